@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <mutex>
 #include <limits>
+#include "RLBox_SandboxMemory.h"
 
 namespace RLBox_DynLib_detail {
 	//https://stackoverflow.com/questions/6512019/can-we-get-the-type-of-a-lambda-argument
@@ -35,9 +36,9 @@ private:
 	static thread_local RLBox_DynLib* dynLib_SavedState;
 	std::mutex callbackMutex;
 	static const unsigned int CALLBACK_SLOT_COUNT = 32;
-	void* allowedFunctions[CALLBACK_SLOT_COUNT];
-	void* functionState[CALLBACK_SLOT_COUNT];
-	void* callbackUniqueKey[CALLBACK_SLOT_COUNT];
+	void* allowedFunctions[CALLBACK_SLOT_COUNT] = {};
+	void* functionState[CALLBACK_SLOT_COUNT] = {};
+	void* callbackUniqueKey[CALLBACK_SLOT_COUNT] = {};
 	void* libHandle = nullptr;
 	int pushPopCount = 0;
 
@@ -69,6 +70,9 @@ private:
 	}
 
 public:
+	static const bool impl_SupportsRealloc;
+	static const bool impl_SupportsFileMapping;
+
 	inline void impl_CreateSandbox(const char* sandboxRuntimePath, const char* libraryPath)
 	{
 		libHandle = dlmopen(LM_ID_NEWLM, libraryPath, RTLD_LAZY);
@@ -104,6 +108,21 @@ public:
 		free(val);
 	}
 
+	inline void* impl_reallocInSandbox(void* val, size_t size)
+	{
+		return realloc(val, size);
+	}
+
+	inline bool impl_MapFileInSandbox(void* addr, size_t size, int fd, off_t offset, bool readOnly)
+	{
+		return RLBox_SandboxMemory::mapFileAt((uintptr_t) addr, size, fd, offset, readOnly);
+	}
+
+	inline void impl_UnmapFileInSandbox(void* addr, size_t size)
+	{
+		RLBox_SandboxMemory::unmapFileAt((uintptr_t) addr, size);
+	}
+
 	inline size_t impl_getTotalMemory()
 	{
 		return std::numeric_limits<size_t>::max();
@@ -213,16 +232,16 @@ public:
 	}
 
 	template <typename T, typename ... TArgs>
-	RLBox_DynLib_detail::return_argument<T> impl_InvokeFunction(T* fnPtr, TArgs... params)
+	RLBox_DynLib_detail::return_argument<T> impl_InvokeFunction(T* fnPtr, TArgs&&... params)
 	{
 		dynLib_SavedState = this;
-		return (*fnPtr)(params...);
+		return (*fnPtr)(std::forward<TArgs>(params)...);
 	}
 
 	template <typename T, typename ... TArgs>
-	RLBox_DynLib_detail::return_argument<T> impl_InvokeFunctionReturnAppPtr(T* fnPtr, TArgs... params)
+	RLBox_DynLib_detail::return_argument<T> impl_InvokeFunctionReturnAppPtr(T* fnPtr, TArgs&&... params)
 	{
-		return impl_InvokeFunction(fnPtr, params...);
+		return impl_InvokeFunction(fnPtr, std::forward<TArgs>(params)...);
 	}
 };
 
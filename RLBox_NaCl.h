@@ -11,6 +11,7 @@
 #include <vector>
 #include <algorithm>
 #include "dyn_ldr_lib.h"
+#include "RLBox_SandboxMemory.h"
 
 namespace RLBox_NaCl_detail {
 	//https://stackoverflow.com/questions/6512019/can-we-get-the-type-of-a-lambda-argument
@@ -68,6 +69,9 @@ private:
 	NaClSandbox* sandbox;
 	static std::once_flag initFlag;
 	std::mutex createAndCallbackMutex;
+	//registrations only touch this sandbox's callback slots, so they don't need to wait for sandbox creation
+	std::mutex callbackMutex;
+	RLBox_SandboxMemory::MemorySnapshot memorySnapshot;
 	#if defined(_M_IX86) || defined(__i386__)
 		static std::mutex sandboxListMutex;
 		static std::vector<NaClSandbox*> sandboxList;
@@ -76,19 +80,18 @@ private:
 	class NaClSandboxStateWrapper
 	{
 	public:
-		void* originalState;
-		void* fnPtr;
-		unsigned slotNumber;
-
-		NaClSandboxStateWrapper(void* originalState, void* fnPtr, unsigned slotNumber)
-		{
-			this->originalState = originalState;
-			this->fnPtr = fnPtr;
-			this->slotNumber = slotNumber;
-		}
+		//null for free slots
+		void* key = nullptr;
+		void* originalState = nullptr;
+		void* fnPtr = nullptr;
+		unsigned slotNumber = 0;
 	};
 
-	std::map<void*, NaClSandboxStateWrapper*> callbackSlotInfo;
+	//indexed by the runtime's callback slot number. The runtime's slot count is not exposed,
+	//so slots past the array are kept in a map of separately allocated wrappers
+	static const unsigned int CALLBACK_SLOT_COUNT = 32;
+	NaClSandboxStateWrapper callbackSlotInfo[CALLBACK_SLOT_COUNT];
+	std::map<void*, NaClSandboxStateWrapper*> overflowCallbackSlotInfo;
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -167,13 +170,13 @@ private:
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 	template<typename... T>
-	inline size_t sandbox_NaClAddParams(T... arg)
+	inline size_t sandbox_NaClAddParams(const T&... arg)
 	{
 			return 0;
 	}
 
 	template <typename T, typename ... Targs>
-	inline size_t sandbox_NaClAddParams(T arg, Targs... rem)
+	inline size_t sandbox_NaClAddParams(const T& arg, const Targs&... rem)
 	{
 		return sizeof(arg) + sandbox_NaClAddParams(rem...);
 	}
@@ -198,13 +201,13 @@ private:
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 	template <typename T, ENABLE_IF(!std::is_floating_point<T>::value)>
-	inline void sandbox_handleNaClArg(NaClSandbox_Thread* threadData, T arg)
+	inline void sandbox_handleNaClArg(NaClSandbox_Thread* threadData, const T& arg)
 	{
 		PUSH_VAL_TO_STACK(threadData, T, arg);
 	}
 
 	template <typename T, ENABLE_IF(std::is_floating_point<T>::value)>
-	inline void sandbox_handleNaClArg(NaClSandbox_Thread* threadData, T arg)
+	inline void sandbox_handleNaClArg(NaClSandbox_Thread* threadData, const T& arg)
 	{
 		PUSH_FLOAT_TO_STACK(threadData, T, arg);
 	}
@@ -249,12 +252,25 @@ private:
 	}
 
 
+	//arguments that already have the parameter's type are pushed without making a copy
+	template <typename TFuncArg, typename TArg, ENABLE_IF(std::is_same<TFuncArg, typename std::decay<TArg>::type>::value)>
+	inline const TFuncArg& sandbox_convertNaClArg(const TArg& arg)
+	{
+		return arg;
+	}
+
+	template <typename TFuncArg, typename TArg, ENABLE_IF(!std::is_same<TFuncArg, typename std::decay<TArg>::type>::value)>
+	inline TFuncArg sandbox_convertNaClArg(const TArg& arg)
+	{
+		return (TFuncArg) arg;
+	}
+
 	template <typename TFuncRet, typename TFuncArg, typename... TFuncArgs, typename TArg, typename ... TArgs>
-	inline void sandbox_dealWithNaClArgs(NaClSandbox_Thread* threadData, TFuncRet(*fnPtr)(TFuncArg, TFuncArgs...), TArg param, TArgs... params)
+	inline void sandbox_dealWithNaClArgs(NaClSandbox_Thread* threadData, TFuncRet(*fnPtr)(TFuncArg, TFuncArgs...), TArg&& param, TArgs&&... params)
 	{
-		sandbox_handleNaClArg(threadData, (TFuncArg) param);
+		sandbox_handleNaClArg<TFuncArg>(threadData, sandbox_convertNaClArg<TFuncArg>(param));
 		using TRemFuncType = TFuncRet(*)(TFuncArgs...);
-		sandbox_dealWithNaClArgs(threadData, (TRemFuncType) nullptr, params...);
+		sandbox_dealWithNaClArgs(threadData, (TRemFuncType) nullptr, std::forward<TArgs>(params)...);
 	}
 
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -319,6 +335,13 @@ private:
 	////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 public:
+	static const bool impl_SupportsSnapshot;
+	static const bool impl_SupportsMemoryTrim;
+	static const bool impl_SupportsMemoryOptions;
+	static const bool impl_SupportsClone;
+	static const bool impl_SupportsInvokeInto;
+	static const bool impl_SupportsFileMapping;
+
 	inline void impl_CreateSandbox(const char* sandboxRuntimePath, const char* libraryPath)
 	{
 		std::call_once(initFlag, [](){ initializeDlSandboxCreator(0 /* No logging */); });
@@ -375,6 +398,67 @@ public:
 		return memSize;
 	}
 
+	//The caller must ensure no sandbox functions are running
+	inline bool impl_SnapshotMemory()
+	{
+		return memorySnapshot.create(getSandboxMemoryBase(sandbox), impl_getTotalMemory() + 1);
+	}
+
+	inline bool impl_RestoreMemory()
+	{
+		return memorySnapshot.restore();
+	}
+
+	inline bool impl_CloneMemoryFrom(RLBox_NaCl* templateSandbox)
+	{
+		return templateSandbox->memorySnapshot.cloneInto(memorySnapshot, getSandboxMemoryBase(sandbox), impl_getTotalMemory() + 1)
+			&& memorySnapshot.restore();
+	}
+
+	//Returns whether huge pages could be enabled
+	inline bool impl_PrepareMemory(bool useHugePages, size_t prefaultSize)
+	{
+		const uintptr_t base = getSandboxMemoryBase(sandbox);
+		const size_t size = impl_getTotalMemory() + 1;
+		bool ret = useHugePages && RLBox_SandboxMemory::adviseHugePages(base, size);
+		RLBox_SandboxMemory::prefault(base, size, prefaultSize);
+		return ret;
+	}
+
+	//Runs the library's rlbox_malloc_trim, which shrinks the heap and lets the runtime release the pages above it
+	//Returns false if the library does not export it. The caller must ensure no sandbox functions are running
+	inline bool impl_TrimMemory()
+	{
+		auto trimFn = (int(*)(size_t)) symbolTableLookupInSandbox(sandbox, "rlbox_malloc_trim");
+		if(!trimFn)
+		{
+			return false;
+		}
+		impl_InvokeFunction(trimFn, (size_t) 0 /* pad */);
+		return true;
+	}
+
+	inline size_t impl_getResidentMemory()
+	{
+		return RLBox_SandboxMemory::getResidentMemory(getSandboxMemoryBase(sandbox), impl_getTotalMemory() + 1);
+	}
+
+	//addr is an unsandboxed pointer to memory the sandbox no longer uses
+	inline void impl_ReleaseUnusedPages(void* addr, size_t size)
+	{
+		RLBox_SandboxMemory::releaseUnusedPages((uintptr_t) addr, ((uintptr_t) addr) + size);
+	}
+
+	inline bool impl_MapFileInSandbox(void* addr, size_t size, int fd, off_t offset, bool readOnly)
+	{
+		return RLBox_SandboxMemory::mapFileAt((uintptr_t) addr, size, fd, offset, readOnly);
+	}
+
+	inline void impl_UnmapFileInSandbox(void* addr, size_t size)
+	{
+		RLBox_SandboxMemory::unmapFileAt((uintptr_t) addr, size);
+	}
+
 	inline char* impl_getMaxPointer()
 	{
 		#if defined(_M_IX86) || defined(__i386__)
@@ -543,7 +627,7 @@ public:
 	template<typename TRet, typename... TArgs>
 	inline void* impl_RegisterCallback(void* key, void* callback, void* state)
 	{
-		std::lock_guard<std::mutex> lock(createAndCallbackMutex);
+		std::lock_guard<std::mutex> lock(callbackMutex);
 
 		unsigned slotNumber;
 		if(!getFreeSandboxCallbackSlot(sandbox, &slotNumber))
@@ -551,21 +635,43 @@ public:
 			return nullptr;
 		}
 
-		auto stateWrapper = new NaClSandboxStateWrapper(state, callback, slotNumber);
-		callbackSlotInfo[key] = stateWrapper;
+		NaClSandboxStateWrapper* stateWrapper;
+		if(slotNumber < CALLBACK_SLOT_COUNT)
+		{
+			stateWrapper = &callbackSlotInfo[slotNumber];
+		}
+		else
+		{
+			stateWrapper = new NaClSandboxStateWrapper();
+			overflowCallbackSlotInfo[key] = stateWrapper;
+		}
+		stateWrapper->key = key;
+		stateWrapper->slotNumber = slotNumber;
+		stateWrapper->originalState = state;
+		stateWrapper->fnPtr = callback;
 		return (void*) registerSandboxCallbackWithState(sandbox, slotNumber, (uintptr_t) impl_CallbackReceiver<TRet, TArgs...>, (void*) stateWrapper);
 	}
 
 	template<typename TFunc>
 	inline void impl_UnregisterCallback(void* key)
 	{
-		std::lock_guard<std::mutex> lock(createAndCallbackMutex);
+		std::lock_guard<std::mutex> lock(callbackMutex);
+
+		for(unsigned int i = 0; i < CALLBACK_SLOT_COUNT; i++)
+		{
+			if(callbackSlotInfo[i].key == key)
+			{
+				unregisterSandboxCallback(sandbox, i);
+				callbackSlotInfo[i] = NaClSandboxStateWrapper();
+				return;
+			}
+		}
 
-		auto it = callbackSlotInfo.find(key);
-		if(it != callbackSlotInfo.end())
+		auto it = overflowCallbackSlotInfo.find(key);
+		if(it != overflowCallbackSlotInfo.end())
 		{
 			NaClSandboxStateWrapper* slotInfo = it->second;
-			callbackSlotInfo.erase(it);
+			overflowCallbackSlotInfo.erase(it);
 			unregisterSandboxCallback(sandbox, slotInfo->slotNumber);
 			delete slotInfo;
 		}
@@ -583,21 +689,32 @@ public:
 	}
 
 	template <typename T, typename ... TArgs>
-	RLBox_NaCl_detail::return_argument<T> impl_InvokeFunction(T* fnPtr, TArgs... params)
+	RLBox_NaCl_detail::return_argument<T> impl_InvokeFunction(T* fnPtr, TArgs&&... params)
 	{
 		NaClSandbox_Thread* threadData = preFunctionCall(sandbox, sandbox_NaClAddParams(params...) + sandbox_NaClAddReturnArg<RLBox_NaCl_detail::return_argument<T>>(), 0 /* size of any arrays being pushed on the stack */);
 		auto returnPtrSlot = sandbox_dealWithNaClReturnArg<RLBox_NaCl_detail::return_argument<T>>(threadData);
-		sandbox_dealWithNaClArgs(threadData, fnPtr, params...);
+		sandbox_dealWithNaClArgs(threadData, fnPtr, std::forward<TArgs>(params)...);
 		invokeFunctionCall(threadData, (void*)(uintptr_t) fnPtr);
 		return sandbox_invokeNaClReturn<T>(threadData, returnPtrSlot);
 	}
 
+	//dest is in sandbox memory; the library writes the struct through the hidden return pointer, so we point that
+	//at dest rather than at a slot on the sandbox stack
+	template <typename T, typename ... TArgs>
+	void impl_InvokeFunctionInto(void* dest, T* fnPtr, TArgs&&... params)
+	{
+		NaClSandbox_Thread* threadData = preFunctionCall(sandbox, sandbox_NaClAddParams(params...) + sizeof(void*), 0 /* size of any arrays being pushed on the stack */);
+		sandbox_handleNaClArg(threadData, impl_GetSandboxedPointer(dest));
+		sandbox_dealWithNaClArgs(threadData, fnPtr, std::forward<TArgs>(params)...);
+		invokeFunctionCall(threadData, (void*)(uintptr_t) fnPtr);
+	}
+
 	template <typename T, typename ... TArgs>
-	RLBox_NaCl_detail::return_argument<T> impl_InvokeFunctionReturnAppPtr(T* fnPtr, TArgs... params)
+	RLBox_NaCl_detail::return_argument<T> impl_InvokeFunctionReturnAppPtr(T* fnPtr, TArgs&&... params)
 	{
 		NaClSandbox_Thread* threadData = preFunctionCall(sandbox, sandbox_NaClAddParams(params...) + sandbox_NaClAddReturnArg<RLBox_NaCl_detail::return_argument<T>>(), 0 /* size of any arrays being pushed on the stack */);
 		sandbox_dealWithNaClReturnArg<RLBox_NaCl_detail::return_argument<T>>(threadData);
-		sandbox_dealWithNaClArgs(threadData, fnPtr, params...);
+		sandbox_dealWithNaClArgs(threadData, fnPtr, std::forward<TArgs>(params)...);
 		invokeFunctionCall(threadData, (void*)(uintptr_t) fnPtr);
 		auto ret = (uintptr_t) functionCallReturnRawPrimitiveInt(threadData);
 		return (RLBox_NaCl_detail::return_argument<T>) ret;
@@ -6,11 +6,28 @@
 #include <stdio.h>
 #include <utility>
 #include <stdint.h>
+#include <string.h>
+#include <limits.h>
 #include <mutex>
 #include <limits>
 #include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <future>
+#include <chrono>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include "ProcessSandbox.h"
+#include "RLBox_SandboxMemory.h"
 
 namespace RLBox_Process_detail {
 	//https://stackoverflow.com/questions/6512019/can-we-get-the-type-of-a-lambda-argument
@@ -34,21 +51,350 @@ namespace RLBox_Process_detail {
 
 	template <typename TProcSandbox, typename T>
 	using injectSandboxParamInFnType = decltype(injectSandboxParamInFnType_helper<TProcSandbox>(std::declval<T>()));
+
+	//ProcessSandbox does not expose the pid of the process it spawns, so we find it ourselves
+	//The sandbox process is a direct child of ours running the "otherside" binary given as the library path
+	inline pid_t findUnclaimedChildPid(const char* libraryPath, const std::set<pid_t>& claimedPids)
+	{
+		char expectedExe[PATH_MAX];
+		if(!realpath(libraryPath, expectedExe))
+		{
+			return 0;
+		}
+
+		DIR* procDir = opendir("/proc");
+		if(!procDir)
+		{
+			return 0;
+		}
+
+		pid_t ret = 0;
+		const pid_t self = getpid();
+		for(struct dirent* entry = readdir(procDir); entry != nullptr && ret == 0; entry = readdir(procDir))
+		{
+			char* end;
+			pid_t pid = (pid_t) strtol(entry->d_name, &end, 10);
+			if(*end != '\0' || pid <= 0 || claimedPids.count(pid) != 0)
+			{
+				continue;
+			}
+
+			char path[64];
+			snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+			FILE* statFile = fopen(path, "r");
+			if(!statFile)
+			{
+				continue;
+			}
+			//the command name may contain spaces, so skip to the last ')' before reading the ppid
+			char statLine[512];
+			size_t len = fread(statLine, 1, sizeof(statLine) - 1, statFile);
+			fclose(statFile);
+			statLine[len] = '\0';
+			const char* commEnd = strrchr(statLine, ')');
+			int ppid = 0;
+			if(!commEnd || sscanf(commEnd + 1, " %*c %d", &ppid) != 1 || ppid != self)
+			{
+				continue;
+			}
+
+			char exe[PATH_MAX];
+			snprintf(path, sizeof(path), "/proc/%d/exe", (int) pid);
+			ssize_t exeLen = readlink(path, exe, sizeof(exe) - 1);
+			if(exeLen <= 0)
+			{
+				continue;
+			}
+			exe[exeLen] = '\0';
+			if(strcmp(exe, expectedExe) == 0)
+			{
+				ret = pid;
+			}
+		}
+		closedir(procDir);
+		return ret;
+	}
+
+	//Work handed from one thread to another, a call into a sandbox process or a callback made during one
+	class InvokeTask
+	{
+	public:
+		std::function<void()> fn;
+		bool started = false;
+		bool finished = false;
+	};
+
+	//Makes the calls into sandbox processes for one nesting level of one application thread, so that the application
+	//thread can stop waiting for a call whose process died. The process sandbox would otherwise wait forever for the answer
+	//Callbacks made during a call arrive on the worker, so they are handed back to the application thread waiting for it
+	class InvokeWorker
+	{
+	private:
+		std::mutex workerMutex;
+		std::condition_variable changed;
+		std::shared_ptr<InvokeTask> call;
+		std::shared_ptr<InvokeTask> callback;
+		bool stopping = false;
+		//only used by the application thread
+		bool lost = false;
+
+		static InvokeWorker*& currentWorker()
+		{
+			static thread_local InvokeWorker* worker = nullptr;
+			return worker;
+		}
+
+		//The process stays a zombie, so that it is still reaped by isSandboxProcessAlive
+		static bool isProcessDead(pid_t pid)
+		{
+			siginfo_t info;
+			info.si_pid = 0;
+			return waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid != 0;
+		}
+
+		void run()
+		{
+			currentWorker() = this;
+			std::unique_lock<std::mutex> lock(workerMutex);
+			for(;;)
+			{
+				changed.wait(lock, [this]() { return stopping || (call && !call->started); });
+				if(stopping)
+				{
+					return;
+				}
+				std::shared_ptr<InvokeTask> task = call;
+				task->started = true;
+				lock.unlock();
+				task->fn();
+				lock.lock();
+				task->finished = true;
+				changed.notify_all();
+			}
+		}
+
+	public:
+		static std::shared_ptr<InvokeWorker> start()
+		{
+			auto worker = std::make_shared<InvokeWorker>();
+			std::thread([worker]() { worker->run(); }).detach();
+			return worker;
+		}
+
+		void stop()
+		{
+			std::lock_guard<std::mutex> lock(workerMutex);
+			stopping = true;
+			changed.notify_all();
+		}
+
+		//Set when the worker was left blocked in a call to a dead process, after which it can't be used again
+		bool isLost()
+		{
+			return lost;
+		}
+
+		//Runs fn on the worker and returns false if the process pid died before fn returned
+		//fn must not refer to the caller's frames once the call is in progress, as it may outlive them
+		bool invoke(pid_t pid, std::function<void()> fn)
+		{
+			auto task = std::make_shared<InvokeTask>();
+			task->fn = std::move(fn);
+			std::unique_lock<std::mutex> lock(workerMutex);
+			call = task;
+			changed.notify_all();
+			while(!task->finished)
+			{
+				if(callback && !callback->started)
+				{
+					std::shared_ptr<InvokeTask> callbackTask = callback;
+					callbackTask->started = true;
+					lock.unlock();
+					callbackTask->fn();
+					lock.lock();
+					callbackTask->finished = true;
+					changed.notify_all();
+				}
+				else if(changed.wait_for(lock, std::chrono::milliseconds(10)) == std::cv_status::timeout && isProcessDead(pid))
+				{
+					//a call the worker has not picked up yet is simply withdrawn
+					if(task->started)
+					{
+						lost = true;
+					}
+					else
+					{
+						call = nullptr;
+					}
+					return false;
+				}
+			}
+			call = nullptr;
+			return true;
+		}
+
+		//Runs fn on the application thread waiting for the call this thread is making, if this thread is a worker
+		static bool invokeCallback(std::function<void()> fn)
+		{
+			InvokeWorker* worker = currentWorker();
+			if(!worker)
+			{
+				return false;
+			}
+			auto task = std::make_shared<InvokeTask>();
+			task->fn = std::move(fn);
+			std::unique_lock<std::mutex> lock(worker->workerMutex);
+			worker->callback = task;
+			worker->changed.notify_all();
+			worker->changed.wait(lock, [&task]() { return task->finished; });
+			worker->callback = nullptr;
+			return true;
+		}
+	};
+
+	//The workers of an application thread, one for each level of calls nested in callbacks
+	class InvokeWorkers
+	{
+	public:
+		std::vector<std::shared_ptr<InvokeWorker>> workers;
+		size_t depth = 0;
+
+		~InvokeWorkers()
+		{
+			for(auto& worker : workers)
+			{
+				if(worker)
+				{
+					worker->stop();
+				}
+			}
+		}
+	};
+
+	inline InvokeWorkers& currentInvokeWorkers()
+	{
+		static thread_local InvokeWorkers workers;
+		return workers;
+	}
+
+	//Runs fn, which calls into the sandbox process pid, and returns false if the process died before fn returned
+	//In that case the worker running fn stays blocked in the call forever, and a new one is used for later calls
+	template<typename TFunc>
+	inline bool callWatched(pid_t pid, TFunc&& fn)
+	{
+		if(pid == 0)
+		{
+			//we can't tell when a process we could not find dies
+			fn();
+			return true;
+		}
+
+		InvokeWorkers& state = currentInvokeWorkers();
+		const size_t depth = state.depth;
+		if(state.workers.size() <= depth)
+		{
+			state.workers.resize(depth + 1);
+		}
+		if(!state.workers[depth])
+		{
+			state.workers[depth] = InvokeWorker::start();
+		}
+		std::shared_ptr<InvokeWorker> worker = state.workers[depth];
+		state.depth++;
+		bool completed = worker->invoke(pid, std::forward<TFunc>(fn));
+		state.depth--;
+		if(worker->isLost())
+		{
+			state.workers[depth] = nullptr;
+		}
+		return completed;
+	}
+
+	template<typename TRet, typename... TArgs>
+	class CallbackTrampolineState
+	{
+	public:
+		TRet(*receiver)(TArgs..., void*);
+		void* state;
+	};
+
+	//Registered with the process sandbox in place of the receiver, so that callbacks run on the thread that made the call
+	template<typename TRet, typename... TArgs>
+	class CallbackTrampoline
+	{
+	public:
+		template<typename T = TRet>
+		static typename std::enable_if<std::is_void<T>::value>::type call(TArgs... params, void* trampolineState)
+		{
+			auto state = (CallbackTrampolineState<TRet, TArgs...>*) trampolineState;
+			if(!InvokeWorker::invokeCallback([&]() { state->receiver(params..., state->state); }))
+			{
+				state->receiver(params..., state->state);
+			}
+		}
+
+		template<typename T = TRet>
+		static typename std::enable_if<!std::is_void<T>::value, T>::type call(TArgs... params, void* trampolineState)
+		{
+			auto state = (CallbackTrampolineState<TRet, TArgs...>*) trampolineState;
+			TRet ret = TRet();
+			if(!InvokeWorker::invokeCallback([&]() { ret = state->receiver(params..., state->state); }))
+			{
+				ret = state->receiver(params..., state->state);
+			}
+			return ret;
+		}
+	};
 };
 
 #define ENABLE_IF(...) typename std::enable_if<__VA_ARGS__>::type* = nullptr
 
+class RLBox_Process_RestartStats
+{
+public:
+	unsigned long restarts = 0;
+	std::chrono::nanoseconds lastRecoveryTime{0};
+	std::chrono::nanoseconds maxRecoveryTime{0};
+	std::chrono::nanoseconds totalRecoveryTime{0};
+};
+
 template<typename TProcSandbox>
 class RLBox_Process
 {
 private:
+	class SpawnedSandbox
+	{
+	public:
+		TProcSandbox* sandbox = nullptr;
+		pid_t pid = 0;
+	};
+
+	class RegisteredCallback
+	{
+	public:
+		void* callback = nullptr;
+		//the CallbackTrampolineState the callback was registered with
+		std::shared_ptr<void> trampolineState;
+	};
+
 	static thread_local RLBox_Process* dynLib_SavedState;
 	static std::mutex sandboxListMutex;
 	static std::vector<TProcSandbox*> sandboxList;
+	static std::mutex spawnMutex;
+	static std::set<pid_t> claimedPids;
 	std::mutex callbackMutex;
-	std::map<void*, void*> callbackKVMap;
+	std::map<void*, RegisteredCallback> callbackKVMap;
 	void* libHandle = nullptr;
 	TProcSandbox* procSandbox = nullptr;
+	pid_t procSandboxPid = 0;
+	std::string libraryPathCopy;
+	std::future<SpawnedSandbox> spareSandbox;
+	bool keepWarmSpare = false;
+	std::mutex restartMutex;
+	RLBox_Process_RestartStats restartStats;
+	std::atomic<unsigned long> restartCount{0};
+	//status of the last invoke on this sandbox, from whichever thread made it
+	std::atomic<bool> sandboxDiedInLastInvoke{false};
 	int pushPopCount = 0;
 
 	static inline size_t getTotalMemoryHelper()
@@ -61,7 +407,160 @@ private:
 			#error Unsupported platform!
 		#endif
 	}
+
+	static SpawnedSandbox spawnSandbox(const std::string& libraryPath)
+	{
+		//Serialize spawns so that we attribute each new child process to the right sandbox
+		std::lock_guard<std::mutex> lock(spawnMutex);
+		SpawnedSandbox ret;
+		ret.sandbox = new TProcSandbox(libraryPath.c_str(), 9999 /* maincore: special marker for don't change */, 3 /* sbox_process_core */);
+		ret.pid = RLBox_Process_detail::findUnclaimedChildPid(libraryPath.c_str(), claimedPids);
+		if(ret.pid != 0)
+		{
+			claimedPids.insert(ret.pid);
+		}
+		return ret;
+	}
+
+	static void releasePid(pid_t pid)
+	{
+		if(pid != 0)
+		{
+			std::lock_guard<std::mutex> lock(spawnMutex);
+			claimedPids.erase(pid);
+		}
+	}
+
+	//If we could not find the pid of the sandbox process, we can't detect crashes and assume it is alive
+	static inline bool isSandboxProcessAlive(pid_t pid)
+	{
+		if(pid == 0)
+		{
+			return true;
+		}
+		int status;
+		return waitpid(pid, &status, WNOHANG) == 0;
+	}
+
+	inline void startSpareSandbox()
+	{
+		std::string libraryPath = libraryPathCopy;
+		spareSandbox = std::async(std::launch::async, [libraryPath]() { return spawnSandbox(libraryPath); });
+	}
+
+	//Swaps a dead sandbox process for the warm spare if there is a live one, or for a newly started process otherwise
+	//All sandbox memory, callbacks and sandbox function pointers of the dead process are lost
+	void replaceDeadSandbox(TProcSandbox* deadSandbox)
+	{
+		std::lock_guard<std::mutex> lock(restartMutex);
+		if(procSandbox != deadSandbox)
+		{
+			//another thread already replaced this sandbox
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		SpawnedSandbox replacement;
+		if(spareSandbox.valid())
+		{
+			replacement = spareSandbox.get();
+			if(!isSandboxProcessAlive(replacement.pid))
+			{
+				//a spare that died while idle is abandoned like the dead sandbox
+				releasePid(replacement.pid);
+				replacement = SpawnedSandbox();
+			}
+		}
+		if(replacement.sandbox == nullptr)
+		{
+			replacement = spawnSandbox(libraryPathCopy);
+		}
+		{
+			std::lock_guard<std::mutex> lock(sandboxListMutex);
+			std::replace(sandboxList.begin(), sandboxList.end(), deadSandbox, replacement.sandbox);
+		}
+		{
+			std::lock_guard<std::mutex> lock(callbackMutex);
+			callbackKVMap.clear();
+		}
+		releasePid(procSandboxPid);
+		//The dead sandbox object is intentionally not destroyed, as its teardown would try to talk to the dead process
+		procSandbox = replacement.sandbox;
+		procSandboxPid = replacement.pid;
+		pushPopCount = 0;
+		if(keepWarmSpare)
+		{
+			startSpareSandbox();
+		}
+		restartCount++;
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+		restartStats.restarts++;
+		restartStats.lastRecoveryTime = elapsed;
+		restartStats.totalRecoveryTime += elapsed;
+		restartStats.maxRecoveryTime = std::max(restartStats.maxRecoveryTime, elapsed);
+	}
+
+	//Returns false and recovers if the sandbox process has died
+	inline bool checkSandboxAlive(TProcSandbox* currSandbox, pid_t currPid)
+	{
+		if(isSandboxProcessAlive(currPid))
+		{
+			return true;
+		}
+		replaceDeadSandbox(currSandbox);
+		return false;
+	}
+
+	template <typename T, typename ... TArgs, ENABLE_IF(std::is_void<RLBox_Process_detail::return_argument<T>>::value)>
+	RLBox_Process_detail::return_argument<T> invokeAndCheck(T* fnPtr, TArgs&&... params)
+	{
+		auto castPointer = (RLBox_Process_detail::injectSandboxParamInFnType<TProcSandbox, T*>) (uintptr_t) fnPtr;
+		TProcSandbox* currSandbox = procSandbox;
+		pid_t currPid = procSandboxPid;
+		if(!checkSandboxAlive(currSandbox, currPid))
+		{
+			sandboxDiedInLastInvoke = true;
+			return;
+		}
+		dynLib_SavedState = this;
+		//the parameters are only read before the call starts, so the lambda may outlive them if the process dies
+		bool completed = RLBox_Process_detail::callWatched(currPid, [&, castPointer, currSandbox]() {
+			(*castPointer)(currSandbox, std::forward<TArgs>(params)...);
+		});
+		bool alive = checkSandboxAlive(currSandbox, currPid);
+		sandboxDiedInLastInvoke = !completed || !alive;
+	}
+
+	template <typename T, typename ... TArgs, ENABLE_IF(!std::is_void<RLBox_Process_detail::return_argument<T>>::value)>
+	RLBox_Process_detail::return_argument<T> invokeAndCheck(T* fnPtr, TArgs&&... params)
+	{
+		auto castPointer = (RLBox_Process_detail::injectSandboxParamInFnType<TProcSandbox, T*>) (uintptr_t) fnPtr;
+		TProcSandbox* currSandbox = procSandbox;
+		pid_t currPid = procSandboxPid;
+		if(!checkSandboxAlive(currSandbox, currPid))
+		{
+			sandboxDiedInLastInvoke = true;
+			return RLBox_Process_detail::return_argument<T>();
+		}
+		dynLib_SavedState = this;
+		//a call abandoned because the process died may still return later, so the result is not on our stack
+		auto ret = std::make_shared<RLBox_Process_detail::return_argument<T>>();
+		bool completed = RLBox_Process_detail::callWatched(currPid, [&, castPointer, currSandbox, ret]() {
+			*ret = (*castPointer)(currSandbox, std::forward<TArgs>(params)...);
+		});
+		bool alive = checkSandboxAlive(currSandbox, currPid);
+		const bool died = !completed || !alive;
+		sandboxDiedInLastInvoke = died;
+		//don't hand out values produced by a sandbox that crashed while computing them
+		return died? RLBox_Process_detail::return_argument<T>() : *ret;
+	}
+
 public:
+	static const bool impl_SupportsRestart;
+	static const bool impl_SupportsMemoryTrim;
+	static const bool impl_SupportsMemoryOptions;
+
 	inline void impl_CreateSandbox(const char* sandboxRuntimePath, const char* libraryPath)
 	{
 		//dlopen with null pointer points to the current app
@@ -71,16 +570,59 @@ public:
 			printf("Could not open symbol table of my app\n");
 			abort();
 		}
-		procSandbox = new TProcSandbox(libraryPath, 9999 /* maincore: special marker for don't change */, 3 /* sbox_process_core */);
+		libraryPathCopy = libraryPath;
+		SpawnedSandbox spawned = spawnSandbox(libraryPathCopy);
+		procSandbox = spawned.sandbox;
+		procSandboxPid = spawned.pid;
 		std::lock_guard<std::mutex> lock(sandboxListMutex);
 		sandboxList.push_back(procSandbox);
 	}
 
 	inline void impl_DestroySandbox()
 	{
-		std::lock_guard<std::mutex> lock(sandboxListMutex);
-		sandboxList.erase(std::remove(sandboxList.begin(), sandboxList.end(), procSandbox), sandboxList.end());
+		{
+			std::lock_guard<std::mutex> lock(sandboxListMutex);
+			sandboxList.erase(std::remove(sandboxList.begin(), sandboxList.end(), procSandbox), sandboxList.end());
+		}
+		impl_SetWarmSpare(false);
 		procSandbox->destroySandbox();
+		releasePid(procSandboxPid);
+	}
+
+	inline void impl_SetWarmSpare(bool enable)
+	{
+		std::lock_guard<std::mutex> lock(restartMutex);
+		keepWarmSpare = enable;
+		if(enable && !spareSandbox.valid())
+		{
+			startSpareSandbox();
+		}
+		else if(!enable && spareSandbox.valid())
+		{
+			SpawnedSandbox spare = spareSandbox.get();
+			if(isSandboxProcessAlive(spare.pid))
+			{
+				spare.sandbox->destroySandbox();
+			}
+			releasePid(spare.pid);
+		}
+	}
+
+	inline bool impl_sandboxDiedInLastInvoke()
+	{
+		return sandboxDiedInLastInvoke;
+	}
+
+	//Incremented every time the sandbox process is replaced
+	inline unsigned long impl_getRestartCount()
+	{
+		return restartCount;
+	}
+
+	inline RLBox_Process_RestartStats impl_getRestartStats()
+	{
+		std::lock_guard<std::mutex> lock(restartMutex);
+		return restartStats;
 	}
 
 	inline TProcSandbox* impl_getSandbox()
@@ -104,6 +646,44 @@ public:
 		return getTotalMemoryHelper();
 	}
 
+	//Snapshots and clones are not supported, as the library's globals and stack live in the sandbox process' own memory
+	//which we can't reach, so restoring just the shared region would leave the library in an inconsistent state
+
+	//Returns whether huge pages could be enabled
+	inline bool impl_PrepareMemory(bool useHugePages, size_t prefaultSize)
+	{
+		std::lock_guard<std::mutex> lock(restartMutex);
+		const uintptr_t base = (uintptr_t) procSandbox->getSandboxMemoryBase();
+		const size_t size = getTotalMemoryHelper();
+		bool ret = useHugePages && RLBox_SandboxMemory::adviseHugePages(base, size);
+		RLBox_SandboxMemory::prefault(base, size, prefaultSize);
+		return ret;
+	}
+
+	//Runs the library's rlbox_malloc_trim in the sandbox process, through the stub generated for it like any other
+	//library function. Returns false if there is none. The caller must ensure no sandbox functions are running
+	inline bool impl_TrimMemory()
+	{
+		auto trimFn = (int(*)(size_t)) dlsym(libHandle, "ProcessSandbox_rlbox_malloc_trim");
+		if(!trimFn)
+		{
+			return false;
+		}
+		invokeAndCheck(trimFn, (size_t) 0 /* pad */);
+		return !sandboxDiedInLastInvoke;
+	}
+
+	inline size_t impl_getResidentMemory()
+	{
+		return RLBox_SandboxMemory::getResidentMemory((uintptr_t) procSandbox->getSandboxMemoryBase(), getTotalMemoryHelper());
+	}
+
+	//addr is an unsandboxed pointer to memory the sandbox no longer uses
+	inline void impl_ReleaseUnusedPages(void* addr, size_t size)
+	{
+		RLBox_SandboxMemory::releaseUnusedPages((uintptr_t) addr, ((uintptr_t) addr) + size);
+	}
+
 	inline char* impl_getMaxPointer()
 	{
 		auto base = (uintptr_t) procSandbox->getSandboxMemoryBase();
@@ -211,10 +791,17 @@ public:
 	inline void* impl_RegisterCallback(void* key, void* callback, void* state)
 	{
 		using FuncType = TRet(*)(TArgs...);
-		auto ret = procSandbox->template registerCallback<FuncType>((FuncType)callback, state);
+		auto trampolineState = std::make_shared<RLBox_Process_detail::CallbackTrampolineState<TRet, TArgs...>>();
+		trampolineState->receiver = (TRet(*)(TArgs..., void*)) callback;
+		trampolineState->state = state;
+		auto trampoline = &RLBox_Process_detail::CallbackTrampoline<TRet, TArgs...>::template call<TRet>;
+		auto ret = procSandbox->template registerCallback<FuncType>((FuncType)(uintptr_t)trampoline, trampolineState.get());
+		if(ret)
 		{
 			std::lock_guard<std::mutex> lock(callbackMutex);
-			callbackKVMap[key] =  const_cast<void*>((const void*)ret);
+			RegisteredCallback& registered = callbackKVMap[key];
+			registered.callback = const_cast<void*>((const void*)ret);
+			registered.trampolineState = trampolineState;
 		}
 		return const_cast<void*>((const void*)ret);
 	}
@@ -223,14 +810,18 @@ public:
 	inline void impl_UnregisterCallback(void* key)
 	{
 		void* cb = nullptr;
+		//the trampoline's state must outlive the registration
+		std::shared_ptr<void> trampolineState;
 		{
 			std::lock_guard<std::mutex> lock(callbackMutex);
 			auto iter = callbackKVMap.find(key);
 			if(iter == callbackKVMap.end())
 			{
-				abort();
+				//callbacks registered with a sandbox process that has since crashed are already gone
+				return;
 			}
-			cb = iter->second;
+			cb = iter->second.callback;
+			trampolineState = std::move(iter->second.trampolineState);
 			callbackKVMap.erase(iter);
 		}
 
@@ -251,6 +842,10 @@ public:
 			}
 			return ret;
 		} else {
+			if(!checkSandboxAlive(procSandbox, procSandboxPid))
+			{
+				return nullptr;
+			}
 			size_t len = strlen(name) + 1;
 			auto copiedName = (char*) procSandbox->mallocInSandbox(len);
 			strcpy(copiedName, name);
@@ -261,17 +856,15 @@ public:
 	}
 
 	template <typename T, typename ... TArgs>
-	RLBox_Process_detail::return_argument<T> impl_InvokeFunction(T* fnPtr, TArgs... params)
+	RLBox_Process_detail::return_argument<T> impl_InvokeFunction(T* fnPtr, TArgs&&... params)
 	{
-		auto castPointer = (RLBox_Process_detail::injectSandboxParamInFnType<TProcSandbox, T*>) (uintptr_t) fnPtr;
-		dynLib_SavedState = this;
-		return (*castPointer)(procSandbox, params...);
+		return invokeAndCheck(fnPtr, std::forward<TArgs>(params)...);
 	}
 
 	template <typename T, typename ... TArgs>
-	RLBox_Process_detail::return_argument<T> impl_InvokeFunctionReturnAppPtr(T* fnPtr, TArgs... params)
+	RLBox_Process_detail::return_argument<T> impl_InvokeFunctionReturnAppPtr(T* fnPtr, TArgs&&... params)
 	{
-		return impl_InvokeFunction(fnPtr, params...);
+		return impl_InvokeFunction(fnPtr, std::forward<TArgs>(params)...);
 	}
 };
 
@@ -281,6 +874,12 @@ thread_local RLBox_Process<TProcSandbox>* RLBox_Process<TProcSandbox>::dynLib_Sa
 template<typename TProcSandbox>
 std::mutex RLBox_Process<TProcSandbox>::sandboxListMutex __attribute__((weak));
 
+template<typename TProcSandbox>
+std::mutex RLBox_Process<TProcSandbox>::spawnMutex __attribute__((weak));
+
+template<typename TProcSandbox>
+std::set<pid_t> RLBox_Process<TProcSandbox>::claimedPids __attribute__((weak));
+
 template<typename TProcSandbox>
 std::vector<TProcSandbox*> RLBox_Process<TProcSandbox>::sandboxList __attribute__((weak));
 
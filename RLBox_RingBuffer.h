@@ -0,0 +1,371 @@
+/* -*- mode: C++; tab-width: 2; indent-tabs-mode: t; c-basic-offset: 2 -*- */
+
+#ifndef RLBOX_API_RINGBUFFER
+#define RLBOX_API_RINGBUFFER
+
+//The application's side of the byte rings in rlbox_ring.h
+//Kept out of rlbox.h so that the C names of rlbox_ring.h are only seen by code that uses rings
+
+#include "rlbox.h"
+#include "rlbox_ring.h"
+
+namespace rlbox
+{
+	enum class RLBox_Ring_Direction
+	{
+		TO_SANDBOX,
+		FROM_SANDBOX
+	};
+
+	//A byte ring in sandbox memory for streaming data to or from a library using rlbox_ring.h in one long running call
+	//The application produces into TO_SANDBOX rings and consumes from FROM_SANDBOX rings. The index written by the library
+	//is checked on every use, and a ring whose indices can't be valid is closed and reports isCorrupted
+	//The library gets the ring with get() and a callback from createSignalCallback, and the ring must outlive that call
+	//A ring stops as if closed once the backend replaces a crashed sandbox
+	template <typename TSandbox>
+	class sandbox_ring_buffer
+	{
+	private:
+		RLBoxSandbox<TSandbox>* sandbox;
+		RLBox_Ring_Direction direction;
+		rlbox_ring* ring = nullptr;
+		//our copies of the capacity and of the index we write, as the library can change those in the ring
+		uint32_t capacity = 0;
+		std::atomic<uint32_t> position { 0 };
+		std::atomic<bool> closed { false };
+		std::atomic<bool> corrupted { false };
+		//see getRestartGeneration
+		unsigned long restartGeneration = 0;
+		std::mutex lock;
+		std::condition_variable changed;
+
+		static std::mutex& getRegistryLock()
+		{
+			static std::mutex registryLock;
+			return registryLock;
+		}
+
+		static std::map<rlbox_ring*, sandbox_ring_buffer*>& getRegistry()
+		{
+			static std::map<rlbox_ring*, sandbox_ring_buffer*> registry;
+			return registry;
+		}
+
+		static void onSignal(RLBoxSandbox<TSandbox>* sandbox, tainted<rlbox_ring*, TSandbox> ring, tainted<unsigned, TSandbox> op)
+		{
+			sandbox_ring_buffer* buffer;
+			{
+				std::lock_guard<std::mutex> registryLock(getRegistryLock());
+				auto it = getRegistry().find(ring.UNSAFE_Unverified());
+				if(it == getRegistry().end() || it->second->sandbox != sandbox)
+				{
+					return;
+				}
+				buffer = it->second;
+			}
+			const unsigned opVal = op.UNSAFE_Unverified();
+			if(opVal == RLBOX_RING_WAIT)
+			{
+				if(yieldUntil([buffer]() { return buffer->libraryCanProceed(); }))
+				{
+					return;
+				}
+				std::unique_lock<std::mutex> waitLock(buffer->lock);
+				buffer->changed.wait(waitLock, [buffer]() { return buffer->libraryCanProceed(); });
+			}
+			else if(opVal == RLBOX_RING_NOTIFY)
+			{
+				buffer->notifyAll();
+			}
+		}
+
+		inline uint32_t loadIndex(const uint32_t* index) const
+		{
+			return __atomic_load_n(index, __ATOMIC_SEQ_CST);
+		}
+
+		inline void notifyAll()
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+			}
+			changed.notify_all();
+		}
+
+		//A ring of a sandbox that was replaced since has no library on the other side
+		inline bool isRestarted() const
+		{
+			return restartGeneration != sandbox->getRestartGeneration();
+		}
+
+		inline bool isStopped() const
+		{
+			return closed || corrupted || isRestarted();
+		}
+
+		inline bool libraryCanProceed() const
+		{
+			if(isStopped())
+			{
+				return true;
+			}
+			const uint32_t used = unverifiedUsed();
+			return direction == RLBox_Ring_Direction::TO_SANDBOX? used != 0 : used != capacity;
+		}
+
+		void markCorrupted()
+		{
+			corrupted = true;
+			__atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+			notifyAll();
+		}
+
+		inline void checkDirection(RLBox_Ring_Direction expected, const char* operation) const
+		{
+			if(direction != expected)
+			{
+				printf("sandbox_ring_buffer::%s used on a ring of the other direction\n", operation);
+				abort();
+			}
+		}
+
+		//Bytes in the ring, computed from the index the library writes, which may be larger than the capacity
+		inline uint32_t unverifiedUsed() const
+		{
+			if(direction == RLBox_Ring_Direction::TO_SANDBOX)
+			{
+				return position - loadIndex(&ring->head);
+			}
+			return loadIndex(&ring->tail) - position;
+		}
+
+		//Bytes the application may use next, space for TO_SANDBOX rings and data for FROM_SANDBOX rings
+		size_t available()
+		{
+			if(ring == nullptr || corrupted || isRestarted())
+			{
+				return 0;
+			}
+			const uint32_t used = unverifiedUsed();
+			if(used > capacity)
+			{
+				markCorrupted();
+				return 0;
+			}
+			return direction == RLBox_Ring_Direction::TO_SANDBOX? capacity - used : used;
+		}
+
+		//Whether an application wait should end. A corrupted index ends it too, and is then caught by available()
+		inline bool applicationCanProceed() const
+		{
+			if(isStopped() || loadIndex(&ring->closed))
+			{
+				return true;
+			}
+			const uint32_t used = unverifiedUsed();
+			return direction == RLBox_Ring_Direction::TO_SANDBOX? used != capacity : used != 0;
+		}
+
+		//Gives the other side a few chances to make progress before sleeping, as a wake up costs a context switch
+		//for every notify, which is most of the time for small transfers
+		template<typename TPred>
+		static bool yieldUntil(TPred pred)
+		{
+			for(int i = 0; i < 64; i++)
+			{
+				if(pred())
+				{
+					return true;
+				}
+				std::this_thread::yield();
+			}
+			return false;
+		}
+
+		template<typename TPred>
+		void waitFor(uint32_t* waitingFlag, TPred pred)
+		{
+			if(yieldUntil(pred))
+			{
+				return;
+			}
+			//the flag is set before checking again, so the library either sees it or we see its update
+			__atomic_store_n(waitingFlag, 1, __ATOMIC_SEQ_CST);
+			std::unique_lock<std::mutex> waitLock(lock);
+			while(!pred())
+			{
+				//woken periodically as well, in case the library does not notify
+				changed.wait_for(waitLock, std::chrono::milliseconds(10));
+			}
+			__atomic_store_n(waitingFlag, 0, __ATOMIC_SEQ_CST);
+		}
+
+	public:
+		//capacity must be a power of 2. If the allocation fails, get() is a null pointer and nothing can be transferred
+		sandbox_ring_buffer(RLBoxSandbox<TSandbox>* sandbox, RLBox_Ring_Direction direction, uint32_t capacity) : sandbox(sandbox), direction(direction)
+		{
+			if(capacity == 0 || (capacity & (capacity - 1)) != 0 || capacity > (1u << 31))
+			{
+				printf("Ring capacity %u is not a power of 2\n", capacity);
+				abort();
+			}
+			const size_t size = sizeof(rlbox_ring) + capacity;
+			restartGeneration = sandbox->getRestartGeneration();
+			ring = (rlbox_ring*) sandbox->trackedMallocAlignedInSandbox(size, 64);
+			if(ring == nullptr)
+			{
+				return;
+			}
+			if(!sandbox->isRangeInSandboxMemory(ring, size))
+			{
+				abort();
+			}
+			std::memset((void*) ring, 0, sizeof(rlbox_ring));
+			ring->capacity = capacity;
+			this->capacity = capacity;
+			std::lock_guard<std::mutex> registryLock(getRegistryLock());
+			getRegistry()[ring] = this;
+		}
+
+		sandbox_ring_buffer(const sandbox_ring_buffer&) = delete;
+		sandbox_ring_buffer& operator=(const sandbox_ring_buffer&) = delete;
+
+		~sandbox_ring_buffer()
+		{
+			if(ring != nullptr)
+			{
+				{
+					std::lock_guard<std::mutex> registryLock(getRegistryLock());
+					getRegistry().erase(ring);
+				}
+				if(!isRestarted())
+				{
+					sandbox->trackedFreeInSandbox(ring);
+				}
+			}
+		}
+
+		//The callback the library passes to the rlbox_ring.h functions, shared by all rings of the sandbox
+		static auto createSignalCallback(RLBoxSandbox<TSandbox>* sandbox)
+		{
+			return sandbox->createCallback(onSignal);
+		}
+
+		inline tainted<rlbox_ring*, TSandbox> get() const
+		{
+			return *((tainted<rlbox_ring*, TSandbox>*) &ring);
+		}
+
+		//Copies up to size bytes into a TO_SANDBOX ring without blocking, and returns the number of bytes copied
+		size_t write(const void* src, size_t size)
+		{
+			checkDirection(RLBox_Ring_Direction::TO_SANDBOX, "write");
+			if(ring == nullptr || isStopped() || loadIndex(&ring->closed))
+			{
+				return 0;
+			}
+			const uint32_t count = (uint32_t) std::min(available(), size);
+			if(count == 0)
+			{
+				return 0;
+			}
+			const uint32_t pos = position;
+			const uint32_t offset = pos & (capacity - 1);
+			const uint32_t first = std::min(count, capacity - offset);
+			unsigned char* data = rlbox_ring_data(ring);
+			std::memcpy(data + offset, src, first);
+			std::memcpy(data, ((const unsigned char*) src) + first, count - first);
+			position = pos + count;
+			__atomic_store_n(&ring->tail, pos + count, __ATOMIC_SEQ_CST);
+			if(__atomic_exchange_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST))
+			{
+				notifyAll();
+			}
+			return count;
+		}
+
+		//Copies up to size bytes out of a FROM_SANDBOX ring without blocking, and returns the number of bytes copied
+		//The bytes come from the library and must be validated like any other data from the sandbox
+		size_t read(void* dest, size_t size)
+		{
+			checkDirection(RLBox_Ring_Direction::FROM_SANDBOX, "read");
+			const uint32_t count = (uint32_t) std::min(available(), size);
+			if(count == 0)
+			{
+				return 0;
+			}
+			const uint32_t pos = position;
+			const uint32_t offset = pos & (capacity - 1);
+			const uint32_t first = std::min(count, capacity - offset);
+			const unsigned char* data = rlbox_ring_data(ring);
+			std::memcpy(dest, data + offset, first);
+			std::memcpy(((unsigned char*) dest) + first, data, count - first);
+			position = pos + count;
+			__atomic_store_n(&ring->head, pos + count, __ATOMIC_SEQ_CST);
+			if(__atomic_exchange_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST))
+			{
+				notifyAll();
+			}
+			return count;
+		}
+
+		//Writes all of src, waiting for space as needed. Returns false if the ring was closed or corrupted first
+		bool writeAll(const void* src, size_t size)
+		{
+			const unsigned char* p = (const unsigned char*) src;
+			while(size > 0)
+			{
+				if(ring == nullptr || isStopped() || loadIndex(&ring->closed))
+				{
+					return false;
+				}
+				size_t written = write(p, size);
+				if(written == 0)
+				{
+					waitFor(&ring->producerWaiting, [this]() { return applicationCanProceed(); });
+				}
+				p += written;
+				size -= written;
+			}
+			return true;
+		}
+
+		//Reads at least one byte, waiting for data as needed. Returns 0 once the library closed the ring and it is empty
+		size_t readSome(void* dest, size_t size)
+		{
+			if(ring == nullptr || size == 0)
+			{
+				return 0;
+			}
+			for(;;)
+			{
+				size_t count = read(dest, size);
+				if(count != 0 || isStopped())
+				{
+					return count;
+				}
+				if(loadIndex(&ring->closed))
+				{
+					//data written before the close is still read
+					return read(dest, size);
+				}
+				waitFor(&ring->consumerWaiting, [this]() { return applicationCanProceed(); });
+			}
+		}
+
+		//Ends the stream of a TO_SANDBOX ring, or stops the library from writing more to a FROM_SANDBOX ring
+		void close()
+		{
+			if(ring == nullptr)
+			{
+				return;
+			}
+			closed = true;
+			__atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+			notifyAll();
+		}
+
+		inline bool isCorrupted() const { return corrupted; }
+	};
+}
+#endif
@@ -0,0 +1,552 @@
+#ifndef RLBOX_API_SANDBOXMEMORY
+#define RLBOX_API_SANDBOXMEMORY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+
+//Helpers for backends whose sandbox memory is a contiguous region of our address space
+//i.e. Wasm linear memory, the NaCl region and the Process shared memory region
+namespace RLBox_SandboxMemory {
+
+	class MemoryRange
+	{
+	public:
+		uintptr_t start;
+		uintptr_t end;
+		int prot;
+		//shared mappings are also visible to other processes, so they can't be replaced by new mappings
+		bool shared;
+		//inode of the mapped file, 0 for anonymous memory
+		//private file mappings fall back to the file contents rather than zeros when discarded
+		unsigned long inode;
+	};
+
+	inline size_t getPageSize()
+	{
+		static const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+		return pageSize;
+	}
+
+	//Mappings in [base, base + size), as listed in /proc/self/maps
+	inline std::vector<MemoryRange> getMappedRanges(uintptr_t base, size_t size, bool writableOnly)
+	{
+		std::vector<MemoryRange> ret;
+		FILE* maps = fopen("/proc/self/maps", "r");
+		if(!maps)
+		{
+			return ret;
+		}
+
+		const uintptr_t limit = base + size;
+		char line[512];
+		while(fgets(line, sizeof(line), maps))
+		{
+			//skip the rest of lines with long file names
+			if(!strchr(line, '\n'))
+			{
+				int c;
+				while((c = fgetc(maps)) != EOF && c != '\n') {}
+			}
+
+			unsigned long start, end, inode;
+			char perms[5];
+			if(sscanf(line, "%lx-%lx %4s %*x %*x:%*x %lu", &start, &end, perms, &inode) != 4 || (writableOnly && perms[1] != 'w') || end <= base || start >= limit)
+			{
+				continue;
+			}
+
+			MemoryRange range;
+			range.start = std::max((uintptr_t) start, base);
+			range.end = std::min((uintptr_t) end, limit);
+			range.prot = (perms[0] == 'r'? PROT_READ : 0) | (perms[1] == 'w'? PROT_WRITE : 0) | (perms[2] == 'x'? PROT_EXEC : 0);
+			range.shared = perms[3] == 's';
+			range.inode = inode;
+			ret.push_back(range);
+		}
+		fclose(maps);
+		return ret;
+	}
+
+	//Mappings in [base, base + size) that the sandbox can write to
+	inline std::vector<MemoryRange> getWritableRanges(uintptr_t base, size_t size)
+	{
+		return getMappedRanges(base, size, true /* writableOnly */);
+	}
+
+	//Asks for transparent huge pages on all of [base, base + size), including reserved memory the sandbox may grow into
+	//Returns false if the kernel does not support them for any of the memory
+	inline bool adviseHugePages(uintptr_t base, size_t size)
+	{
+		bool ret = false;
+		for(auto& range : getMappedRanges(base, size, false /* writableOnly */))
+		{
+			if(madvise((void*) range.start, range.end - range.start, MADV_HUGEPAGE) == 0)
+			{
+				ret = true;
+			}
+		}
+		return ret;
+	}
+
+	//Faults in the first prefaultSize bytes of writable memory, so that the sandbox does not take these faults later
+	inline void prefault(uintptr_t base, size_t size, size_t prefaultSize)
+	{
+		const size_t pageSize = getPageSize();
+		for(auto& range : getWritableRanges(base, size))
+		{
+			if(prefaultSize == 0)
+			{
+				break;
+			}
+			size_t len = std::min(prefaultSize, (size_t) (range.end - range.start));
+			prefaultSize -= len;
+
+			#ifdef MADV_POPULATE_WRITE
+				if(madvise((void*) range.start, len, MADV_POPULATE_WRITE) == 0)
+				{
+					continue;
+				}
+			#endif
+			//older kernels, touch every page without changing its contents
+			for(uintptr_t page = range.start; page < range.start + len; page += pageSize)
+			{
+				volatile char* p = (volatile char*) page;
+				*p = *p;
+			}
+		}
+	}
+
+	inline bool writeAll(int fd, uintptr_t src, size_t len, off_t offset)
+	{
+		while(len > 0)
+		{
+			ssize_t written = pwrite(fd, (void*) src, len, offset);
+			if(written <= 0)
+			{
+				if(written == -1 && errno == EINTR) { continue; }
+				return false;
+			}
+			src += written;
+			len -= written;
+			offset += written;
+		}
+		return true;
+	}
+
+	inline bool readAll(int fd, uintptr_t dest, size_t len, off_t offset)
+	{
+		while(len > 0)
+		{
+			ssize_t readCount = pread(fd, (void*) dest, len, offset);
+			if(readCount <= 0)
+			{
+				if(readCount == -1 && errno == EINTR) { continue; }
+				return false;
+			}
+			dest += readCount;
+			len -= readCount;
+			offset += readCount;
+		}
+		return true;
+	}
+
+	//Calls fn(start, end) for each run of marked pages in the page aligned range [start, end)
+	//markPages(chunk, len, marks) sets marks[i] to whether the i-th page of [chunk, chunk + len) is marked
+	template<typename TMarkFunc, typename TFunc>
+	inline void forEachMarkedRun(uintptr_t start, uintptr_t end, TMarkFunc markPages, TFunc fn)
+	{
+		const size_t pageSize = getPageSize();
+		const size_t chunkPages = 4096;
+		std::vector<unsigned char> marks(chunkPages);
+		bool inRun = false;
+		uintptr_t runStart = 0;
+
+		for(uintptr_t chunk = start; chunk < end; chunk += chunkPages * pageSize)
+		{
+			size_t len = std::min((uintptr_t) (chunkPages * pageSize), end - chunk);
+			size_t pages = len / pageSize;
+			markPages(chunk, len, marks.data());
+
+			for(size_t i = 0; i < pages; i++)
+			{
+				uintptr_t page = chunk + i * pageSize;
+				bool marked = marks[i];
+				if(marked && !inRun)
+				{
+					runStart = page;
+					inRun = true;
+				}
+				else if(!marked && inRun)
+				{
+					fn(runStart, page);
+					inRun = false;
+				}
+			}
+		}
+
+		if(inRun)
+		{
+			fn(runStart, end);
+		}
+	}
+
+	//Calls fn(start, end) for each run of resident pages in the page aligned range [start, end)
+	template<typename TFunc>
+	inline void forEachResidentRun(uintptr_t start, uintptr_t end, TFunc fn)
+	{
+		forEachMarkedRun(start, end, [](uintptr_t chunk, size_t len, unsigned char* marks) {
+			if(mincore((void*) chunk, len, marks) != 0)
+			{
+				//be conservative and treat the chunk as resident
+				memset(marks, 1, len / getPageSize());
+			}
+			for(size_t i = 0; i < len / getPageSize(); i++)
+			{
+				marks[i] &= 1;
+			}
+		}, fn);
+	}
+
+	//Calls fn(start, end) for each run of pages of anonymous memory in [start, end) that were ever written, which
+	//unlike resident pages includes the ones that were swapped out. Pages that read as zeros may be left out
+	template<typename TFunc>
+	inline void forEachPopulatedRun(uintptr_t start, uintptr_t end, TFunc fn)
+	{
+		const uint64_t presentBit = 1ull << 63;
+		const uint64_t swappedBit = 1ull << 62;
+		int pagemapFd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+		std::vector<uint64_t> entries;
+		forEachMarkedRun(start, end, [&](uintptr_t chunk, size_t len, unsigned char* marks) {
+			const size_t pageSize = getPageSize();
+			const size_t pages = len / pageSize;
+			entries.resize(pages);
+			if(pagemapFd == -1 || !readAll(pagemapFd, (uintptr_t) entries.data(), pages * sizeof(uint64_t), (chunk / pageSize) * sizeof(uint64_t)))
+			{
+				//be conservative and treat the chunk as populated
+				memset(marks, 1, pages);
+				return;
+			}
+			for(size_t i = 0; i < pages; i++)
+			{
+				marks[i] = (entries[i] & (presentBit | swappedBit)) != 0;
+			}
+		}, fn);
+		if(pagemapFd != -1)
+		{
+			close(pagemapFd);
+		}
+	}
+
+	//Calls fn(start, end) for the parts of range that are not covered by any of the sorted ranges in covered
+	template<typename TFunc>
+	inline void forEachUncovered(const MemoryRange& range, const std::vector<MemoryRange>& covered, TFunc fn)
+	{
+		uintptr_t curr = range.start;
+		for(auto& c : covered)
+		{
+			if(c.end <= curr || c.start >= range.end)
+			{
+				continue;
+			}
+			if(c.start > curr)
+			{
+				fn(curr, c.start);
+			}
+			curr = std::max(curr, c.end);
+		}
+		if(curr < range.end)
+		{
+			fn(curr, range.end);
+		}
+	}
+
+	//After this, reads of the range return zeros and its pages no longer count towards our resident memory
+	inline void discardPages(uintptr_t start, uintptr_t end, bool shared)
+	{
+		if(shared)
+		{
+			//MADV_DONTNEED would just drop our view of the shared pages, MADV_REMOVE frees the backing memory
+			if(madvise((void*) start, end - start, MADV_REMOVE) != 0)
+			{
+				memset((void*) start, 0, end - start);
+			}
+		}
+		else
+		{
+			if(madvise((void*) start, end - start, MADV_DONTNEED) != 0)
+			{
+				memset((void*) start, 0, end - start);
+			}
+		}
+	}
+
+	//Discards the whole pages in [start, end), for memory whose contents are no longer needed such as a freed allocation
+	//Returns the number of bytes released
+	inline size_t releaseUnusedPages(uintptr_t start, uintptr_t end)
+	{
+		const size_t pageSize = getPageSize();
+		start = (start + pageSize - 1) & ~(pageSize - 1);
+		end = end & ~(pageSize - 1);
+		if(start >= end)
+		{
+			return 0;
+		}
+
+		size_t ret = 0;
+		for(auto& range : getWritableRanges(start, end - start))
+		{
+			discardPages(range.start, range.end, range.shared);
+			ret += range.end - range.start;
+		}
+		return ret;
+	}
+
+	inline bool isZero(uintptr_t start, uintptr_t end)
+	{
+		for(const uint64_t* curr = (const uint64_t*) start; curr < (const uint64_t*) end; curr++)
+		{
+			if(*curr != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//Bytes of the writable memory in [base, base + size) that are resident. Pages shared with a snapshot are included
+	inline size_t getResidentMemory(uintptr_t base, size_t size)
+	{
+		size_t ret = 0;
+		for(auto& range : getWritableRanges(base, size))
+		{
+			forEachResidentRun(range.start, range.end, [&](uintptr_t start, uintptr_t end) {
+				ret += end - start;
+			});
+		}
+		return ret;
+	}
+
+	//Replaces the pages at dest with a private mapping of the file, so the sandbox reads the page cache without a copy
+	//dest, size and offset must be page aligned. Writes to a writable mapping are not written back to the file
+	//Pages the file no longer covers, e.g. after it is truncated, raise SIGBUS when read
+	inline bool mapFileAt(uintptr_t dest, size_t size, int fd, off_t offset, bool readOnly)
+	{
+		const int prot = readOnly? PROT_READ : PROT_READ | PROT_WRITE;
+		void* ret = mmap((void*) dest, size, prot, MAP_PRIVATE | MAP_FIXED, fd, offset);
+		return ret != MAP_FAILED;
+	}
+
+	//Puts zeroed anonymous memory back over a range from mapFileAt
+	inline void unmapFileAt(uintptr_t dest, size_t size)
+	{
+		void* ret = mmap((void*) dest, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		if(ret == MAP_FAILED)
+		{
+			printf("Could not restore sandbox memory after a file mapping\n");
+			abort();
+		}
+	}
+
+	//A copy of the writable memory of a sandbox, stored in a memfd at the same offsets the memory has in the sandbox
+	//Pages that were never touched are left as holes in the memfd, so the snapshot only costs the memory in use
+	class MemorySnapshot
+	{
+	private:
+		int fd = -1;
+		uintptr_t base = 0;
+		size_t size = 0;
+		std::vector<MemoryRange> ranges;
+
+		bool restoreSharedRange(const MemoryRange& range)
+		{
+			const off_t endOffset = range.end - base;
+			off_t offset = range.start - base;
+			while(offset < endOffset)
+			{
+				off_t dataStart = lseek(fd, offset, SEEK_DATA);
+				if(dataStart == -1 && errno != ENXIO)
+				{
+					//no hole support, copy the whole range
+					return readAll(fd, base + offset, endOffset - offset, offset);
+				}
+				if(dataStart == -1 || dataStart >= endOffset)
+				{
+					discardPages(base + offset, base + endOffset, true /* shared */);
+					break;
+				}
+				if(dataStart > offset)
+				{
+					discardPages(base + offset, base + dataStart, true /* shared */);
+				}
+				off_t holeStart = std::min(lseek(fd, dataStart, SEEK_HOLE), endOffset);
+				if(holeStart == -1 || !readAll(fd, base + dataStart, holeStart - dataStart, dataStart))
+				{
+					return false;
+				}
+				offset = holeStart;
+			}
+			return true;
+		}
+
+	public:
+		MemorySnapshot() = default;
+		MemorySnapshot(const MemorySnapshot&) = delete;
+		MemorySnapshot& operator=(const MemorySnapshot&) = delete;
+
+		~MemorySnapshot()
+		{
+			clear();
+		}
+
+		inline bool isValid() const
+		{
+			return fd != -1;
+		}
+
+		void clear()
+		{
+			if(fd != -1)
+			{
+				close(fd);
+				fd = -1;
+			}
+			ranges.clear();
+		}
+
+		bool create(uintptr_t p_base, size_t p_size)
+		{
+			clear();
+			int newFd = memfd_create("rlbox_snapshot", MFD_CLOEXEC);
+			if(newFd == -1)
+			{
+				return false;
+			}
+			if(ftruncate(newFd, p_size) != 0)
+			{
+				close(newFd);
+				return false;
+			}
+
+			auto newRanges = getWritableRanges(p_base, p_size);
+			const size_t pageSize = getPageSize();
+			bool ok = true;
+			auto copyRun = [&](uintptr_t start, uintptr_t end) {
+				ok = ok && writeAll(newFd, start, end - start, start - p_base);
+			};
+			for(auto& range : newRanges)
+			{
+				if(range.inode == 0)
+				{
+					forEachPopulatedRun(range.start, range.end, copyRun);
+					continue;
+				}
+				//pages of file mappings, such as an earlier snapshot, hold data whether or not they are in our page tables
+				//so the whole range is read, and only zero pages are left as holes
+				uintptr_t runStart = range.start;
+				for(uintptr_t page = range.start; page < range.end; page += pageSize)
+				{
+					if(isZero(page, page + pageSize))
+					{
+						if(runStart < page)
+						{
+							copyRun(runStart, page);
+						}
+						runStart = page + pageSize;
+					}
+				}
+				if(runStart < range.end)
+				{
+					copyRun(runStart, range.end);
+				}
+			}
+			if(!ok)
+			{
+				close(newFd);
+				return false;
+			}
+
+			fd = newFd;
+			base = p_base;
+			size = p_size;
+			ranges = newRanges;
+			return true;
+		}
+
+		//Makes target a snapshot of the same memory contents for a sandbox whose memory is at targetBase, sharing our memfd
+		//Restoring target then gives that sandbox a copy of this snapshot
+		bool cloneInto(MemorySnapshot& target, uintptr_t targetBase, size_t targetSize) const
+		{
+			if(fd == -1 || targetSize < size)
+			{
+				return false;
+			}
+			int newFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+			if(newFd == -1)
+			{
+				return false;
+			}
+
+			target.clear();
+			target.fd = newFd;
+			target.base = targetBase;
+			target.size = size;
+			for(auto range : ranges)
+			{
+				range.start = range.start - base + targetBase;
+				range.end = range.end - base + targetBase;
+				target.ranges.push_back(range);
+			}
+			return true;
+		}
+
+		//Private memory is remapped as a copy on write view of the snapshot, so the cost is proportional to the pages
+		//touched since the snapshot. Shared memory has to be copied back, as other processes have it mapped as well
+		bool restore()
+		{
+			if(fd == -1)
+			{
+				return false;
+			}
+
+			//memory the sandbox made writable after the snapshot was taken was zero at snapshot time
+			auto currentRanges = getWritableRanges(base, size);
+			for(auto& range : currentRanges)
+			{
+				forEachUncovered(range, ranges, [&](uintptr_t start, uintptr_t end) {
+					discardPages(start, end, range.shared);
+				});
+			}
+
+			for(auto& range : ranges)
+			{
+				if(range.shared)
+				{
+					if(!restoreSharedRange(range))
+					{
+						return false;
+					}
+				}
+				else
+				{
+					void* ret = mmap((void*) range.start, range.end - range.start, range.prot, MAP_PRIVATE | MAP_FIXED, fd, range.start - base);
+					if(ret == MAP_FAILED)
+					{
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+	};
+};
+
+#endif
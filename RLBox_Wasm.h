@@ -6,6 +6,7 @@
 #include <map>
 #include <mutex>
 #include "wasm_sandbox.h"
+#include "RLBox_SandboxMemory.h"
 
 class RLBox_Wasm
 {
@@ -15,22 +16,22 @@ private:
 	static std::vector<WasmSandbox*> sandboxList;
 	std::mutex callbackMutex;
 	std::mutex threadMutex;
+	RLBox_SandboxMemory::MemorySnapshot memorySnapshot;
 	class WasmSandboxStateWrapper
 	{
 	public:
-		RLBox_Wasm* sandbox;
-		void* originalState;
-		void* fnPtr;
-		WasmSandboxCallback* registeredCallback;
-
-		WasmSandboxStateWrapper(RLBox_Wasm* sandbox, void* originalState, void* fnPtr)
-		{
-			this->sandbox = sandbox;
-			this->originalState = originalState;
-			this->fnPtr = fnPtr;
-		}
+		RLBox_Wasm* sandbox = nullptr;
+		//null for free entries
+		void* key = nullptr;
+		void* originalState = nullptr;
+		void* fnPtr = nullptr;
+		WasmSandboxCallback* registeredCallback = nullptr;
 	};
-	std::map<void*, WasmSandboxStateWrapper*> callbackSlotInfo;
+	//the runtime's callback slots are function table indexes, so entries are handed out separately
+	//The table has no fixed size, so registrations past the array are kept in a map of separately allocated wrappers
+	static const unsigned int CALLBACK_SLOT_COUNT = 32;
+	WasmSandboxStateWrapper callbackSlotInfo[CALLBACK_SLOT_COUNT];
+	std::map<void*, WasmSandboxStateWrapper*> overflowCallbackSlotInfo;
 
 	//https://stackoverflow.com/questions/23467635/is-there-a-variant-of-stdlock-guard-that-unlocks-at-construction-and-locks-at
 	template <class T>
@@ -90,6 +91,12 @@ public:
 	#if defined(_M_X64) || defined(__x86_64__)
 		static const bool impl_Handle32bitPointerArrays;
 	#endif
+	static const bool impl_SupportsSnapshot;
+	static const bool impl_SupportsMemoryTrim;
+	static const bool impl_SupportsMemoryOptions;
+	static const bool impl_SupportsClone;
+	static const bool impl_SupportsBatchFree;
+	static const bool impl_SupportsFileMapping;
 
 	inline void impl_CreateSandbox(const char* sandboxRuntimePath, const char* libraryPath)
 	{
@@ -128,11 +135,92 @@ public:
 		sandbox->freeInSandbox(val);
 	}
 
+	//frees several sandboxed pointers under a single acquisition of the sandbox lock
+	inline void impl_freeInSandboxBatch(void** vals, size_t count)
+	{
+		std::lock_guard<std::mutex> lock(threadMutex);
+		for(size_t i = 0; i < count; i++)
+		{
+			sandbox->freeInSandbox(vals[i]);
+		}
+	}
+
 	inline size_t impl_getTotalMemory()
 	{
 		return sandbox->getTotalMemory();
 	}
 
+	inline bool impl_SnapshotMemory()
+	{
+		std::lock_guard<std::mutex> lock(threadMutex);
+		return memorySnapshot.create((uintptr_t) sandbox->getSandboxMemoryBase(), sandbox->getTotalMemory());
+	}
+
+	inline bool impl_RestoreMemory()
+	{
+		std::lock_guard<std::mutex> lock(threadMutex);
+		return memorySnapshot.restore();
+	}
+
+	//Fails if the template's memory has grown larger than ours, as the runtime would not know about the extra memory
+	inline bool impl_CloneMemoryFrom(RLBox_Wasm* templateSandbox)
+	{
+		{
+			std::lock_guard<std::mutex> lock(templateSandbox->threadMutex);
+			if(!templateSandbox->memorySnapshot.cloneInto(memorySnapshot, (uintptr_t) sandbox->getSandboxMemoryBase(), sandbox->getTotalMemory()))
+			{
+				return false;
+			}
+		}
+		std::lock_guard<std::mutex> lock(threadMutex);
+		return memorySnapshot.restore();
+	}
+
+	//Returns whether huge pages could be enabled
+	inline bool impl_PrepareMemory(bool useHugePages, size_t prefaultSize)
+	{
+		std::lock_guard<std::mutex> lock(threadMutex);
+		const uintptr_t base = (uintptr_t) sandbox->getSandboxMemoryBase();
+		const size_t size = sandbox->getTotalMemory();
+		bool ret = useHugePages && RLBox_SandboxMemory::adviseHugePages(base, size);
+		RLBox_SandboxMemory::prefault(base, size, prefaultSize);
+		return ret;
+	}
+
+	//Runs the library's rlbox_malloc_trim, for allocators that can give free heap pages back
+	//Returns false if the library does not export it. The caller must ensure no sandbox functions are running
+	inline bool impl_TrimMemory()
+	{
+		auto trimFn = (int(*)(size_t)) sandbox->symbolLookup("rlbox_malloc_trim");
+		if(!trimFn)
+		{
+			return false;
+		}
+		impl_InvokeFunction(trimFn, (size_t) 0 /* pad */);
+		return true;
+	}
+
+	inline size_t impl_getResidentMemory()
+	{
+		return RLBox_SandboxMemory::getResidentMemory((uintptr_t) sandbox->getSandboxMemoryBase(), sandbox->getTotalMemory());
+	}
+
+	//addr is an unsandboxed pointer to memory the sandbox no longer uses
+	inline void impl_ReleaseUnusedPages(void* addr, size_t size)
+	{
+		RLBox_SandboxMemory::releaseUnusedPages((uintptr_t) addr, ((uintptr_t) addr) + size);
+	}
+
+	inline bool impl_MapFileInSandbox(void* addr, size_t size, int fd, off_t offset, bool readOnly)
+	{
+		return RLBox_SandboxMemory::mapFileAt((uintptr_t) addr, size, fd, offset, readOnly);
+	}
+
+	inline void impl_UnmapFileInSandbox(void* addr, size_t size)
+	{
+		RLBox_SandboxMemory::unmapFileAt((uintptr_t) addr, size);
+	}
+
 	inline char* impl_getMaxPointer()
 	{
 		void* maxPtr = (void*) (((uintptr_t)sandbox->getTotalMemory()) - 1);
@@ -252,11 +340,43 @@ public:
 	inline void* impl_RegisterCallback(void* key, void* callback, void* state)
 	{
 		std::lock_guard<std::mutex> lock(callbackMutex);
-		auto stateWrapper = new WasmSandboxStateWrapper(this, state, callback);
-		callbackSlotInfo[key] = stateWrapper;
+		WasmSandboxStateWrapper* stateWrapper = nullptr;
+		for(unsigned int i = 0; i < CALLBACK_SLOT_COUNT; i++)
+		{
+			if(callbackSlotInfo[i].key == nullptr)
+			{
+				stateWrapper = &callbackSlotInfo[i];
+				break;
+			}
+		}
+		const bool overflow = stateWrapper == nullptr;
+		if(overflow)
+		{
+			stateWrapper = new WasmSandboxStateWrapper();
+		}
+		stateWrapper->sandbox = this;
+		stateWrapper->key = key;
+		stateWrapper->originalState = state;
+		stateWrapper->fnPtr = callback;
 		using funcType = TRet(*)(void*, TArgs...);
 		auto callbackStub = (funcType) impl_CallbackReceiver<TRet, TArgs...>;
 		WasmSandboxCallback* registeredCallback = sandbox->registerCallback(callbackStub, (void*)stateWrapper);
+		if(!registeredCallback)
+		{
+			if(overflow)
+			{
+				delete stateWrapper;
+			}
+			else
+			{
+				*stateWrapper = WasmSandboxStateWrapper();
+			}
+			return nullptr;
+		}
+		if(overflow)
+		{
+			overflowCallbackSlotInfo[key] = stateWrapper;
+		}
 		stateWrapper->registeredCallback = registeredCallback;
 		return (void*)(uintptr_t)registeredCallback->callbackSlot;
 	}
@@ -266,11 +386,21 @@ public:
 	{
 		std::lock_guard<std::mutex> lock(callbackMutex);
 
-		auto it = callbackSlotInfo.find(key);
-		if(it != callbackSlotInfo.end())
+		for(unsigned int i = 0; i < CALLBACK_SLOT_COUNT; i++)
+		{
+			if(callbackSlotInfo[i].key == key)
+			{
+				sandbox->unregisterCallback(callbackSlotInfo[i].registeredCallback);
+				callbackSlotInfo[i] = WasmSandboxStateWrapper();
+				return;
+			}
+		}
+
+		auto it = overflowCallbackSlotInfo.find(key);
+		if(it != overflowCallbackSlotInfo.end())
 		{
 			WasmSandboxStateWrapper* slotInfo = it->second;
-			callbackSlotInfo.erase(it);
+			overflowCallbackSlotInfo.erase(it);
 			sandbox->unregisterCallback(slotInfo->registeredCallback);
 			delete slotInfo;
 		}
@@ -282,18 +412,18 @@ public:
 	}
 
 	template <typename TRet, typename ... TOrigArgs, typename ... TArgs>
-	TRet impl_InvokeFunction(TRet(*fnPtr)(TOrigArgs...), TArgs... params)
+	TRet impl_InvokeFunction(TRet(*fnPtr)(TOrigArgs...), TArgs&&... params)
 	{
 		std::lock_guard<std::mutex> lock(threadMutex);
-		return sandbox->invokeFunction(fnPtr, params...);
+		return sandbox->invokeFunction(fnPtr, std::forward<TArgs>(params)...);
 	}
 
 	template <typename TRet, typename ... TOrigArgs, typename ... TArgs>
-	TRet impl_InvokeFunctionReturnAppPtr(TRet(*fnPtr)(TOrigArgs...), TArgs... params)
+	TRet impl_InvokeFunctionReturnAppPtr(TRet(*fnPtr)(TOrigArgs...), TArgs&&... params)
 	{
 		std::lock_guard<std::mutex> lock(threadMutex);
-		using TargetFuncType = uint32_t(*)(TArgs...);
-		uintptr_t rawRet = (uintptr_t) sandbox->invokeFunction((TargetFuncType) fnPtr, params...);
+		using TargetFuncType = uint32_t(*)(typename std::decay<TArgs>::type...);
+		uintptr_t rawRet = (uintptr_t) sandbox->invokeFunction((TargetFuncType) fnPtr, std::forward<TArgs>(params)...);
 		return (TRet) rawRet;
 	}
 };
@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+#include <functional>
+#include <sys/mman.h>
+#include "libtest.h"
+#include "RLBox_MyApp.h"
+#include "RLBox_DynLib.h"
+#include "RLBox_SandboxMemory.h"
+#ifndef NO_PROCESS
+	#define USE_RLBOXTEST
+	#include "RLBox_Process.h"
+#endif
+#ifndef NO_NACL
+	#include "RLBox_NaCl.h"
+#endif
+#include "testlib_structs_for_cpp_api.h"
+#include "rlbox.h"
+#include "RLBox_RingBuffer.h"
+
+using namespace rlbox;
+
+rlbox_load_library_api(testlib, RLBox_DynLib)
+#ifndef NO_PROCESS
+	rlbox_load_library_api(testlib, RLBox_Process<RLBoxTestProcessSandbox>)
+#endif
+#ifndef NO_NACL
+	rlbox_load_library_api(testlib, RLBox_NaCl)
+#endif
+
+#define ENSURE(a) if(!(a)) { printf("%s check failed\n", #a); abort(); }
+
+//////////////////////////////////////////////////////////////////
+
+template<typename TFunc>
+double timeMicroseconds(int iterations, TFunc fn)
+{
+	auto start = std::chrono::steady_clock::now();
+	for(int i = 0; i < iterations; i++)
+	{
+		fn(i);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
+
+//Compares restoring a snapshot with copying the whole heap back, for a heap where the first 16MB were initialized
+//and each use of the sandbox dirties 64 pages
+void benchmarkSnapshotRestore(bool shared)
+{
+	const size_t pageSize = RLBox_SandboxMemory::getPageSize();
+	const size_t initializedSize = 16 * 1024 * 1024;
+	const size_t touchedPages = 64;
+	const int iterations = 20;
+
+	printf("Snapshot restore (%s memory)\n", shared? "shared" : "private");
+	printf("%12s %18s %18s\n", "heap MB", "restore us", "full copy us");
+	for(size_t heapSize : std::vector<size_t>{ 16ull << 20, 64ull << 20, 256ull << 20, 1024ull << 20 })
+	{
+		char* heap = (char*) mmap(nullptr, heapSize, PROT_READ | PROT_WRITE, (shared? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+		ENSURE(heap != MAP_FAILED);
+		memset(heap, 1, initializedSize);
+
+		RLBox_SandboxMemory::MemorySnapshot snapshot;
+		ENSURE(snapshot.create((uintptr_t) heap, heapSize));
+
+		auto dirtyHeap = [&](int iteration) {
+			for(size_t i = 0; i < touchedPages; i++)
+			{
+				heap[((i * 7919 + iteration) % (heapSize / pageSize)) * pageSize] = 2;
+			}
+		};
+
+		double restoreTime = timeMicroseconds(iterations, [&](int iteration) {
+			dirtyHeap(iteration);
+			ENSURE(snapshot.restore());
+		});
+
+		//the reset we are replacing, copying back a saved copy of the heap
+		char* copy = (char*) malloc(heapSize);
+		ENSURE(copy);
+		memcpy(copy, heap, heapSize);
+		double copyTime = timeMicroseconds(iterations, [&](int iteration) {
+			dirtyHeap(iteration);
+			memcpy(heap, copy, heapSize);
+		});
+
+		printf("%12zu %18.1f %18.1f\n", heapSize >> 20, restoreTime, copyTime);
+		free(copy);
+		snapshot.clear();
+		munmap(heap, heapSize);
+	}
+}
+
+//Compares creating a heap and initializing it, with creating a heap as a copy on write clone of an initialized template
+void benchmarkClone()
+{
+	const size_t heapSize = 256ull << 20;
+	const int iterations = 20;
+
+	printf("Clone from template (%zu MB heap)\n", heapSize >> 20);
+	printf("%12s %18s %18s\n", "init MB", "init us", "clone us");
+	for(size_t initializedSize : std::vector<size_t>{ 1ull << 20, 4ull << 20, 16ull << 20, 64ull << 20 })
+	{
+		//stands in for building tables or parsing config inside the sandbox
+		auto initialize = [&](char* heap) {
+			uint32_t state = 2463534242u;
+			for(size_t i = 0; i < initializedSize / sizeof(uint32_t); i++)
+			{
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+				((uint32_t*) heap)[i] = state;
+			}
+		};
+		auto createHeap = []() {
+			char* heap = (char*) mmap(nullptr, heapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			ENSURE(heap != MAP_FAILED);
+			return heap;
+		};
+
+		char* templateHeap = createHeap();
+		initialize(templateHeap);
+		RLBox_SandboxMemory::MemorySnapshot templateSnapshot;
+		ENSURE(templateSnapshot.create((uintptr_t) templateHeap, heapSize));
+
+		double initTime = timeMicroseconds(iterations, [&](int iteration) {
+			char* heap = createHeap();
+			initialize(heap);
+			munmap(heap, heapSize);
+		});
+
+		double cloneTime = timeMicroseconds(iterations, [&](int iteration) {
+			char* heap = createHeap();
+			RLBox_SandboxMemory::MemorySnapshot snapshot;
+			ENSURE(templateSnapshot.cloneInto(snapshot, (uintptr_t) heap, heapSize));
+			ENSURE(snapshot.restore());
+			munmap(heap, heapSize);
+		});
+
+		printf("%12zu %18.1f %18.1f\n", initializedSize >> 20, initTime, cloneTime);
+		templateSnapshot.clear();
+		munmap(templateHeap, heapSize);
+	}
+}
+
+//Sequential and random access over 256MB of sandbox-like memory, with and without huge pages and prefaulting
+//The first pass includes the page faults of first touch
+void benchmarkHugePages()
+{
+	const size_t heapSize = 256ull << 20;
+	const size_t randomAccesses = 16ull << 20;
+
+	printf("Huge pages (%zu MB heap, ms)\n", heapSize >> 20);
+	printf("%12s %12s %12s %12s %12s %12s\n", "huge pages", "prefault", "prepare", "first seq", "seq", "random");
+	for(int config = 0; config < 4; config++)
+	{
+		const bool useHugePages = config & 1;
+		const bool usePrefault = config & 2;
+		//over-reserve so that the heap can start on a huge page boundary
+		const size_t hugePageSize = 2ull << 20;
+		char* reservation = (char*) mmap(nullptr, heapSize + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		ENSURE(reservation != MAP_FAILED);
+		char* heap = (char*) ((((uintptr_t) reservation) + hugePageSize - 1) & ~(hugePageSize - 1));
+
+		auto timeMs = [](std::function<void()> fn) {
+			auto start = std::chrono::steady_clock::now();
+			fn();
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		};
+
+		bool hugePagesEnabled = false;
+		double prepareTime = timeMs([&]() {
+			if(useHugePages)
+			{
+				hugePagesEnabled = RLBox_SandboxMemory::adviseHugePages((uintptr_t) heap, heapSize);
+			}
+			if(usePrefault)
+			{
+				RLBox_SandboxMemory::prefault((uintptr_t) heap, heapSize, heapSize);
+			}
+		});
+
+		volatile uint64_t sink = 0;
+		auto sequential = [&]() {
+			uint64_t sum = 0;
+			for(size_t i = 0; i < heapSize; i += 64)
+			{
+				heap[i]++;
+				sum += heap[i];
+			}
+			sink = sum;
+		};
+		double firstSeqTime = timeMs(sequential);
+		double seqTime = timeMs(sequential);
+		double randomTime = timeMs([&]() {
+			uint64_t sum = 0;
+			uint64_t state = 88172645463325252ull;
+			for(size_t i = 0; i < randomAccesses; i++)
+			{
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+				sum += heap[state % heapSize];
+			}
+			sink = sum;
+		});
+		(void) sink;
+
+		printf("%12s %12s %12.1f %12.1f %12.1f %12.1f\n", useHugePages? (hugePagesEnabled? "yes" : "unavailable") : "no",
+			usePrefault? "yes" : "no", prepareTime, firstSeqTime, seqTime, randomTime);
+		munmap(reservation, heapSize + hugePageSize);
+	}
+}
+
+static int churnCallback(RLBoxSandbox<RLBox_MyApp>* sandbox, tainted<unsigned, RLBox_MyApp> a, tainted<const char*, RLBox_MyApp> b, tainted<unsigned[1], RLBox_MyApp> c)
+{
+	return 0;
+}
+
+//Creates and unregisters a callback per iteration, as code that registers a callback per request does
+void benchmarkCallbackChurn()
+{
+	const int iterations = 1000000;
+	auto sandbox = RLBoxSandbox<RLBox_MyApp>::createSandbox("", "");
+
+	printf("Callback create/unregister churn (ns)\n");
+	auto churn = [&](int iteration) {
+		auto cb = sandbox->createCallback(churnCallback);
+		ENSURE(cb.UNSAFE_Unverified() != nullptr);
+	};
+	double registerTime = timeMicroseconds(iterations, churn) * 1000;
+
+	//another helper keeps the registration alive
+	auto held = sandbox->createCallback(churnCallback);
+	double sharedTime = timeMicroseconds(iterations, churn) * 1000;
+	held.unregister();
+
+	sandbox->setIdleCallbackLimit(1);
+	double idleTime = timeMicroseconds(iterations, churn) * 1000;
+	sandbox->setIdleCallbackLimit(0);
+
+	printf("%18s %18s %18s\n", "register", "shared", "idle cached");
+	printf("%18.1f %18.1f %18.1f\n", registerTime, sharedTime, idleTime);
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
+template<typename TSandbox>
+static int sumCallback(RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned long, TSandbox> a, tainted<unsigned long, TSandbox> b, tainted<unsigned long, TSandbox> c,
+	tainted<unsigned long, TSandbox> d, tainted<unsigned long, TSandbox> e, tainted<unsigned long, TSandbox> f)
+{
+	return (int) (a.UNSAFE_Unverified() + b.UNSAFE_Unverified() + c.UNSAFE_Unverified() + d.UNSAFE_Unverified() + e.UNSAFE_Unverified() + f.UNSAFE_Unverified());
+}
+
+//Times the callback receiver on its own and in a round trip through simpleCallbackTest2, against calling the
+//application's callback directly, which is the most a receiver specialized for fundamental arguments could save
+template<typename TSandbox>
+void benchmarkCallbackReceiver(const char* name, const char* libraryPath)
+{
+	const int iterations = 10000000;
+	auto sandbox = RLBoxSandbox<TSandbox>::createSandbox("", libraryPath);
+
+	using TReceiver = int(*)(unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, void*);
+	sandbox_callback_state<TSandbox> state(sandbox, (void*)(uintptr_t) sumCallback<TSandbox>, nullptr, nullptr);
+	volatile TReceiver receiver = sandbox_callback_receiver<TSandbox, int, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long, unsigned long>;
+	volatile int sink = 0;
+	double receiverTime = timeMicroseconds(iterations, [&](int i) { sink = receiver(i, 1, 2, 3, 4, 5, &state); }) * 1000;
+	using TDirect = decltype(&sumCallback<TSandbox>);
+	volatile TDirect direct = sumCallback<TSandbox>;
+	double directTime = timeMicroseconds(iterations, [&](int i) { sink = direct(sandbox, (unsigned long) i, 1ul, 2ul, 3ul, 4ul, 5ul); }) * 1000;
+
+	auto cb = sandbox->createCallback(sumCallback<TSandbox>);
+	double roundTripTime = timeMicroseconds(iterations / 10, [&](int i) {
+		sink = sandbox_invoke(sandbox, simpleCallbackTest2, (unsigned long) i, cb).UNSAFE_Unverified();
+	}) * 1000;
+	(void) sink;
+	cb.unregister();
+
+	printf("Callback receiver, %s (ns)\n", name);
+	printf("%18s %18s %18s\n", "direct", "receiver", "round trip");
+	printf("%18.1f %18.1f %18.1f\n", directTime, receiverTime, roundTripTime);
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
+//Compares copying a whole testStruct out of the sandbox to read some of its fields, with reading them through a
+//tainted_struct_view
+void benchmarkStructView()
+{
+	const int iterations = 10000000;
+	auto sandbox = RLBoxSandbox<RLBox_DynLib>::createSandbox("", "./libtest.so");
+	auto ps = sandbox_invoke(sandbox, simpleTestStructPtr);
+	auto verifyLong = [](unsigned long val) { return val; };
+	auto verifyBool = [](unsigned int val) { return val; };
+
+	volatile unsigned long sink = 0;
+	double copyOneTime = timeMicroseconds(iterations, [&](int i) {
+		sink = ps.copyAndVerify([&](tainted<testStruct, RLBox_DynLib>* val) {
+			testStruct ret;
+			ret.fieldLong = val->fieldLong.copyAndVerify(verifyLong);
+			return ret;
+		}).fieldLong;
+	}) * 1000;
+	double viewOneTime = timeMicroseconds(iterations, [&](int i) {
+		tainted_struct_view<testStruct, RLBox_DynLib> view(ps);
+		sink = view.fieldLong.copyAndVerify(verifyLong);
+	}) * 1000;
+
+	//reads two fields twice each, as code that checks a field and then uses it does
+	double copyTwoTime = timeMicroseconds(iterations, [&](int i) {
+		tainted<testStruct, RLBox_DynLib> copy = *ps;
+		sink = copy.fieldLong.copyAndVerify(verifyLong) + copy.fieldBool.copyAndVerify(verifyBool);
+		sink = copy.fieldLong.copyAndVerify(verifyLong) + copy.fieldBool.copyAndVerify(verifyBool);
+	}) * 1000;
+	double viewTwoTime = timeMicroseconds(iterations, [&](int i) {
+		tainted_struct_view<testStruct, RLBox_DynLib> view(ps);
+		sink = view.fieldLong.copyAndVerify(verifyLong) + view.fieldBool.copyAndVerify(verifyBool);
+		sink = view.fieldLong.copyAndVerify(verifyLong) + view.fieldBool.copyAndVerify(verifyBool);
+	}) * 1000;
+	(void) sink;
+
+	printf("Struct field access, testStruct (ns)\n");
+	printf("%18s %18s %18s %18s\n", "copy, 1 field", "view, 1 field", "copy, 2 fields", "view, 2 fields");
+	printf("%18.1f %18.1f %18.1f %18.1f\n", copyOneTime, viewOneTime, copyTwoTime, viewTwoTime);
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
+//Bandwidth of the checked memory functions against the libc calls they wrap, and of copies out of the sandbox with
+//regular and non-temporal stores
+void benchmarkMemoryFunctions()
+{
+	auto sandbox = RLBoxSandbox<RLBox_DynLib>::createSandbox("", "./libtest.so");
+	auto gbPerSecond = [](size_t size, double us) { return size / us / 1000.0; };
+
+	printf("Checked memory functions (GB/s)\n");
+	printf("%12s %12s %12s %12s %12s %12s %12s %12s %12s\n", "size KB", "memcpy", "libc", "memmove", "libc", "memcmp", "libc", "memchr", "libc");
+	for(size_t size : std::vector<size_t>{ 256, 4096, 64 * 1024, 1024 * 1024 })
+	{
+		const int iterations = (int) std::max((size_t) 100, (size_t) (256ull << 20) / size);
+		auto a = sandbox->mallocInSandbox<char>(size);
+		auto b = sandbox->mallocInSandbox<char>(size);
+		std::memset(a.UNSAFE_Unverified(), 1, size);
+		std::memset(b.UNSAFE_Unverified(), 1, size);
+		char* rawA = a.UNSAFE_Unverified();
+		char* rawB = b.UNSAFE_Unverified();
+		volatile int sink = 0;
+
+		double copyTime = timeMicroseconds(iterations, [&](int i) { memcpy(sandbox, a, b, size); });
+		double libcCopyTime = timeMicroseconds(iterations, [&](int i) { std::memcpy(rawA, rawB, size); sink = rawA[i % size]; });
+		double moveTime = timeMicroseconds(iterations, [&](int i) { memmove(sandbox, a, b, size); });
+		double libcMoveTime = timeMicroseconds(iterations, [&](int i) { std::memmove(rawA, rawB, size); sink = rawA[i % size]; });
+		double cmpTime = timeMicroseconds(iterations, [&](int i) { sink = memcmp(sandbox, a, b, size).UNSAFE_Unverified(); });
+		double libcCmpTime = timeMicroseconds(iterations, [&](int i) { sink = std::memcmp(rawA, rawB, size); });
+		double chrTime = timeMicroseconds(iterations, [&](int i) { sink = memchr(sandbox, a, 2, size) == nullptr; });
+		double libcChrTime = timeMicroseconds(iterations, [&](int i) { sink = std::memchr(rawA, 2, size) == nullptr; });
+		(void) sink;
+
+		printf("%12.2f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n", size / 1024.0,
+			gbPerSecond(size, copyTime), gbPerSecond(size, libcCopyTime), gbPerSecond(size, moveTime), gbPerSecond(size, libcMoveTime),
+			gbPerSecond(size, cmpTime), gbPerSecond(size, libcCmpTime), gbPerSecond(size, chrTime), gbPerSecond(size, libcChrTime));
+		sandbox->freeInSandbox(b);
+		sandbox->freeInSandbox(a);
+	}
+
+	printf("Copy out of the sandbox (GB/s)\n");
+	printf("%12s %18s %18s\n", "size MB", "libc memcpy", "rlbox memcpy");
+	for(size_t size : std::vector<size_t>{ 1ull << 20, 4ull << 20, 16ull << 20, 64ull << 20 })
+	{
+		const int iterations = (int) std::max((size_t) 5, (size_t) (1024ull << 20) / size);
+		auto src = sandbox->mallocInSandbox<char>(size);
+		std::memset(src.UNSAFE_Unverified(), 1, size);
+		std::vector<char> dest(size);
+		double regularTime = timeMicroseconds(iterations, [&](int i) { std::memcpy(dest.data(), src.UNSAFE_Unverified(), size); });
+		//copies from nonTemporalCopyThreshold up use non-temporal stores
+		auto verifyAll = [](char* val, size_t size) { return RLBox_Verify_Status::SAFE; };
+		double rlboxTime = timeMicroseconds(iterations, [&](int i) { memcpy(sandbox, dest.data(), src, size, verifyAll); });
+		printf("%12zu %18.1f %18.1f\n", size >> 20, gbPerSecond(size, regularTime), gbPerSecond(size, rlboxTime));
+		sandbox->freeInSandbox(src);
+	}
+
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
+template<size_t... I>
+static void scatterAndGather(RLBoxSandbox<RLBox_DynLib>* sandbox, char** buffers, size_t size, std::index_sequence<I...>)
+{
+	auto packed = sandbox->scatterarr(sandbox_iov_inout(buffers[I], size)...);
+	packed.gather([](size_t index, void* data, size_t size) { return RLBox_Verify_Status::SAFE; });
+}
+
+//Compares passing N buffers as one heaparr each, with packing them with scatterarr, including copying them back
+template<size_t N>
+void benchmarkScatterGather(size_t size)
+{
+	const int iterations = 200000;
+	auto sandbox = RLBoxSandbox<RLBox_DynLib>::createSandbox("", "./libtest.so");
+	std::vector<std::vector<char>> storage(N, std::vector<char>(size, 1));
+	char* buffers[N];
+	for(size_t i = 0; i < N; i++)
+	{
+		buffers[i] = storage[i].data();
+	}
+
+	double heaparrTime = timeMicroseconds(iterations, [&](int iteration) {
+		std::vector<sandbox_heaparr_helper<char, RLBox_DynLib>> arrs;
+		arrs.reserve(N);
+		for(size_t i = 0; i < N; i++)
+		{
+			arrs.emplace_back(sandbox->heaparr(buffers[i], size));
+		}
+		for(size_t i = 0; i < N; i++)
+		{
+			std::memcpy(buffers[i], arrs[i].UNSAFE_Unverified(), size);
+		}
+	}) * 1000;
+	double scatterTime = timeMicroseconds(iterations, [&](int iteration) {
+		scatterAndGather(sandbox, buffers, size, std::make_index_sequence<N>());
+	}) * 1000;
+
+	printf("%12zu %12zu %18.1f %18.1f\n", N, size, heaparrTime, scatterTime);
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
+//Compares reading a file into a sandbox allocation with mapping it with mapFileInSandbox, for a file that is already in
+//the page cache and is parsed once by the library with strlen
+void benchmarkMapFile(size_t size)
+{
+	const int iterations = 5;
+	auto sandbox = RLBoxSandbox<RLBox_DynLib>::createSandbox("", "./libtest.so");
+	FILE* file = tmpfile();
+	ENSURE(file != nullptr);
+	std::vector<char> chunk(1 << 20, 'a');
+	for(size_t written = 0; written < size; written += chunk.size())
+	{
+		if(written + chunk.size() >= size)
+		{
+			chunk.resize(size - written);
+			chunk.back() = '\0';
+		}
+		ENSURE(fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size());
+	}
+	fflush(file);
+	const int fd = fileno(file);
+
+	double copyTime = timeMicroseconds(iterations, [&](int i) {
+		auto buf = sandbox->mallocInSandbox<char>(size);
+		ENSURE(RLBox_SandboxMemory::readAll(fd, (uintptr_t) buf.UNSAFE_Unverified(), size, 0));
+		auto len = sandbox_invoke(sandbox, simpleStrLenTest, buf).UNSAFE_Unverified();
+		ENSURE(len == size - 1);
+		sandbox->freeInSandbox(buf);
+	});
+	double mapTime = timeMicroseconds(iterations, [&](int i) {
+		auto mapped = sandbox->mapFileInSandbox(fd, 0, size);
+		auto len = sandbox_invoke(sandbox, simpleStrLenTest, mapped).UNSAFE_Unverified();
+		ENSURE(len == size - 1);
+	});
+
+	auto gbPerSecond = [&](double us) { return size / us / 1000.0; };
+	printf("%12zu %12.2f %12.2f\n", size >> 20, gbPerSecond(copyTime), gbPerSecond(mapTime));
+	fclose(file);
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
+//Streams size bytes through uppercaseBuffer, with one call per chunk copying the chunk in and the result out, and
+//through ringBufferUppercase, with a single call reading and writing rings while the application fills and drains them
+//The ring saves the cost of a call per chunk, which is small for the dyn lib and large for the Process and NaCl
+//sandboxes. Its producer, library and consumer threads only run in parallel with a core each
+template<typename TSandbox>
+void benchmarkRingBuffer(const char* name, const char* runtimePath, const char* libraryPath, size_t chunkSize)
+{
+	const size_t size = 256ull << 20;
+	auto sandbox = RLBoxSandbox<TSandbox>::createSandbox(runtimePath, libraryPath);
+	std::vector<char> input(size, 'a');
+	std::vector<char> output(size);
+
+	auto start = std::chrono::steady_clock::now();
+	for(size_t offset = 0; offset < size; offset += chunkSize)
+	{
+		auto buf = sandbox->template mallocInSandbox<char>(chunkSize);
+		memcpy(sandbox, buf, input.data() + offset, chunkSize);
+		sandbox_invoke(sandbox, uppercaseBuffer, buf, chunkSize);
+		char* copy = buf.copyAndVerifyArray(sandbox, [](char* val) { return RLBox_Verify_Status::SAFE; }, chunkSize, nullptr);
+		std::memcpy(output.data() + offset, copy, chunkSize);
+		delete[] copy;
+		sandbox->freeInSandbox(buf);
+	}
+	double perChunkTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	ENSURE(output[size - 1] == 'A');
+	output[size - 1] = 0;
+
+	start = std::chrono::steady_clock::now();
+	{
+		sandbox_ring_buffer<TSandbox> in(sandbox, RLBox_Ring_Direction::TO_SANDBOX, 1 << 20);
+		sandbox_ring_buffer<TSandbox> out(sandbox, RLBox_Ring_Direction::FROM_SANDBOX, 1 << 20);
+		auto signal = sandbox_ring_buffer<TSandbox>::createSignalCallback(sandbox);
+		std::thread library([&]() {
+			sandbox_invoke(sandbox, ringBufferUppercase, in.get(), out.get(), signal);
+		});
+		std::thread producer([&]() {
+			for(size_t offset = 0; offset < size; offset += chunkSize)
+			{
+				ENSURE(in.writeAll(input.data() + offset, chunkSize));
+			}
+			in.close();
+		});
+		size_t received = 0;
+		size_t count;
+		while((count = out.readSome(output.data() + received, std::min(chunkSize, size - received))) != 0)
+		{
+			received += count;
+		}
+		producer.join();
+		library.join();
+		ENSURE(received == size);
+	}
+	double ringTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	ENSURE(output[size - 1] == 'A');
+
+	printf("%12s %12zu %18.2f %18.2f\n", name, chunkSize, size / perChunkTime / 1000.0, size / ringTime / 1000.0);
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
+int main(int argc, char const *argv[])
+{
+	benchmarkSnapshotRestore(false /* shared */);
+	benchmarkSnapshotRestore(true /* shared */);
+	benchmarkClone();
+	benchmarkHugePages();
+	benchmarkCallbackChurn();
+	benchmarkCallbackReceiver<RLBox_MyApp>("my app", "");
+	benchmarkCallbackReceiver<RLBox_DynLib>("dyn lib", "./libtest.so");
+	benchmarkStructView();
+	benchmarkMemoryFunctions();
+	printf("Scatter/gather of N buffers (ns)\n");
+	printf("%12s %12s %18s %18s\n", "buffers", "bytes", "heaparr each", "scatterarr");
+	benchmarkScatterGather<4>(256);
+	benchmarkScatterGather<8>(256);
+	benchmarkScatterGather<16>(256);
+	benchmarkScatterGather<4>(4096);
+	benchmarkScatterGather<16>(4096);
+	printf("Parsing a file in the sandbox (GB/s)\n");
+	printf("%12s %12s %12s\n", "size MB", "read", "mapped");
+	benchmarkMapFile(64ull << 20);
+	benchmarkMapFile(256ull << 20);
+	benchmarkMapFile(1024ull << 20);
+	printf("Streaming 256MB through the sandbox with %u cores (GB/s)\n", std::thread::hardware_concurrency());
+	printf("%12s %12s %18s %18s\n", "sandbox", "chunk bytes", "call per chunk", "ring buffer");
+	for(size_t chunkSize : { (size_t) 256, (size_t) 4096, (size_t) 64 * 1024 })
+	{
+		benchmarkRingBuffer<RLBox_DynLib>("dyn lib", "", "./libtest.so", chunkSize);
+		#ifndef NO_PROCESS
+			benchmarkRingBuffer<RLBox_Process<RLBoxTestProcessSandbox>>("process", "", "../../../ProcessSandbox/ProcessSandbox_otherside_rlboxtest64", chunkSize);
+		#endif
+		#ifndef NO_NACL
+			benchmarkRingBuffer<RLBox_NaCl>("nacl", "../../../Sandboxing_NaCl/native_client/scons-out-firefox/nacl_irt-x86-64/staging/irt_core.nexe", "./libtest.nexe", chunkSize);
+		#endif
+	}
+	return 0;
+}
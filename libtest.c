@@ -3,6 +3,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#if defined(__GLIBC__) || defined(__native_client__)
+	#include <malloc.h>
+#endif
 
 unsigned long simpleAddNoPrintTest(unsigned long a, unsigned long b)
 {
@@ -164,4 +167,51 @@ void simplePointerWrite(int* ptr, int val) {
 
 int simpleCallbackTest2(unsigned long startVal, CallbackType2 cb) {
 	return cb(startVal, startVal+1, startVal+2, startVal+3, startVal+4, startVal+5);
-}
\ No newline at end of file
+}
+
+void uppercaseBuffer(char* buf, unsigned long size)
+{
+	for(unsigned long i = 0; i < size; i++)
+	{
+		if(buf[i] >= 'a' && buf[i] <= 'z')
+		{
+			buf[i] -= 'a' - 'A';
+		}
+	}
+}
+
+//Streams in to out until in is closed, in one call
+unsigned long ringBufferUppercase(struct rlbox_ring* in, struct rlbox_ring* out, RingSignalCallback signal)
+{
+	char buf[4096];
+	unsigned long total = 0;
+	uint32_t count;
+	while((count = rlbox_ring_read_some(in, buf, sizeof(buf), signal)) != 0)
+	{
+		uppercaseBuffer(buf, count);
+		if(!rlbox_ring_write_all(out, buf, count, signal))
+		{
+			break;
+		}
+		total += count;
+	}
+	rlbox_ring_close(out, signal);
+	return total;
+}
+
+//Only called in sandboxes that run the library in another process
+int simpleCrashTest(int a)
+{
+	abort();
+	return a;
+}
+
+//Allocators without malloc_trim keep their free memory, and trimMemory only releases what rlbox knows is free
+int rlbox_malloc_trim(size_t pad)
+{
+	#if defined(__GLIBC__) || defined(__native_client__)
+		return malloc_trim(pad);
+	#else
+		return 0;
+	#endif
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdio.h>
+#include "rlbox_ring.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,6 +56,11 @@ extern "C" {
     int internalCallback(unsigned, const char*, unsigned[1]);
     void simplePointerWrite(int* ptr, int val);
     int simpleCallbackTest2(unsigned long startVal, CallbackType2 cb);
+    void uppercaseBuffer(char* buf, unsigned long size);
+    unsigned long ringBufferUppercase(struct rlbox_ring* in, struct rlbox_ring* out, RingSignalCallback signal);
+    int simpleCrashTest(int a);
+    //Looked up by trimMemory, so the sandbox's allocator gives free heap memory back
+    int rlbox_malloc_trim(size_t pad);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -13,9 +13,32 @@
 #include <functional>
 #include <type_traits>
 #include <map>
+#include <unordered_map>
 #include <cstring>
 #include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <new>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <tuple>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
 
 namespace rlbox_detail {
 	//https://stackoverflow.com/questions/13786888/check-if-member-exists-using-enable-if
@@ -34,6 +57,15 @@ namespace rlbox_detail {
 	using has_member_##member = decltype(hasMemberHelper_##member<T>(TagHasMember_##member()));
 
 	GENERATE_HAS_MEMBER(impl_Handle32bitPointerArrays)
+	GENERATE_HAS_MEMBER(impl_SupportsRestart)
+	GENERATE_HAS_MEMBER(impl_SupportsSnapshot)
+	GENERATE_HAS_MEMBER(impl_SupportsClone)
+	GENERATE_HAS_MEMBER(impl_SupportsMemoryTrim)
+	GENERATE_HAS_MEMBER(impl_SupportsMemoryOptions)
+	GENERATE_HAS_MEMBER(impl_SupportsBatchFree)
+	GENERATE_HAS_MEMBER(impl_SupportsInvokeInto)
+	GENERATE_HAS_MEMBER(impl_SupportsRealloc)
+	GENERATE_HAS_MEMBER(impl_SupportsFileMapping)
 	#undef GENERATE_HAS_MEMBER
 }
 
@@ -248,22 +280,26 @@ namespace rlbox
 	class sandbox_stackarr_helper : public sandbox_wrapper_base, public sandbox_wrapper_base_of<T*>
 	{
 	private:
-		TSandbox* sandbox;
+		RLBoxSandbox<TSandbox>* sandbox;
 		T* field;
 		size_t arrSize;
+		//see getRestartGeneration
+		unsigned long restartGeneration;
 	public:
 
-		sandbox_stackarr_helper(TSandbox* sandbox, T* field, size_t arrSize)
+		sandbox_stackarr_helper(RLBoxSandbox<TSandbox>* sandbox, T* field, size_t arrSize, unsigned long restartGeneration)
 		{
 			this->sandbox = sandbox;
 			this->field = field;
 			this->arrSize = arrSize;
+			this->restartGeneration = restartGeneration;
 		}
 		sandbox_stackarr_helper(sandbox_stackarr_helper&& other)
 		{
 			sandbox = other.sandbox;
 			field = other.field;
 			arrSize = other.arrSize;
+			restartGeneration = other.restartGeneration;
 			other.sandbox = nullptr;
 			other.field = nullptr;
 			other.arrSize = 0;
@@ -276,6 +312,7 @@ namespace rlbox
 				sandbox = other.sandbox;
 				field = other.field;
 				arrSize = other.arrSize;
+				restartGeneration = other.restartGeneration;
 				other.sandbox = nullptr;
 				other.field = nullptr;
 				other.arrSize = 0;
@@ -284,9 +321,9 @@ namespace rlbox
 
 		~sandbox_stackarr_helper()
 		{
-			if(field != nullptr)
+			if(field != nullptr && restartGeneration == sandbox->getRestartGeneration())
 			{
-				sandbox->impl_popStackArr((my_remove_const_t<T>*) field, arrSize);
+				sandbox->trackedPopStackArr((my_remove_const_t<T>*) field, arrSize);
 			}
 		}
 
@@ -298,21 +335,25 @@ namespace rlbox
 	class sandbox_heaparr_helper : public sandbox_wrapper_base, public sandbox_wrapper_base_of<T*>
 	{
 	private:
-		TSandbox* sandbox;
+		RLBoxSandbox<TSandbox>* sandbox;
 		T* field;
+		//see getRestartGeneration
+		unsigned long restartGeneration;
 	public:
 
 		sandbox_heaparr_helper(sandbox_heaparr_helper&& other)
 		{
 			sandbox = other.sandbox;
 			field = other.field;
+			restartGeneration = other.restartGeneration;
 			other.sandbox = nullptr;
 			other.field = nullptr;
 		}
-		sandbox_heaparr_helper(TSandbox* sandbox, T* field)
+		sandbox_heaparr_helper(RLBoxSandbox<TSandbox>* sandbox, T* field, unsigned long restartGeneration)
 		{
 			this->sandbox = sandbox;
 			this->field = field;
+			this->restartGeneration = restartGeneration;
 		}
 
 		sandbox_heaparr_helper& operator=(const sandbox_heaparr_helper&& other)  
@@ -321,6 +362,7 @@ namespace rlbox
 			{
 				sandbox = other.sandbox;
 				field = other.field;
+				restartGeneration = other.restartGeneration;
 				other.sandbox = nullptr;
 				other.field = nullptr;
 			}
@@ -328,9 +370,9 @@ namespace rlbox
 
 		~sandbox_heaparr_helper()
 		{
-			if(field != nullptr)
+			if(field != nullptr && restartGeneration == sandbox->getRestartGeneration())
 			{
-				sandbox->impl_freeInSandbox((my_remove_const_t<T>*) field);
+				sandbox->trackedFreeInSandbox((my_remove_const_t<T>*) field);
 			}
 		}
 
@@ -339,15 +381,322 @@ namespace rlbox
 	};
 
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	//Use a custom enum for returns as boolean returns are a bad idea
+	//int returns are automatically cast to a boolean
+	//Some APIs have overloads with boolean and non returns, so best to use a custom class
+	enum class RLBox_Verify_Status
+	{
+		SAFE, UNSAFE
+	};
+
+	//An application buffer of size bytes for scatterarr. sandbox_iov buffers are only copied into the sandbox,
+	//sandbox_iov_out buffers are only copied back by gather, and sandbox_iov_inout buffers are both
+	template <typename T>
+	class sandbox_iovec
+	{
+	public:
+		T* base;
+		size_t size;
+		bool copyIn;
+		bool copyOut;
+	};
+
+	template <typename T>
+	inline sandbox_iovec<T> sandbox_iov(T* base, size_t size)
+	{
+		return sandbox_iovec<T> { base, size, true /* copyIn */, false /* copyOut */ };
+	}
+
+	template <typename T>
+	inline sandbox_iovec<T> sandbox_iov_out(T* base, size_t size)
+	{
+		static_assert(!std::is_const<T>::value, "Output buffers must not be const");
+		return sandbox_iovec<T> { base, size, false /* copyIn */, true /* copyOut */ };
+	}
+
+	template <typename T>
+	inline sandbox_iovec<T> sandbox_iov_inout(T* base, size_t size)
+	{
+		static_assert(!std::is_const<T>::value, "Output buffers must not be const");
+		return sandbox_iovec<T> { base, size, true /* copyIn */, true /* copyOut */ };
+	}
+
+	//Several application buffers packed into one sandbox allocation, which is freed with the helper
+	//If the allocation fails, every buffer is a null pointer
+	template <typename TSandbox, typename... T>
+	class sandbox_scatter_helper
+	{
+		static_assert(sizeof...(T) > 0, "scatterarr needs at least one buffer");
+		static const size_t bufferCount = sizeof...(T);
+		static const size_t bufferAlignment = 16;
+
+	private:
+		RLBoxSandbox<TSandbox>* sandbox = nullptr;
+		char* block = nullptr;
+		//see getRestartGeneration
+		unsigned long restartGeneration = 0;
+		void* appBuffers[bufferCount];
+		size_t sizes[bufferCount];
+		size_t offsets[bufferCount];
+		bool copyBack[bufferCount];
+
+		template <size_t... I>
+		inline std::tuple<tainted<T*, TSandbox>...> viewsHelper(std::index_sequence<I...>) const
+		{
+			return std::make_tuple(get<I>()...);
+		}
+
+	public:
+		sandbox_scatter_helper(RLBoxSandbox<TSandbox>* sandbox, const sandbox_iovec<T>&... iovs) : sandbox(sandbox)
+		{
+			void* bases[] = { (void*) iovs.base... };
+			size_t bufferSizes[] = { iovs.size... };
+			bool copyIn[] = { iovs.copyIn... };
+			bool copyOut[] = { iovs.copyOut... };
+
+			size_t total = 0;
+			for(size_t i = 0; i < bufferCount; i++)
+			{
+				appBuffers[i] = bases[i];
+				sizes[i] = bufferSizes[i];
+				copyBack[i] = copyOut[i];
+				offsets[i] = total;
+				if(bufferSizes[i] > SIZE_MAX - total - bufferAlignment)
+				{
+					return;
+				}
+				total = (total + bufferSizes[i] + bufferAlignment - 1) & ~(bufferAlignment - 1);
+			}
+
+			restartGeneration = sandbox->getRestartGeneration();
+			block = (char*) sandbox->trackedMallocAlignedInSandbox(total, bufferAlignment);
+			if(block == nullptr)
+			{
+				return;
+			}
+			if(!sandbox->isRangeInSandboxMemory(block, total))
+			{
+				abort();
+			}
+			for(size_t i = 0; i < bufferCount; i++)
+			{
+				if(copyIn[i] && sizes[i] != 0)
+				{
+					std::memcpy(block + offsets[i], appBuffers[i], sizes[i]);
+				}
+			}
+		}
+
+		sandbox_scatter_helper(const sandbox_scatter_helper&) = delete;
+		sandbox_scatter_helper& operator=(const sandbox_scatter_helper&) = delete;
+
+		sandbox_scatter_helper(sandbox_scatter_helper&& other)
+		{
+			sandbox = other.sandbox;
+			block = other.block;
+			restartGeneration = other.restartGeneration;
+			for(size_t i = 0; i < bufferCount; i++)
+			{
+				appBuffers[i] = other.appBuffers[i];
+				sizes[i] = other.sizes[i];
+				offsets[i] = other.offsets[i];
+				copyBack[i] = other.copyBack[i];
+			}
+			other.block = nullptr;
+		}
+
+		~sandbox_scatter_helper()
+		{
+			if(block != nullptr && restartGeneration == sandbox->getRestartGeneration())
+			{
+				sandbox->trackedFreeInSandbox(block);
+			}
+		}
+
+		template <size_t I>
+		inline tainted<typename std::tuple_element<I, std::tuple<T...>>::type*, TSandbox> get() const
+		{
+			using TElem = typename std::tuple_element<I, std::tuple<T...>>::type;
+			TElem* p = block != nullptr? (TElem*) (block + offsets[I]) : nullptr;
+			return *((tainted<TElem*, TSandbox>*) &p);
+		}
+
+		inline std::tuple<tainted<T*, TSandbox>...> views() const
+		{
+			return viewsHelper(std::index_sequence_for<T...>());
+		}
+
+		//Copies the sandbox_iov_out and sandbox_iov_inout buffers back to the application, and passes each copy to
+		//verifyFunction with the buffer's index. Copies that fail verification are cleared
+		//Returns false if any copy failed, or if there was no allocation or the sandbox was restarted since
+		bool gather(std::function<RLBox_Verify_Status(size_t, void*, size_t)> verifyFunction) const
+		{
+			if(block == nullptr || restartGeneration != sandbox->getRestartGeneration())
+			{
+				return false;
+			}
+			bool ret = true;
+			for(size_t i = 0; i < bufferCount; i++)
+			{
+				if(!copyBack[i])
+				{
+					continue;
+				}
+				if(sizes[i] != 0)
+				{
+					std::memcpy(appBuffers[i], block + offsets[i], sizes[i]);
+				}
+				if(verifyFunction(i, appBuffers[i], sizes[i]) != RLBox_Verify_Status::SAFE)
+				{
+					std::memset(appBuffers[i], 0, sizes[i]);
+					ret = false;
+				}
+			}
+			return ret;
+		}
+	};
+
+	//A range of a file in sandbox memory from mapFileInSandbox, which is unmapped and freed with the helper
+	//If the file could not be mapped or read, the data is a null pointer
+	template <typename TSandbox>
+	class sandbox_mapped_file_helper : public sandbox_wrapper_base, public sandbox_wrapper_base_of<const char*>
+	{
+	private:
+		RLBoxSandbox<TSandbox>* sandbox = nullptr;
+		//the page aligned allocation holding the file pages
+		char* region = nullptr;
+		size_t regionSize = 0;
+		const char* field = nullptr;
+		size_t length = 0;
+		bool mapped = false;
+		//helpers from mapFileInSandbox hold off snapshots and restores, shared blobs don't
+		bool blocksSnapshot = false;
+		//see getRestartGeneration
+		unsigned long restartGeneration = 0;
+
+	public:
+		sandbox_mapped_file_helper() = default;
+		sandbox_mapped_file_helper(RLBoxSandbox<TSandbox>* sandbox, char* region, size_t regionSize, const char* field, size_t length, bool mapped, bool blocksSnapshot, unsigned long restartGeneration) :
+			sandbox(sandbox), region(region), regionSize(regionSize), field(field), length(length), mapped(mapped), blocksSnapshot(blocksSnapshot), restartGeneration(restartGeneration)
+		{
+		}
+
+		sandbox_mapped_file_helper(const sandbox_mapped_file_helper&) = delete;
+		sandbox_mapped_file_helper& operator=(const sandbox_mapped_file_helper&) = delete;
+
+		sandbox_mapped_file_helper(sandbox_mapped_file_helper&& other)
+		{
+			sandbox = other.sandbox;
+			region = other.region;
+			regionSize = other.regionSize;
+			field = other.field;
+			length = other.length;
+			mapped = other.mapped;
+			blocksSnapshot = other.blocksSnapshot;
+			restartGeneration = other.restartGeneration;
+			other.region = nullptr;
+			other.field = nullptr;
+		}
+
+		~sandbox_mapped_file_helper()
+		{
+			if(region != nullptr)
+			{
+				sandbox->trackedUnmapFileInSandbox(region, regionSize, mapped, blocksSnapshot, restartGeneration);
+			}
+		}
+
+		inline tainted<const char*, TSandbox> get() const
+		{
+			return *((tainted<const char*, TSandbox>*) &field);
+		}
+
+		//Gives up the memory without unmapping or freeing it, for memory the sandbox no longer has, e.g. after a restore
+		inline void release()
+		{
+			region = nullptr;
+			field = nullptr;
+		}
+
+		inline size_t size() const { return length; }
+		//false if the file was copied in because the backend can't map files into its memory
+		inline bool isMapped() const { return mapped; }
+
+		inline const char* UNSAFE_Unverified() const noexcept { return field; }
+		inline const char* UNSAFE_Sandboxed(RLBoxSandbox<TSandbox>* sandboxP) const noexcept { return (const char*) sandboxP->getSandboxedPointer(field); }
+	};
+
 
 	template <typename TSandbox>
 	class sandbox_callback_state
 	{
+	private:
+		template<typename TStored>
+		static void copyCallableHelper(sandbox_callback_state* dest, const void* src)
+		{
+			dest->storeCallable(*(const TStored*) src);
+		}
+
+		template<typename TStored, RLBOX_ENABLE_IF(std::is_copy_constructible<TStored>::value)>
+		inline void setCopyCallable()
+		{
+			copyCallable = copyCallableHelper<TStored>;
+		}
+
+		template<typename TStored, RLBOX_ENABLE_IF(!std::is_copy_constructible<TStored>::value)>
+		inline void setCopyCallable()
+		{
+			copyCallable = nullptr;
+		}
+
 	public:
+		static const size_t inlineCallableSize = 4 * sizeof(void*);
+
 		RLBoxSandbox<TSandbox>* const sandbox;
-		void* const actualCallback;
-		sandbox_callback_state(RLBoxSandbox<TSandbox>* p_sandbox, void* p_actualCallback) : sandbox(p_sandbox), actualCallback(p_actualCallback)
+		//the application's function, or the function object for callbacks created from one
+		void* actualCallback;
+		//type erased registration, so that the sandbox can drop callbacks on reset and recreate them in clones without knowing their types
+		void* (* const registerCallback)(RLBoxSandbox<TSandbox>*, sandbox_callback_state<TSandbox>*);
+		void (* const unregisterCallback)(RLBoxSandbox<TSandbox>*, void*);
+		//the value the sandbox uses to call the callback
+		void* registeredAddress = nullptr;
+		//callback helpers sharing this registration, see createCallback
+		unsigned long refCount = 0;
+		//function objects that fit are kept here, larger ones are heap allocated
+		alignas(std::max_align_t) unsigned char callableStorage[inlineCallableSize];
+		void (*destroyCallable)(void*) = nullptr;
+		//null for function objects that can't be copied into a clone
+		void (*copyCallable)(sandbox_callback_state*, const void*) = nullptr;
+
+		sandbox_callback_state(RLBoxSandbox<TSandbox>* p_sandbox, void* p_actualCallback, void* (*p_registerCallback)(RLBoxSandbox<TSandbox>*, sandbox_callback_state<TSandbox>*), void (*p_unregisterCallback)(RLBoxSandbox<TSandbox>*, void*)) : sandbox(p_sandbox), actualCallback(p_actualCallback), registerCallback(p_registerCallback), unregisterCallback(p_unregisterCallback)
+		{
+		}
+
+		sandbox_callback_state(const sandbox_callback_state&) = delete;
+		sandbox_callback_state& operator=(const sandbox_callback_state&) = delete;
+
+		~sandbox_callback_state()
+		{
+			if(destroyCallable)
+			{
+				destroyCallable(actualCallback);
+			}
+		}
+
+		template<typename TFunc, typename TStored = my_decay_t<TFunc>, RLBOX_ENABLE_IF(sizeof(TStored) <= inlineCallableSize && alignof(TStored) <= alignof(std::max_align_t))>
+		void storeCallable(TFunc&& callable)
+		{
+			actualCallback = new (callableStorage) TStored(std::forward<TFunc>(callable));
+			destroyCallable = [](void* p) { ((TStored*) p)->~TStored(); };
+			setCopyCallable<TStored>();
+		}
+
+		template<typename TFunc, typename TStored = my_decay_t<TFunc>, RLBOX_ENABLE_IF(!(sizeof(TStored) <= inlineCallableSize && alignof(TStored) <= alignof(std::max_align_t)))>
+		void storeCallable(TFunc&& callable)
 		{
+			actualCallback = new TStored(std::forward<TFunc>(callable));
+			destroyCallable = [](void* p) { delete (TStored*) p; };
+			setCopyCallable<TStored>();
 		}
 	};
 
@@ -355,7 +704,7 @@ namespace rlbox
 	class sandbox_callback_helper : public sandbox_wrapper_base, public sandbox_wrapper_base_of<T*>
 	{
 	private:
-		TSandbox* sandbox;
+		RLBoxSandbox<TSandbox>* sandbox;
 		T* registeredCallback;
 		sandbox_callback_state<TSandbox>* stateObject;
 	public:
@@ -367,7 +716,7 @@ namespace rlbox
 			this->stateObject = nullptr;
 		}
 
-		sandbox_callback_helper(TSandbox* sandbox, T* registeredCallback, sandbox_callback_state<TSandbox>* stateObject)
+		sandbox_callback_helper(RLBoxSandbox<TSandbox>* sandbox, T* registeredCallback, sandbox_callback_state<TSandbox>* stateObject)
 		{
 			this->sandbox = sandbox;
 			this->registeredCallback = registeredCallback;
@@ -387,6 +736,7 @@ namespace rlbox
 		{
 			if (this != &other)  
 			{
+				unregister();
 				registeredCallback = other.registeredCallback;
 				sandbox = other.sandbox;
 				stateObject = other.stateObject;
@@ -401,8 +751,7 @@ namespace rlbox
 		{
 			if(registeredCallback != nullptr)
 			{
-				sandbox->template impl_UnregisterCallback<T>(stateObject->actualCallback);
-				delete stateObject;
+				sandbox->releaseCallbackReference(stateObject);
 				this->sandbox = nullptr;
 				this->registeredCallback = nullptr;
 				this->stateObject = nullptr;
@@ -473,14 +822,42 @@ namespace rlbox
 		return actualCallback(stateObj->sandbox, sandbox_convertToUnverified<TArgs>(stateObj->sandbox, params)...);
 	}
 
+	template <typename TSandbox, typename TRet, typename... TArgs>
+	void* sandbox_callback_register(RLBoxSandbox<TSandbox>* sandbox, sandbox_callback_state<TSandbox>* stateObject)
+	{
+		void* callbackReciever = (void*)(uintptr_t) sandbox_callback_receiver<TSandbox, TRet, TArgs...>;
+		return sandbox->template impl_RegisterCallback<TRet, TArgs...>(stateObject->actualCallback, callbackReciever, (void*)stateObject);
+	}
+
+	template <typename TSandbox, typename TFunc, typename TRet, typename... TArgs>
+	__attribute__ ((noinline)) TRet sandbox_callback_receiver_callable(TArgs... params, void* state)
+	{
+		auto stateObj = static_cast<sandbox_callback_state<TSandbox>*>(state);
+		TFunc* callable = (TFunc*) stateObj->actualCallback;
+		return (*callable)(stateObj->sandbox, sandbox_convertToUnverified<TArgs>(stateObj->sandbox, params)...);
+	}
+
+	template <typename TSandbox, typename TFunc, typename TRet, typename... TArgs>
+	void* sandbox_callback_register_callable(RLBoxSandbox<TSandbox>* sandbox, sandbox_callback_state<TSandbox>* stateObject)
+	{
+		void* callbackReciever = (void*)(uintptr_t) sandbox_callback_receiver_callable<TSandbox, TFunc, TRet, TArgs...>;
+		//the function object's address is unique to the state, so it serves as the key
+		return sandbox->template impl_RegisterCallback<TRet, TArgs...>(stateObject->actualCallback, callbackReciever, (void*)stateObject);
+	}
+
+	template <typename TSandbox, typename TFunc>
+	void sandbox_callback_unregister(RLBoxSandbox<TSandbox>* sandbox, void* key)
+	{
+		sandbox->template impl_UnregisterCallback<TFunc>(key);
+	}
+
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	//Use a custom enum for returns as boolean returns are a bad idea
-	//int returns are automatically cast to a boolean
-	//Some APIs have overloads with boolean and non returns, so best to use a custom class
-	enum class RLBox_Verify_Status
+	//Backends that can recover from a crash of the sandboxed library report it through this status
+	//When the sandbox died, the tainted value returned by the invoke is zero initialized
+	enum class RLBox_Invoke_Status
 	{
-		SAFE, UNSAFE
+		SUCCESS, SANDBOX_DIED
 	};
 
 	template<typename TField, typename T, RLBOX_ENABLE_IF(!my_is_class_v<T> && !my_is_reference_v<T> && !my_is_array_v<T>)>
@@ -1602,106 +1979,421 @@ namespace rlbox
 		return temp;
 	}
 
-	#define helper_tainted_createField(fieldType, fieldName, isFrozen, TSandbox) tainted<fieldType, TSandbox> fieldName;
-	#define helper_tainted_volatile_createField(fieldType, fieldName, isFrozen, TSandbox) my_conditional_t<isFrozen == 0, tainted_volatile<fieldType, TSandbox>, tainted_freezable_volatile<fieldType, TSandbox>> fieldName;
-	#define helper_noOp()
-	#define helper_fieldInit(fieldType, fieldName, isFrozen, TSandbox) fieldName = p.fieldName;
-	#define helper_fieldCopy(fieldType, fieldName, isFrozen, TSandbox) { tainted<fieldType, TSandbox> temp = convertToTaintedField(fieldName); std::memcpy((void*) &(ret.fieldName), (void*) &temp, sizeof(ret.fieldName)); }
-	#define helper_fieldCopyUnsandbox(fieldType, fieldName, isFrozen, TSandbox) { auto temp = fieldName.UNSAFE_Sandboxed(sandbox); std::memcpy((void*) &(ret.fieldName), (void*) &temp, sizeof(ret.fieldName)); }
-	#define helper_fieldUnsandbox(fieldType, fieldName, isFrozen, TSandbox) fieldName.unsandboxPointersOrNull(sandbox);
+	//A range of count elements in sandbox memory. The range is checked once when the span is created, so element access,
+	//iteration and sub-spans need no further checks. The sandbox can still change the elements, so they are accessed as
+	//tainted_volatile
+	template<typename T, typename TSandbox>
+	class tainted_vector;
 
-	#define tainted_data_specialization(T, libId, TSandbox) \
-	template<> \
-	class tainted_volatile<T, TSandbox> \
-	{ \
-	public: \
-		sandbox_fields_reflection_##libId##_class_##T(helper_tainted_volatile_createField, helper_noOp, TSandbox) \
-		\
-		inline T UNSAFE_Unverified() const noexcept \
-		{ \
-			T ret; \
-			sandbox_fields_reflection_##libId##_class_##T(helper_fieldCopy, helper_noOp, TSandbox) \
-			return ret;\
-		} \
-		\
-		inline T UNSAFE_Sandboxed(RLBoxSandbox<TSandbox>* sandbox) const noexcept \
-		{ \
-			return *((T*)this); \
-		} \
-		\
-		inline T copyAndVerify(std::function<T(tainted_volatile<T, TSandbox>&)> verifyFunction) \
-		{ \
-			return verifyFunction(*this); \
-		} \
-		\
-		inline tainted<T*, TSandbox> operator&() const noexcept \
-		{ \
-			auto structAddr = (T*)this; \
-			return *((tainted<T*, TSandbox>*)&structAddr); \
-		} \
-	};\
-	template<> \
-	class tainted<T, TSandbox> \
-	{ \
-	public: \
-		sandbox_fields_reflection_##libId##_class_##T(helper_tainted_createField, helper_noOp, TSandbox) \
-		tainted() = default; \
-		tainted(const tainted<T, TSandbox>& p) = default; \
-		\
-		tainted(const tainted_volatile<T, TSandbox>& p) \
-		{ \
-			sandbox_fields_reflection_##libId##_class_##T(helper_fieldInit, helper_noOp, TSandbox) \
-		} \
- 		\
-		inline T UNSAFE_Unverified() const noexcept \
-		{ \
-			/* Can't reinterpret_cast due to constness */ \
-			return *((T*)this); \
-		} \
-		 \
-		inline T UNSAFE_Sandboxed(RLBoxSandbox<TSandbox>* sandbox) const noexcept \
-		{ \
-			T ret; \
-			sandbox_fields_reflection_##libId##_class_##T(helper_fieldCopyUnsandbox, helper_noOp, TSandbox) \
-			return ret;\
-		} \
-		\
-		inline T copyAndVerify(std::function<T(tainted<T, TSandbox>&)> verifyFunction) \
-		{ \
-			return verifyFunction(*this); \
-		} \
-		\
-		template<typename TRHS, RLBOX_ENABLE_IF(my_is_assignable_v<T&, TRHS>)> \
-		inline tainted<T, TSandbox>& operator=(const TRHS& p) noexcept \
-		{ \
-			sandbox_fields_reflection_##libId##_class_##T(helper_fieldInit, helper_noOp, TSandbox) \
-			return *this; \
-		} \
-		\
-		template<typename TRHS, RLBOX_ENABLE_IF(my_is_assignable_v<T&, TRHS>)> \
-		inline tainted<T, TSandbox>& operator=(const tainted_volatile<TRHS, TSandbox>& p) noexcept \
-		{ \
-			sandbox_fields_reflection_##libId##_class_##T(helper_fieldInit, helper_noOp, TSandbox) \
-			return *this; \
-		} \
-		\
-		inline void unsandboxPointersOrNull(RLBoxSandbox<TSandbox>* sandbox) \
-		{ \
-			sandbox_fields_reflection_##libId##_class_##T(helper_fieldUnsandbox, helper_noOp, TSandbox)\
-		} \
-	};
+	template<typename T, typename TSandbox>
+	class tainted_span
+	{
+		template<typename U, typename USandbox>
+		friend class tainted_vector;
 
-	#define rlbox_load_library_api(libId, TSandbox) namespace rlbox { \
-		sandbox_fields_reflection_##libId##_allClasses(tainted_data_specialization, TSandbox) \
-	}
+	private:
+		T* start = nullptr;
+		size_t count = 0;
 
-	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+		tainted_span(T* start, size_t count) : start(start), count(count)
+		{
+		}
 
-	template <typename TSandbox, typename T, RLBOX_ENABLE_IF(!my_is_base_of_v<sandbox_wrapper_base, T>)>
-	inline T sandbox_removeWrapper(RLBoxSandbox<TSandbox>* sandbox, T& arg)
-	{
-		return arg;
-	}
+	public:
+		using element_type = tainted_volatile<T, TSandbox>;
+		using iterator = element_type*;
+
+		tainted_span() = default;
+
+		tainted_span(RLBoxSandbox<TSandbox>* sandbox, tainted<T*, TSandbox> ptr, size_t count) : start(ptr.UNSAFE_Unverified()), count(count)
+		{
+			if(count > SIZE_MAX / sizeof(T) || !sandbox->isRangeInSandboxMemory(start, count * sizeof(T)))
+			{
+				printf("tainted_span is not in sandbox memory\n");
+				abort();
+			}
+		}
+
+		inline size_t size() const noexcept { return count; }
+		inline bool empty() const noexcept { return count == 0; }
+
+		inline element_type& operator[](size_t i) const noexcept
+		{
+			return ((element_type*) start)[i];
+		}
+
+		inline iterator begin() const noexcept { return (iterator) start; }
+		inline iterator end() const noexcept { return ((iterator) start) + count; }
+
+		inline tainted_span<T, TSandbox> subspan(size_t offset, size_t subCount) const
+		{
+			if(offset > count || subCount > count - offset)
+			{
+				printf("tainted_span::subspan out of range\n");
+				abort();
+			}
+			return tainted_span<T, TSandbox>(start + offset, subCount);
+		}
+
+		inline tainted<T*, TSandbox> data() const noexcept
+		{
+			return *((tainted<T*, TSandbox>*) &start);
+		}
+
+		inline T* UNSAFE_Unverified() const noexcept { return start; }
+	};
+
+	//A growable array whose storage is in sandbox memory, for building lists that are handed to the library
+	//Storage grows geometrically through reallocInSandbox, which extends the allocation in place when the backend can
+	//Operations that allocate return false if the sandbox is out of memory or over its hard quota, leaving the vector as it was
+	//After the backend replaced a crashed sandbox, the next operation that changes the vector empties it
+	template<typename T, typename TSandbox>
+	class tainted_vector
+	{
+		static_assert(my_is_fundamental_or_enum_v<T>, "tainted_vector only holds fundamental or enum types");
+
+	private:
+		RLBoxSandbox<TSandbox>* sandbox = nullptr;
+		tainted<T*, TSandbox> elements = nullptr;
+		size_t count = 0;
+		size_t elementCapacity = 0;
+		//of the storage, see getRestartGeneration
+		unsigned long restartGeneration = 0;
+
+		void release()
+		{
+			if(elements != nullptr && restartGeneration == sandbox->getRestartGeneration())
+			{
+				sandbox->freeInSandbox(elements);
+			}
+			elements = nullptr;
+			count = 0;
+			elementCapacity = 0;
+		}
+
+		//Storage of a sandbox that was replaced since is given up, as it can't be grown or handed to the new sandbox
+		inline void dropIfRestarted()
+		{
+			if(elements != nullptr && restartGeneration != sandbox->getRestartGeneration())
+			{
+				elements = nullptr;
+				count = 0;
+				elementCapacity = 0;
+			}
+		}
+
+	public:
+		tainted_vector(RLBoxSandbox<TSandbox>* sandbox) : sandbox(sandbox)
+		{
+		}
+
+		tainted_vector(const tainted_vector<T, TSandbox>&) = delete;
+		tainted_vector<T, TSandbox>& operator=(const tainted_vector<T, TSandbox>&) = delete;
+
+		tainted_vector(tainted_vector<T, TSandbox>&& other) noexcept : sandbox(other.sandbox), elements(other.elements), count(other.count), elementCapacity(other.elementCapacity), restartGeneration(other.restartGeneration)
+		{
+			other.elements = nullptr;
+			other.count = 0;
+			other.elementCapacity = 0;
+		}
+
+		tainted_vector<T, TSandbox>& operator=(tainted_vector<T, TSandbox>&& other) noexcept
+		{
+			if(this != &other)
+			{
+				release();
+				sandbox = other.sandbox;
+				elements = other.elements;
+				count = other.count;
+				elementCapacity = other.elementCapacity;
+				restartGeneration = other.restartGeneration;
+				other.elements = nullptr;
+				other.count = 0;
+				other.elementCapacity = 0;
+			}
+			return *this;
+		}
+
+		~tainted_vector()
+		{
+			release();
+		}
+
+		inline size_t size() const noexcept { return count; }
+		inline size_t capacity() const noexcept { return elementCapacity; }
+		inline bool empty() const noexcept { return count == 0; }
+
+		bool reserve(size_t newCapacity)
+		{
+			dropIfRestarted();
+			if(newCapacity <= elementCapacity)
+			{
+				return true;
+			}
+			if(newCapacity > UINT32_MAX)
+			{
+				return false;
+			}
+			const unsigned long generation = sandbox->getRestartGeneration();
+			//the old size is passed, as it is only recorded while memory accounting is on
+			auto newElements = sandbox->template reallocInSandbox<T>(elements, (unsigned int) elementCapacity, (unsigned int) newCapacity);
+			if(newElements == nullptr)
+			{
+				return false;
+			}
+			elements = newElements;
+			restartGeneration = generation;
+			elementCapacity = newCapacity;
+			return true;
+		}
+
+		bool push_back(T val)
+		{
+			dropIfRestarted();
+			if(count == elementCapacity && !reserve(std::max(elementCapacity * 2, (size_t) 8)))
+			{
+				return false;
+			}
+			elements.UNSAFE_Unverified()[count++] = val;
+			return true;
+		}
+
+		void pop_back()
+		{
+			if(count != 0)
+			{
+				count--;
+			}
+		}
+
+		//New elements are zeroed
+		bool resize(size_t newCount)
+		{
+			dropIfRestarted();
+			if(newCount > elementCapacity && !reserve(std::max(elementCapacity * 2, newCount)))
+			{
+				return false;
+			}
+			if(newCount > count)
+			{
+				memset(elements.UNSAFE_Unverified() + count, 0, (newCount - count) * sizeof(T));
+			}
+			count = newCount;
+			return true;
+		}
+
+		void clear()
+		{
+			count = 0;
+		}
+
+		inline tainted_volatile<T, TSandbox>& operator[](size_t i) const
+		{
+			if(i >= count)
+			{
+				printf("tainted_vector index %zu out of range\n", i);
+				abort();
+			}
+			return ((tainted_volatile<T, TSandbox>*) elements.UNSAFE_Unverified())[i];
+		}
+
+		//For passing to sandbox_invoke. The pointer changes when the vector grows
+		inline tainted<T*, TSandbox> data() const noexcept
+		{
+			return elements;
+		}
+
+		inline tainted_span<T, TSandbox> span() const noexcept
+		{
+			return tainted_span<T, TSandbox>(elements.UNSAFE_Unverified(), count);
+		}
+
+		//Copies the elements into copy, which holds sizeOfCopy bytes, and passes them to verifyFunction
+		//On failure the copy is cleared
+		bool copyAndVerify(T* copy, size_t sizeOfCopy, std::function<RLBox_Verify_Status(T*, size_t)> verifyFunction) const
+		{
+			const size_t size = count * sizeof(T);
+			if(sizeOfCopy < size)
+			{
+				return false;
+			}
+			if(size != 0)
+			{
+				memcpy(copy, elements.UNSAFE_Unverified(), size);
+			}
+			if(verifyFunction(copy, count) == RLBox_Verify_Status::SAFE)
+			{
+				return true;
+			}
+			memset(copy, 0, size);
+			return false;
+		}
+	};
+
+	template<typename T, typename TSandbox>
+	class tainted_struct_view;
+
+	//A field of a tainted_struct_view. The field is copied out of sandbox memory on first use, so later reads see the same
+	//value even if the sandbox changes it. Each copyAndVerify still runs its own verifier on that copy
+	template<typename T, typename TField, typename TSandbox>
+	class tainted_struct_view_field
+	{
+		template<typename U, typename USandbox>
+		friend class tainted_struct_view;
+
+	private:
+		const TField* field = nullptr;
+		bool copied = false;
+		tainted<T, TSandbox> copy;
+
+	public:
+		inline const tainted<T, TSandbox>& get()
+		{
+			if(!copied)
+			{
+				copy = convertToTaintedField(*field);
+				copied = true;
+			}
+			return copy;
+		}
+
+		inline auto UNSAFE_Unverified()
+		{
+			return get().UNSAFE_Unverified();
+		}
+
+		template<typename T2=T, RLBOX_ENABLE_IF(my_is_fundamental_or_enum_v<T2>)>
+		inline T2 copyAndVerify(std::function<valid_return_t<T>(T)> verifyFunction)
+		{
+			return get().copyAndVerify(verifyFunction);
+		}
+
+		template<typename T2=T, RLBOX_ENABLE_IF(my_is_fundamental_or_enum_v<T2>)>
+		inline T2 copyAndVerify(std::function<RLBox_Verify_Status(T)> verifyFunction, T defaultValue)
+		{
+			return get().copyAndVerify(verifyFunction, defaultValue);
+		}
+	};
+
+	#define helper_tainted_createField(fieldType, fieldName, isFrozen, TSandbox) tainted<fieldType, TSandbox> fieldName;
+	#define helper_tainted_volatile_createField(fieldType, fieldName, isFrozen, TSandbox) my_conditional_t<isFrozen == 0, tainted_volatile<fieldType, TSandbox>, tainted_freezable_volatile<fieldType, TSandbox>> fieldName;
+	#define helper_noOp()
+	#define helper_fieldInit(fieldType, fieldName, isFrozen, TSandbox) fieldName = p.fieldName;
+	#define helper_fieldCopy(fieldType, fieldName, isFrozen, TSandbox) { tainted<fieldType, TSandbox> temp = convertToTaintedField(fieldName); std::memcpy((void*) &(ret.fieldName), (void*) &temp, sizeof(ret.fieldName)); }
+	#define helper_fieldCopyUnsandbox(fieldType, fieldName, isFrozen, TSandbox) { auto temp = fieldName.UNSAFE_Sandboxed(sandbox); std::memcpy((void*) &(ret.fieldName), (void*) &temp, sizeof(ret.fieldName)); }
+	#define helper_fieldUnsandbox(fieldType, fieldName, isFrozen, TSandbox) fieldName.unsandboxPointersOrNull(sandbox);
+	#define helper_structView_createField(fieldType, fieldName, isFrozen, TSandbox) tainted_struct_view_field<fieldType, my_conditional_t<isFrozen == 0, tainted_volatile<fieldType, TSandbox>, tainted_freezable_volatile<fieldType, TSandbox>>, TSandbox> fieldName;
+	#define helper_structView_initField(fieldType, fieldName, isFrozen, TSandbox) fieldName.field = std::addressof(p.fieldName);
+
+	#define tainted_data_specialization(T, libId, TSandbox) \
+	template<> \
+	class tainted_volatile<T, TSandbox> \
+	{ \
+	public: \
+		sandbox_fields_reflection_##libId##_class_##T(helper_tainted_volatile_createField, helper_noOp, TSandbox) \
+		\
+		inline T UNSAFE_Unverified() const noexcept \
+		{ \
+			T ret; \
+			sandbox_fields_reflection_##libId##_class_##T(helper_fieldCopy, helper_noOp, TSandbox) \
+			return ret;\
+		} \
+		\
+		inline T UNSAFE_Sandboxed(RLBoxSandbox<TSandbox>* sandbox) const noexcept \
+		{ \
+			return *((T*)this); \
+		} \
+		\
+		inline T copyAndVerify(std::function<T(tainted_volatile<T, TSandbox>&)> verifyFunction) \
+		{ \
+			return verifyFunction(*this); \
+		} \
+		\
+		inline tainted<T*, TSandbox> operator&() const noexcept \
+		{ \
+			auto structAddr = (T*)this; \
+			return *((tainted<T*, TSandbox>*)&structAddr); \
+		} \
+	};\
+	template<> \
+	class tainted<T, TSandbox> \
+	{ \
+	public: \
+		sandbox_fields_reflection_##libId##_class_##T(helper_tainted_createField, helper_noOp, TSandbox) \
+		tainted() = default; \
+		tainted(const tainted<T, TSandbox>& p) = default; \
+		\
+		tainted(const tainted_volatile<T, TSandbox>& p) \
+		{ \
+			sandbox_fields_reflection_##libId##_class_##T(helper_fieldInit, helper_noOp, TSandbox) \
+		} \
+ 		\
+		inline T UNSAFE_Unverified() const noexcept \
+		{ \
+			/* Can't reinterpret_cast due to constness */ \
+			return *((T*)this); \
+		} \
+		 \
+		inline T UNSAFE_Sandboxed(RLBoxSandbox<TSandbox>* sandbox) const noexcept \
+		{ \
+			T ret; \
+			sandbox_fields_reflection_##libId##_class_##T(helper_fieldCopyUnsandbox, helper_noOp, TSandbox) \
+			return ret;\
+		} \
+		\
+		inline T copyAndVerify(std::function<T(tainted<T, TSandbox>&)> verifyFunction) \
+		{ \
+			return verifyFunction(*this); \
+		} \
+		\
+		template<typename TRHS, RLBOX_ENABLE_IF(my_is_assignable_v<T&, TRHS>)> \
+		inline tainted<T, TSandbox>& operator=(const TRHS& p) noexcept \
+		{ \
+			sandbox_fields_reflection_##libId##_class_##T(helper_fieldInit, helper_noOp, TSandbox) \
+			return *this; \
+		} \
+		\
+		template<typename TRHS, RLBOX_ENABLE_IF(my_is_assignable_v<T&, TRHS>)> \
+		inline tainted<T, TSandbox>& operator=(const tainted_volatile<TRHS, TSandbox>& p) noexcept \
+		{ \
+			sandbox_fields_reflection_##libId##_class_##T(helper_fieldInit, helper_noOp, TSandbox) \
+			return *this; \
+		} \
+		\
+		inline void unsandboxPointersOrNull(RLBoxSandbox<TSandbox>* sandbox) \
+		{ \
+			sandbox_fields_reflection_##libId##_class_##T(helper_fieldUnsandbox, helper_noOp, TSandbox)\
+		} \
+	}; \
+	/* A view of a struct in sandbox memory that only copies the fields that are read. It must not outlive the struct */ \
+	template<> \
+	class tainted_struct_view<T, TSandbox> \
+	{ \
+	public: \
+		sandbox_fields_reflection_##libId##_class_##T(helper_structView_createField, helper_noOp, TSandbox) \
+		\
+		tainted_struct_view(const tainted_volatile<T, TSandbox>& p) \
+		{ \
+			sandbox_fields_reflection_##libId##_class_##T(helper_structView_initField, helper_noOp, TSandbox) \
+		} \
+		\
+		tainted_struct_view(const tainted<T*, TSandbox>& ptr) : tainted_struct_view(*ptr) \
+		{ \
+		} \
+	};
+
+	#define rlbox_load_library_api(libId, TSandbox) namespace rlbox { \
+		sandbox_fields_reflection_##libId##_allClasses(tainted_data_specialization, TSandbox) \
+	}
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	//unwrapped arguments are passed through as they are, so that invocations don't copy them
+	template <typename TSandbox, typename T, RLBOX_ENABLE_IF(!my_is_base_of_v<sandbox_wrapper_base, my_decay_t<T>>)>
+	inline T&& sandbox_removeWrapper(RLBoxSandbox<TSandbox>* sandbox, T&& arg)
+	{
+		return std::forward<T>(arg);
+	}
 
 	template<typename TSandbox, typename TRHS, typename... TRHSRem, template<typename, typename...> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<sandbox_wrapper_base, TWrap<TRHS, TRHSRem...>>)>
 	inline auto sandbox_removeWrapper(RLBoxSandbox<TSandbox>* sandbox, const TWrap<TRHS, TRHSRem...>& arg) -> decltype(arg.UNSAFE_Sandboxed(sandbox))
@@ -1715,10 +2407,10 @@ namespace rlbox
 		return arg.UNSAFE_SandboxedNoFreezeCheck();
 	}
 
-	template <typename TSandbox, typename T, RLBOX_ENABLE_IF(!my_is_base_of_v<sandbox_wrapper_base, T>)>
-	inline T sandbox_removeWrapperUnsandboxed(RLBoxSandbox<TSandbox>* sandbox, T& arg)
+	template <typename TSandbox, typename T, RLBOX_ENABLE_IF(!my_is_base_of_v<sandbox_wrapper_base, my_decay_t<T>>)>
+	inline T&& sandbox_removeWrapperUnsandboxed(RLBoxSandbox<TSandbox>* sandbox, T&& arg)
 	{
-		return arg;
+		return std::forward<T>(arg);
 	}
 
 	template<typename TSandbox, typename TRHS, typename... TRHSRem, template<typename, typename...> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<sandbox_wrapper_base, TWrap<TRHS, TRHSRem...>>)>
@@ -1777,262 +2469,2568 @@ namespace rlbox
 
 	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-	template<typename TSandbox>
-	class RLBoxSandbox : protected TSandbox
+	class RLBoxSandboxMemoryStats
 	{
-	private:
-		RLBoxSandbox(){}
-		void* fnPointerMap = nullptr;
-		std::mutex functionPointerCacheLock;
+	public:
+		//memory allocated by the application through mallocInSandbox, heaparr, stackarr and their variants
+		size_t bytesAllocated = 0;
+		size_t peakBytesAllocated = 0;
+		unsigned long allocationCount = 0;
+		unsigned long totalAllocations = 0;
+		//allocations refused because of the hard quota
+		unsigned long failedAllocations = 0;
+		//allocations served from the slab free lists without calling the sandbox allocator
+		unsigned long slabAllocations = 0;
+		//allocations that left the sandbox over the soft quota
+		unsigned long softQuotaExceeded = 0;
+		//0 means no quota
+		size_t softQuota = 0;
+		size_t hardQuota = 0;
+	};
 
-		uint32_t appPtrMapCounter = 0;
-		std::mutex appPtrMapMutex;
-		std::map<void*, void*> appPtrMap;
+	//Options that apply to backends whose sandbox memory is a separate region (Wasm, NaCl, Process)
+	class RLBoxSandboxOptions
+	{
+	public:
+		//Back sandbox memory with transparent huge pages, if the kernel allows it
+		bool useHugePages = false;
+		//Bytes at the start of sandbox memory to fault in during creation, so that first touches don't happen on the request path
+		size_t prefaultSize = 0;
+	};
+
+	class RLBoxSandboxReaperStats
+	{
+	public:
+		size_t queueLength = 0;
+		size_t maxQueueLength = 0;
+		unsigned long queued = 0;
+		unsigned long completed = 0;
+		//teardowns that had to wait for space in the queue
+		unsigned long blocked = 0;
+		std::chrono::nanoseconds lastTeardownTime{0};
+		std::chrono::nanoseconds maxTeardownTime{0};
+		std::chrono::nanoseconds totalTeardownTime{0};
+	};
+
+	//Runs sandbox teardown on a background thread, so that it does not land on request threads
+	//The queue is bounded, and callers block when it is full rather than letting teardowns pile up
+	class RLBoxSandboxReaper
+	{
+	private:
+		const size_t maxQueueLength;
+		std::mutex queueLock;
+		std::condition_variable queueChanged;
+		std::deque<std::function<void()>> queue;
+		bool stopping = false;
+		RLBoxSandboxReaperStats stats;
+		std::thread reaperThread;
+
+		void reaperMain()
+		{
+			std::unique_lock<std::mutex> lock(queueLock);
+			while(true)
+			{
+				queueChanged.wait(lock, [this]() { return stopping || !queue.empty(); });
+				if(queue.empty())
+				{
+					//stopping, and everything queued has been torn down
+					return;
+				}
+
+				auto teardown = std::move(queue.front());
+				queue.pop_front();
+				stats.queueLength = queue.size();
+				lock.unlock();
+				queueChanged.notify_all();
+
+				auto start = std::chrono::steady_clock::now();
+				teardown();
+				auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+				lock.lock();
+				stats.completed++;
+				stats.lastTeardownTime = elapsed;
+				stats.totalTeardownTime += elapsed;
+				stats.maxTeardownTime = std::max(stats.maxTeardownTime, elapsed);
+				queueChanged.notify_all();
+			}
+		}
+
+	public:
+		explicit RLBoxSandboxReaper(size_t maxQueueLength = 16) : maxQueueLength(maxQueueLength)
+		{
+			if(maxQueueLength == 0)
+			{
+				printf("Invalid sandbox reaper queue length\n");
+				abort();
+			}
+			reaperThread = std::thread(&RLBoxSandboxReaper::reaperMain, this);
+		}
+
+		RLBoxSandboxReaper(const RLBoxSandboxReaper&) = delete;
+		RLBoxSandboxReaper& operator=(const RLBoxSandboxReaper&) = delete;
+
+		//Finishes all queued teardowns before returning
+		~RLBoxSandboxReaper()
+		{
+			{
+				std::lock_guard<std::mutex> lock(queueLock);
+				stopping = true;
+			}
+			queueChanged.notify_all();
+			reaperThread.join();
+		}
+
+		//Must not be called from a teardown, as a full queue would then never drain
+		void enqueue(std::function<void()> teardown)
+		{
+			{
+				std::unique_lock<std::mutex> lock(queueLock);
+				if(queue.size() >= maxQueueLength)
+				{
+					stats.blocked++;
+					queueChanged.wait(lock, [this]() { return queue.size() < maxQueueLength; });
+				}
+				queue.push_back(std::move(teardown));
+				stats.queued++;
+				stats.queueLength = queue.size();
+				stats.maxQueueLength = std::max(stats.maxQueueLength, stats.queueLength);
+			}
+			queueChanged.notify_all();
+		}
+
+		//Blocks until every teardown queued so far has finished
+		void drain()
+		{
+			std::unique_lock<std::mutex> lock(queueLock);
+			unsigned long target = stats.queued;
+			queueChanged.wait(lock, [this, target]() { return stats.completed >= target; });
+		}
+
+		RLBoxSandboxReaperStats getStats()
+		{
+			std::lock_guard<std::mutex> lock(queueLock);
+			return stats;
+		}
+	};
+
+	//Read-only data published once and mapped into any number of sandboxes with getSharedBlob
+	//The data is kept in a sealed memfd, so it can't be changed after creation and every mapping shares its pages
+	class RLBoxSharedBlob
+	{
+	private:
+		int fd = -1;
+		size_t blobSize = 0;
+		uint64_t id;
+
+		static uint64_t nextId()
+		{
+			static std::atomic<uint64_t> counter { 0 };
+			return ++counter;
+		}
+
+	public:
+		RLBoxSharedBlob(const void* data, size_t size) : id(nextId())
+		{
+			if(size == 0)
+			{
+				return;
+			}
+			int newFd = memfd_create("rlbox_shared_blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+			if(newFd == -1)
+			{
+				return;
+			}
+			size_t written = 0;
+			while(written < size)
+			{
+				ssize_t count = pwrite(newFd, ((const char*) data) + written, size - written, written);
+				if(count <= 0)
+				{
+					if(count == -1 && errno == EINTR) { continue; }
+					close(newFd);
+					return;
+				}
+				written += count;
+			}
+			if(fcntl(newFd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL) != 0)
+			{
+				close(newFd);
+				return;
+			}
+			fd = newFd;
+			blobSize = size;
+		}
+
+		RLBoxSharedBlob(const RLBoxSharedBlob&) = delete;
+		RLBoxSharedBlob& operator=(const RLBoxSharedBlob&) = delete;
+
+		//Sandboxes keep their mappings of the blob after it is destroyed
+		~RLBoxSharedBlob()
+		{
+			if(fd != -1)
+			{
+				close(fd);
+			}
+		}
+
+		inline bool isValid() const { return fd != -1; }
+		inline int getFd() const { return fd; }
+		inline size_t size() const { return blobSize; }
+		inline uint64_t getId() const { return id; }
+	};
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	template<typename TSandbox>
+	class RLBoxSandbox : protected TSandbox
+	{
+	private:
+		RLBoxSandbox(){}
+		void* fnPointerMap = nullptr;
+		std::mutex functionPointerCacheLock;
+
+		uint32_t appPtrMapCounter = 0;
+		std::mutex appPtrMapMutex;
+		std::map<void*, void*> appPtrMap;
+
+		std::string sandboxRuntimePath;
+		std::string libraryPath;
+		RLBoxSandboxOptions sandboxOptions;
+		bool hugePagesEnabled = false;
+		//backend restarts that handleSandboxRestart has already cleaned up after
+		std::atomic<unsigned long> handledRestartCount { 0 };
+
+		class AllocationInfo
+		{
+		public:
+			size_t size;
+			bool fromSlab;
+			//start of the underlying allocation, which differs from the returned pointer for aligned allocations
+			void* base;
+			//pages of large aligned allocations are given back to the OS when they are freed
+			bool releasePages;
+			//bytes counted in the memory stats, which includes alignment padding. Not set if accounting was off
+			bool accounted;
+			size_t accountedSize;
+		};
+
+		//Small objects allocated with mallocSlabInSandbox<T> are carved out of larger chunks of sandbox memory
+		//and recycled through host side free lists keyed by the rounded object size
+		static const size_t slabMaxObjectSize = 256;
+		static const size_t slabObjectAlignment = 16;
+		static const size_t slabChunkSize = 16 * 1024;
+
+		//Aligned allocations of at least this size start and end on page boundaries
+		static const size_t largeAllocationSize = 1024 * 1024;
+		static const size_t largeAllocationAlignment = 4096;
+
+		std::mutex memoryStatsLock;
+		RLBoxSandboxMemoryStats memoryStats;
+		std::unordered_map<void*, AllocationInfo> allocations;
+		//Plain allocations are only recorded while accounting is on. The count lets frees skip the lock when nothing is recorded
+		std::atomic<bool> memoryAccounting { false };
+		std::atomic<size_t> trackedAllocationCount { 0 };
+		std::unordered_map<size_t, std::vector<void*>> slabFreeLists;
+		//Chunks by start address, so that an object can be traced back to its chunk
+		//The chunk itself counts against the quota, its objects only count as allocations
+		class SlabChunk
+		{
+		public:
+			size_t objectSize;
+			size_t objectCount;
+			size_t liveObjects;
+			bool accounted;
+		};
+		std::map<uintptr_t, SlabChunk> slabChunks;
+		//allocator state at the last snapshot, which a restore brings back
+		std::unordered_map<void*, AllocationInfo> snapshotAllocations;
+		std::unordered_map<size_t, std::vector<void*>> snapshotSlabFreeLists;
+		std::map<uintptr_t, SlabChunk> snapshotSlabChunks;
+		RLBoxSandboxMemoryStats snapshotMemoryStats;
+
+		//Frees queued while deferred freeing is enabled
+		std::mutex deferredFreeLock;
+		std::vector<void*> deferredFrees;
+		std::atomic<bool> deferFrees { false };
+		std::atomic<size_t> deferredFreeCount { 0 };
+		size_t deferredFreeThreshold = 64;
+
+		std::mutex callbackStateLock;
+		std::set<sandbox_callback_state<TSandbox>*> liveCallbackStates;
+		//callbacks that were live at the last snapshot, which restored memory may refer to
+		std::set<sandbox_callback_state<TSandbox>*> snapshotCallbackStates;
+		//states of callbacks recreated from a template, which have no callback helper to free them
+		std::vector<sandbox_callback_state<TSandbox>*> ownedCallbackStates;
+		//callback helpers that still refer to this sandbox
+		size_t callbackHelperCount = 0;
+		//registrations made by createCallback, keyed by the function and its registration function, which encodes the signature
+		std::map<std::pair<void*, void*>, sandbox_callback_state<TSandbox>*> callbackCache;
+		//storage of freed callback states, reused so that short lived callbacks don't allocate each time
+		std::vector<void*> freeCallbackStateStorage;
+		static const size_t freeCallbackStateLimit = 16;
+
+		//helpers from mapFileInSandbox that are alive
+		std::atomic<size_t> liveFileMappings { 0 };
+
+		std::mutex sharedBlobLock;
+		//mappings made by getSharedBlob, keyed by the blob id, which stay at the same address until unmapSharedBlob
+		std::map<uint64_t, sandbox_mapped_file_helper<TSandbox>> sharedBlobs;
+		//blobs that were mapped at the last snapshot, which a restore keeps
+		std::set<uint64_t> snapshotSharedBlobs;
+		//cached registrations kept after their last helper was unregistered
+		std::vector<sandbox_callback_state<TSandbox>*> idleCallbackStates;
+		size_t idleCallbackLimit = 0;
+
+		//Expects callbackStateLock to be held
+		template<typename... TArgs>
+		sandbox_callback_state<TSandbox>* newCallbackStateLocked(TArgs... args)
+		{
+			void* storage;
+			if(!freeCallbackStateStorage.empty())
+			{
+				storage = freeCallbackStateStorage.back();
+				freeCallbackStateStorage.pop_back();
+			}
+			else
+			{
+				storage = ::operator new(sizeof(sandbox_callback_state<TSandbox>));
+			}
+			return new (storage) sandbox_callback_state<TSandbox>(this, args...);
+		}
+
+		template<typename... TArgs>
+		sandbox_callback_state<TSandbox>* newCallbackState(TArgs... args)
+		{
+			std::lock_guard<std::mutex> lock(callbackStateLock);
+			return newCallbackStateLocked(args...);
+		}
+
+		void deleteCallbackState(sandbox_callback_state<TSandbox>* stateObject)
+		{
+			stateObject->~sandbox_callback_state<TSandbox>();
+			{
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				if(freeCallbackStateStorage.size() < freeCallbackStateLimit)
+				{
+					freeCallbackStateStorage.push_back(stateObject);
+					return;
+				}
+			}
+			::operator delete(stateObject);
+		}
+
+		//Expects callbackStateLock to be held. Only for states without a function object, whose destructor could
+		//call back into the sandbox
+		void deleteCallbackStateLocked(sandbox_callback_state<TSandbox>* stateObject)
+		{
+			stateObject->~sandbox_callback_state<TSandbox>();
+			if(freeCallbackStateStorage.size() < freeCallbackStateLimit)
+			{
+				freeCallbackStateStorage.push_back(stateObject);
+				return;
+			}
+			::operator delete(stateObject);
+		}
+
+		static inline std::pair<void*, void*> getCallbackCacheKey(sandbox_callback_state<TSandbox>* stateObject)
+		{
+			return std::make_pair(stateObject->actualCallback, (void*)(uintptr_t) stateObject->registerCallback);
+		}
+
+		//Expects callbackStateLock to be held
+		void eraseFromCallbackCache(sandbox_callback_state<TSandbox>* stateObject)
+		{
+			auto it = callbackCache.find(getCallbackCacheKey(stateObject));
+			if(it != callbackCache.end() && it->second == stateObject)
+			{
+				callbackCache.erase(it);
+			}
+		}
+
+		template <typename TSandbox2, typename TRet, typename... TArgs>
+		friend void* sandbox_callback_register(RLBoxSandbox<TSandbox2>* sandbox, sandbox_callback_state<TSandbox2>* stateObject);
+		template <typename TSandbox2, typename TFunc, typename TRet, typename... TArgs>
+		friend void* sandbox_callback_register_callable(RLBoxSandbox<TSandbox2>* sandbox, sandbox_callback_state<TSandbox2>* stateObject);
+		template <typename TSandbox2, typename TFunc>
+		friend void sandbox_callback_unregister(RLBoxSandbox<TSandbox2>* sandbox, void* key);
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline void handleSandboxRestart()
+		{
+			//compare restart counts rather than the last invoke status, which another thread's invoke may have overwritten
+			const unsigned long restarts = this->impl_getRestartCount();
+			if(handledRestartCount.exchange(restarts) != restarts)
+			{
+				//pointers to sandbox functions are not valid in the replacement sandbox
+				{
+					std::lock_guard<std::mutex> lock(functionPointerCacheLock);
+					if(fnPointerMap)
+					{
+						((std::map<std::string, void*> *) fnPointerMap)->clear();
+					}
+				}
+
+				//neither are allocations or slab chunks
+				{
+					std::lock_guard<std::mutex> statsLock(memoryStatsLock);
+					allocations.clear();
+					slabFreeLists.clear();
+					slabChunks.clear();
+					allocationsChanged();
+					snapshotAllocations.clear();
+					snapshotSlabFreeLists.clear();
+					snapshotSlabChunks.clear();
+					memoryStats.bytesAllocated = 0;
+					memoryStats.allocationCount = 0;
+
+					dropDeferredFrees();
+				}
+
+				//not under memoryStatsLock, as blobs are mapped and unmapped while holding sharedBlobLock
+				std::lock_guard<std::mutex> blobLock(sharedBlobLock);
+				for(auto& entry : sharedBlobs)
+				{
+					entry.second.release();
+				}
+				sharedBlobs.clear();
+				snapshotSharedBlobs.clear();
+			}
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline void handleSandboxRestart()
+		{
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsBatchFree<T2>::value)>
+		inline void freeBatchInSandbox(void** ptrs, size_t count)
+		{
+			this->impl_freeInSandboxBatch(ptrs, count);
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsBatchFree<T2>::value)>
+		inline void freeBatchInSandbox(void** ptrs, size_t count)
+		{
+			for(size_t i = 0; i < count; i++)
+			{
+				this->impl_freeInSandbox(ptrs[i]);
+			}
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsRealloc<T2>::value)>
+		inline void* reallocUntrackedInSandbox(void* addr, size_t oldSize, size_t size)
+		{
+			return this->impl_reallocInSandbox(addr, size);
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsRealloc<T2>::value)>
+		inline void* reallocUntrackedInSandbox(void* addr, size_t oldSize, size_t size)
+		{
+			void* ret = this->impl_mallocInSandbox(size);
+			if(ret != nullptr)
+			{
+				memcpy(ret, addr, std::min(oldSize, size));
+				freeOrDeferInSandbox(addr);
+			}
+			return ret;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsRealloc<T2>::value)>
+		inline void* reallocUnknownSizeInSandbox(void* addr, size_t size)
+		{
+			return this->impl_reallocInSandbox(addr, size);
+		}
+
+		//Moving the allocation ourselves needs its size, which is only recorded while accounting is on
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsRealloc<T2>::value)>
+		inline void* reallocUnknownSizeInSandbox(void* addr, size_t size)
+		{
+			printf("reallocInSandbox on this backend needs the old count for memory allocated while memory accounting is off\n");
+			abort();
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsFileMapping<T2>::value)>
+		inline bool mapFileUntrackedInSandbox(void* addr, size_t size, int fd, off_t offset, bool readOnly)
+		{
+			return this->impl_MapFileInSandbox(addr, size, fd, offset, readOnly);
+		}
+
+		//The Process sandbox only shares its memory region with the sandbox process, so files can't be mapped into it
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsFileMapping<T2>::value)>
+		inline bool mapFileUntrackedInSandbox(void* addr, size_t size, int fd, off_t offset, bool readOnly)
+		{
+			return false;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsFileMapping<T2>::value)>
+		inline void unmapFileUntrackedInSandbox(void* addr, size_t size)
+		{
+			this->impl_UnmapFileInSandbox(addr, size);
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsFileMapping<T2>::value)>
+		inline void unmapFileUntrackedInSandbox(void* addr, size_t size)
+		{
+		}
+
+		template<typename T, typename ... TArgs, typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsInvokeInto<T2>::value)>
+		inline void invokeFunctionIntoSandbox(void* dest, T* fnPtr, TArgs&&... params)
+		{
+			this->impl_InvokeFunctionInto(dest, fnPtr, std::forward<TArgs>(params)...);
+		}
+
+		template<typename T, typename ... TArgs, typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsInvokeInto<T2>::value)>
+		inline void invokeFunctionIntoSandbox(void* dest, T* fnPtr, TArgs&&... params)
+		{
+			auto&& retRaw = this->impl_InvokeFunction(fnPtr, std::forward<TArgs>(params)...);
+			memcpy(dest, &retRaw, sizeof(return_argument<T>));
+		}
+
+		void freeOrDeferInSandbox(void* addr)
+		{
+			if(!deferFrees)
+			{
+				this->impl_freeInSandbox(addr);
+				return;
+			}
+			bool flush;
+			{
+				std::lock_guard<std::mutex> lock(deferredFreeLock);
+				deferredFrees.push_back(addr);
+				deferredFreeCount = deferredFrees.size();
+				flush = deferredFrees.size() >= deferredFreeThreshold;
+			}
+			if(flush)
+			{
+				flushDeferredFrees();
+			}
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsMemoryTrim<T2>::value)>
+		inline void releaseUnusedPages(void* addr, size_t size)
+		{
+			this->impl_ReleaseUnusedPages(addr, size);
+		}
+
+		//the application's allocator already returns large blocks to the OS where sandbox memory is the application's heap
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsMemoryTrim<T2>::value)>
+		inline void releaseUnusedPages(void* addr, size_t size)
+		{
+		}
+
+		inline void flushDeferredFreesIfPending()
+		{
+			if(deferredFreeCount != 0)
+			{
+				flushDeferredFrees();
+			}
+		}
+
+		//Queued frees of memory that a restore rewinds or a restart replaces must not reach the allocator
+		void dropDeferredFrees()
+		{
+			std::lock_guard<std::mutex> lock(deferredFreeLock);
+			deferredFrees.clear();
+			deferredFreeCount = 0;
+		}
+
+		//Accounts for an allocation of size bytes, unless it would go over the hard quota
+		//Expects accounting to be on
+		bool reserveMemory(size_t size)
+		{
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			if(memoryStats.hardQuota != 0 && memoryStats.bytesAllocated + size > memoryStats.hardQuota)
+			{
+				memoryStats.failedAllocations++;
+				return false;
+			}
+			memoryStats.bytesAllocated += size;
+			memoryStats.allocationCount++;
+			memoryStats.totalAllocations++;
+			memoryStats.peakBytesAllocated = std::max(memoryStats.peakBytesAllocated, memoryStats.bytesAllocated);
+			if(memoryStats.softQuota != 0 && memoryStats.bytesAllocated > memoryStats.softQuota)
+			{
+				memoryStats.softQuotaExceeded++;
+			}
+			return true;
+		}
+
+		void releaseMemory(size_t size)
+		{
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			memoryStats.bytesAllocated -= size;
+			memoryStats.allocationCount--;
+		}
+
+		//Expects memoryStatsLock to be held
+		inline void allocationsChanged()
+		{
+			trackedAllocationCount = allocations.size() + slabChunks.size();
+		}
+
+		void saveAllocatorStateForSnapshot()
+		{
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			snapshotAllocations = allocations;
+			snapshotSlabFreeLists = slabFreeLists;
+			snapshotSlabChunks = slabChunks;
+			snapshotMemoryStats = memoryStats;
+		}
+
+		//Slab chunks allocated after the snapshot are gone after a restore, so the free lists are rewound as well
+		//Expects memoryStatsLock to be held
+		void restoreAllocatorStateFromSnapshot()
+		{
+			allocations = snapshotAllocations;
+			slabFreeLists = snapshotSlabFreeLists;
+			slabChunks = snapshotSlabChunks;
+			allocationsChanged();
+			memoryStats.bytesAllocated = snapshotMemoryStats.bytesAllocated;
+			memoryStats.allocationCount = snapshotMemoryStats.allocationCount;
+		}
+
+		//Returns the chunk holding addr, or slabChunks.end()
+		//Expects memoryStatsLock to be held
+		typename std::map<uintptr_t, SlabChunk>::iterator findSlabChunk(void* addr)
+		{
+			auto it = slabChunks.upper_bound((uintptr_t) addr);
+			if(it == slabChunks.begin())
+			{
+				return slabChunks.end();
+			}
+			--it;
+			return (uintptr_t) addr < it->first + slabChunkSize? it : slabChunks.end();
+		}
+
+		//Takes an object from the free list of its size class, refilling the list with a new chunk if it is empty
+		//Expects memoryStatsLock to be held
+		void* slabAllocate(size_t size, bool accounted)
+		{
+			const size_t objectSize = (size + slabObjectAlignment - 1) & ~(slabObjectAlignment - 1);
+			std::vector<void*>& freeList = slabFreeLists[objectSize];
+			if(freeList.empty())
+			{
+				if(accounted && memoryStats.hardQuota != 0 && memoryStats.bytesAllocated + slabChunkSize > memoryStats.hardQuota)
+				{
+					memoryStats.failedAllocations++;
+					return nullptr;
+				}
+				void* chunk = this->impl_mallocInSandbox(slabChunkSize);
+				if(chunk == nullptr)
+				{
+					return nullptr;
+				}
+				uintptr_t start = ((uintptr_t) chunk + slabObjectAlignment - 1) & ~(slabObjectAlignment - 1);
+				uintptr_t end = ((uintptr_t) chunk) + slabChunkSize;
+				if(!this->isValidSandboxedPointer(this->getSandboxedPointer((void*) start), false /* isFuncPtr */) ||
+					!this->isValidSandboxedPointer(this->getSandboxedPointer((void*) (end - 1)), false /* isFuncPtr */))
+				{
+					abort();
+				}
+				//push in reverse so that objects are handed out in address order
+				const size_t objectCount = (end - start) / objectSize;
+				for(size_t i = objectCount; i > 0; i--)
+				{
+					freeList.push_back((void*) (start + (i - 1) * objectSize));
+				}
+				slabChunks[(uintptr_t) chunk] = SlabChunk { objectSize, objectCount, 0 /* liveObjects */, accounted };
+				if(accounted)
+				{
+					memoryStats.bytesAllocated += slabChunkSize;
+					memoryStats.peakBytesAllocated = std::max(memoryStats.peakBytesAllocated, memoryStats.bytesAllocated);
+					if(memoryStats.softQuota != 0 && memoryStats.bytesAllocated > memoryStats.softQuota)
+					{
+						memoryStats.softQuotaExceeded++;
+					}
+				}
+			}
+			void* addr = freeList.back();
+			freeList.pop_back();
+			findSlabChunk(addr)->second.liveObjects++;
+			memoryStats.slabAllocations++;
+			return addr;
+		}
+
+		//Expects memoryStatsLock to be held
+		void releaseSlabChunk(typename std::map<uintptr_t, SlabChunk>::iterator chunk)
+		{
+			const uintptr_t start = chunk->first;
+			std::vector<void*>& freeList = slabFreeLists[chunk->second.objectSize];
+			freeList.erase(std::remove_if(freeList.begin(), freeList.end(), [&](void* p) {
+				return (uintptr_t) p >= start && (uintptr_t) p < start + slabChunkSize;
+			}), freeList.end());
+			if(chunk->second.accounted)
+			{
+				memoryStats.bytesAllocated -= slabChunkSize;
+			}
+			slabChunks.erase(chunk);
+			//before the free, as the allocator may write to the chunk once it has it back
+			releaseUnusedPages((void*) start, slabChunkSize);
+			this->impl_freeInSandbox((void*) start);
+		}
+
+		//Releases the pages of live slab chunks that only hold free objects, the free space rlbox knows about without
+		//help from the sandbox's allocator. Returns the bytes released
+		//Expects memoryStatsLock to be held
+		size_t releaseFreeSlabPages()
+		{
+			const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+			//free objects overlapping each page
+			std::map<uintptr_t, size_t> freeOnPage;
+			for(auto& entry : slabFreeLists)
+			{
+				for(void* p : entry.second)
+				{
+					const uintptr_t first = ((uintptr_t) p) & ~(pageSize - 1);
+					const uintptr_t last = (((uintptr_t) p) + entry.first - 1) & ~(pageSize - 1);
+					for(uintptr_t page = first; page <= last; page += pageSize)
+					{
+						freeOnPage[page]++;
+					}
+				}
+			}
+
+			size_t ret = 0;
+			for(auto& chunk : slabChunks)
+			{
+				const uintptr_t start = (chunk.first + slabObjectAlignment - 1) & ~(slabObjectAlignment - 1);
+				const uintptr_t objectsEnd = start + chunk.second.objectCount * chunk.second.objectSize;
+				const uintptr_t end = chunk.first + slabChunkSize;
+				for(uintptr_t page = (chunk.first + pageSize - 1) & ~(pageSize - 1); page + pageSize <= end; page += pageSize)
+				{
+					//objects overlapping the page, none if it is past the last object
+					size_t objects = 0;
+					if(page < objectsEnd)
+					{
+						const uintptr_t firstObject = page < start? 0 : (page - start) / chunk.second.objectSize;
+						const uintptr_t lastObject = (std::min(page + pageSize, objectsEnd) - 1 - start) / chunk.second.objectSize;
+						objects = lastObject - firstObject + 1;
+					}
+					auto it = freeOnPage.find(page);
+					if(objects == (it == freeOnPage.end()? 0 : it->second))
+					{
+						releaseUnusedPages((void*) page, pageSize);
+						ret += pageSize;
+					}
+				}
+			}
+			return ret;
+		}
+
+		//Returns an object to its free list. A chunk that becomes empty is given back to the sandbox allocator,
+		//unless it is the only free space left in its size class
+		//Expects memoryStatsLock to be held
+		void slabFree(void* addr)
+		{
+			auto chunk = findSlabChunk(addr);
+			std::vector<void*>& freeList = slabFreeLists[chunk->second.objectSize];
+			freeList.push_back(addr);
+			chunk->second.liveObjects--;
+			if(chunk->second.liveObjects == 0 && freeList.size() > chunk->second.objectCount)
+			{
+				releaseSlabChunk(chunk);
+			}
+		}
+
+		//Gives back the chunks kept for reuse that hold no objects
+		void releaseEmptySlabChunks()
+		{
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			for(auto it = slabChunks.begin(); it != slabChunks.end();)
+			{
+				auto next = std::next(it);
+				if(it->second.liveObjects == 0)
+				{
+					releaseSlabChunk(it);
+				}
+				it = next;
+			}
+			allocationsChanged();
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsMemoryOptions<T2>::value)>
+		inline void applyOptions(const RLBoxSandboxOptions& options)
+		{
+			sandboxOptions = options;
+			hugePagesEnabled = this->impl_PrepareMemory(options.useHugePages, options.prefaultSize);
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsMemoryOptions<T2>::value)>
+		inline void applyOptions(const RLBoxSandboxOptions& options)
+		{
+			sandboxOptions = options;
+		}
+
+		//Mappings that replace sandbox memory, such as a restored snapshot, don't carry the huge page advice over
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsMemoryOptions<T2>::value)>
+		inline void reapplyHugePages()
+		{
+			if(hugePagesEnabled)
+			{
+				this->impl_PrepareMemory(true /* useHugePages */, 0 /* prefaultSize */);
+			}
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsMemoryOptions<T2>::value)>
+		inline void reapplyHugePages()
+		{
+		}
+
+		bool cloneCallbacksFrom(RLBoxSandbox* templateSandbox)
+		{
+			std::vector<sandbox_callback_state<TSandbox>*> templateStates;
+			{
+				std::lock_guard<std::mutex> lock(templateSandbox->callbackStateLock);
+				templateStates.assign(templateSandbox->snapshotCallbackStates.begin(), templateSandbox->snapshotCallbackStates.end());
+			}
+			//backends hand out the lowest free callback slot, so registering in address order should reproduce the template's slots
+			std::sort(templateStates.begin(), templateStates.end(), [](sandbox_callback_state<TSandbox>* a, sandbox_callback_state<TSandbox>* b) {
+				return (uintptr_t) a->registeredAddress < (uintptr_t) b->registeredAddress;
+			});
+
+			for(auto templateState : templateStates)
+			{
+				auto stateObject = newCallbackState(templateState->actualCallback, templateState->registerCallback, templateState->unregisterCallback);
+				if(templateState->destroyCallable)
+				{
+					if(!templateState->copyCallable)
+					{
+						deleteCallbackState(stateObject);
+						return false;
+					}
+					templateState->copyCallable(stateObject, templateState->actualCallback);
+				}
+				stateObject->registeredAddress = stateObject->registerCallback(this, stateObject);
+				{
+					std::lock_guard<std::mutex> lock(callbackStateLock);
+					ownedCallbackStates.push_back(stateObject);
+					liveCallbackStates.insert(stateObject);
+					snapshotCallbackStates.insert(stateObject);
+				}
+				//the cloned memory refers to the callback by the address it had in the template
+				if(stateObject->registeredAddress != templateState->registeredAddress)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void cloneMapsFrom(RLBoxSandbox* templateSandbox)
+		{
+			std::vector<std::string> fnNames;
+			{
+				std::lock_guard<std::mutex> lock(templateSandbox->functionPointerCacheLock);
+				if(templateSandbox->fnPointerMap)
+				{
+					for(auto& entry : *(std::map<std::string, void*> *) templateSandbox->fnPointerMap)
+					{
+						fnNames.push_back(entry.first);
+					}
+				}
+			}
+			//backends that support cloning resolve sandbox functions and callbacks the same way
+			for(auto& fnName : fnNames)
+			{
+				getFunctionPointerFromCache(fnName.c_str(), false /* forSandboxFunction */);
+			}
+
+			{
+				std::lock_guard<std::mutex> templateLock(templateSandbox->memoryStatsLock);
+				std::lock_guard<std::mutex> lock(memoryStatsLock);
+				snapshotAllocations = templateSandbox->snapshotAllocations;
+				snapshotSlabFreeLists = templateSandbox->snapshotSlabFreeLists;
+				snapshotSlabChunks = templateSandbox->snapshotSlabChunks;
+				snapshotMemoryStats = templateSandbox->snapshotMemoryStats;
+				restoreAllocatorStateFromSnapshot();
+				memoryAccounting = templateSandbox->memoryAccounting.load();
+			}
+
+			std::lock_guard<std::mutex> templateLock(templateSandbox->appPtrMapMutex);
+			std::lock_guard<std::mutex> lock(appPtrMapMutex);
+			appPtrMap = templateSandbox->appPtrMap;
+			appPtrMapCounter = templateSandbox->appPtrMapCounter;
+		}
 
 	public:
 		static RLBoxSandbox* createSandbox(const char* sandboxRuntimePath, const char* libraryPath)
 		{
-			RLBoxSandbox* ret = new RLBoxSandbox();
-			ret->impl_CreateSandbox(sandboxRuntimePath, libraryPath);
-			return ret;
+			RLBoxSandbox* ret = new RLBoxSandbox();
+			ret->sandboxRuntimePath = sandboxRuntimePath;
+			ret->libraryPath = libraryPath;
+			ret->impl_CreateSandbox(sandboxRuntimePath, libraryPath);
+			return ret;
+		}
+
+		//Options that the backend or the kernel can't honor are ignored, see usesHugePages()
+		static RLBoxSandbox* createSandbox(const char* sandboxRuntimePath, const char* libraryPath, const RLBoxSandboxOptions& options)
+		{
+			RLBoxSandbox* ret = createSandbox(sandboxRuntimePath, libraryPath);
+			ret->applyOptions(options);
+			return ret;
+		}
+
+		inline bool usesHugePages() const
+		{
+			return hugePagesEnabled;
+		}
+
+		//Creates the sandbox on a background thread
+		static std::future<RLBoxSandbox*> createSandboxAsync(const char* sandboxRuntimePath, const char* libraryPath, const RLBoxSandboxOptions& options = RLBoxSandboxOptions())
+		{
+			std::string runtimePathCopy = sandboxRuntimePath;
+			std::string libraryPathCopy = libraryPath;
+			return std::async(std::launch::async, [runtimePathCopy, libraryPathCopy, options]() {
+				return createSandbox(runtimePathCopy.c_str(), libraryPathCopy.c_str(), options);
+			});
+		}
+
+		inline const RLBoxSandboxOptions& getOptions() const
+		{
+			return sandboxOptions;
+		}
+
+		//Creates a sandbox for the same library, whose memory starts as a copy on write image of templateSandbox's last snapshot
+		//(one is taken if there is none), so the library initialization done in the template is not repeated
+		//Changes the template made after its last snapshot are not in the clone, so snapshot the template when it is ready
+		//Callbacks live in the template at snapshot time are registered again in the clone and its symbol and app_ptr maps are
+		//copied. The template's callbacks must not be unregistered during the clone
+		//Function object callbacks are copied into the clone, so anything they capture by reference or pointer is shared
+		//with the template's callback. Capture by value what must be separate per sandbox
+		//The clone gets options if given, and the template's options otherwise
+		//Blobs from getSharedBlob are not mapped into the clone, so cloning a template that has blobs mapped, or had them
+		//at its last snapshot, fails. Unmap them and snapshot again, and map them in each clone instead
+		//Returns nullptr if the backend can't clone sandboxes
+		static RLBoxSandbox* cloneFrom(RLBoxSandbox* templateSandbox)
+		{
+			return cloneFrom(templateSandbox, templateSandbox->sandboxOptions);
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsClone<T2>::value)>
+		static RLBoxSandbox* cloneFrom(RLBoxSandbox* templateSandbox, const RLBoxSandboxOptions& options)
+		{
+			{
+				//the clone's image would hold the blob ranges as allocated, but with nothing mapped there
+				std::lock_guard<std::mutex> blobLock(templateSandbox->sharedBlobLock);
+				if(!templateSandbox->sharedBlobs.empty() || !templateSandbox->snapshotSharedBlobs.empty())
+				{
+					return nullptr;
+				}
+			}
+			RLBoxSandbox* ret = createSandbox(templateSandbox->sandboxRuntimePath.c_str(), templateSandbox->libraryPath.c_str());
+			TSandbox* templateImpl = templateSandbox;
+			bool cloned = ret->impl_CloneMemoryFrom(templateImpl) || (templateSandbox->snapshot() && ret->impl_CloneMemoryFrom(templateImpl));
+			if(!cloned || !ret->cloneCallbacksFrom(templateSandbox))
+			{
+				ret->destroySandbox();
+				delete ret;
+				return nullptr;
+			}
+			ret->cloneMapsFrom(templateSandbox);
+			//after the clone, so that the advice covers the cloned mappings
+			ret->applyOptions(options);
+			return ret;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsClone<T2>::value)>
+		static RLBoxSandbox* cloneFrom(RLBoxSandbox* templateSandbox, const RLBoxSandboxOptions& options)
+		{
+			return nullptr;
+		}
+
+		~RLBoxSandbox()
+		{
+			//callback helpers may be released after destroySandbox, so the storage they return is freed here
+			for(auto storage : freeCallbackStateStorage)
+			{
+				::operator delete(storage);
+			}
+		}
+
+		void destroySandbox()
+		{
+			std::vector<sandbox_callback_state<TSandbox>*> ownedStates;
+			{
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				ownedStates.swap(ownedCallbackStates);
+			}
+			for(auto stateObject : ownedStates)
+			{
+				releaseCallbackState(stateObject);
+				deleteCallbackState(stateObject);
+			}
+			releaseIdleCallbacks();
+			//backends that share the application's heap do not release it with the sandbox
+			std::map<uint64_t, sandbox_mapped_file_helper<TSandbox>> blobs;
+			{
+				std::lock_guard<std::mutex> blobLock(sharedBlobLock);
+				blobs.swap(sharedBlobs);
+			}
+			blobs.clear();
+			flushDeferredFreesIfPending();
+			this->impl_DestroySandbox();
+		}
+
+		//Hands the sandbox to the reaper, which destroys and deletes it in the background
+		//The sandbox must not be used after this call. Blocks if the reaper's queue is full
+		//There is no default reaper, as one that lives until exit would tear sandboxes down during static destruction
+		void destroySandboxAsync(RLBoxSandboxReaper& reaper)
+		{
+			reaper.enqueue([this]() {
+				destroySandbox();
+				delete this;
+			});
+		}
+
+		inline auto getSandbox() -> decltype(this->impl_getSandbox())
+		{
+			return this->impl_getSandbox();
+		}
+
+		//Returns a null pointer if the allocation would exceed the hard quota
+		template<typename T>
+		tainted<T*, TSandbox> mallocInSandbox(unsigned int count=1)
+		{
+			void* addr = trackedMallocInSandbox(sizeof(T) * count);
+			if(addr != nullptr && !this->isValidSandboxedPointer(this->getSandboxedPointer(addr), false /* isFuncPtr */))
+			{
+				abort();
+			}
+			tainted<T*, TSandbox> ret;
+			ret.field = static_cast<T*>(addr);
+			return ret;
+		}
+
+		//Returns a single small object carved out of a chunk of sandbox memory, which is cheaper than mallocInSandbox
+		//for objects allocated and freed often. The object is not a separate allocation of the sandbox allocator:
+		//it must only be freed or resized by the application through freeInSandbox and reallocInSandbox,
+		//never handed to the library to free or resize, and objects allocated after a snapshot are gone after a restore
+		//Returns a null pointer if the allocation would exceed the hard quota
+		template<typename T>
+		tainted<T*, TSandbox> mallocSlabInSandbox()
+		{
+			static_assert(sizeof(T) <= slabMaxObjectSize && alignof(T) <= slabObjectAlignment, "Type is too large for the slab allocator");
+			void* addr = trackedSlabMallocInSandbox(sizeof(T));
+			if(addr != nullptr && !this->isValidSandboxedPointer(this->getSandboxedPointer(addr), false /* isFuncPtr */))
+			{
+				abort();
+			}
+			tainted<T*, TSandbox> ret;
+			ret.field = static_cast<T*>(addr);
+			return ret;
+		}
+
+		//Returns memory for count objects of T aligned to alignment bytes, which must be a power of 2
+		//Allocations of 1MB or more are page aligned and their pages are released to the OS when freed
+		//Returns a null pointer if the allocation would exceed the hard quota
+		template<typename T>
+		tainted<T*, TSandbox> mallocAlignedInSandbox(unsigned int count, size_t alignment)
+		{
+			const size_t size = sizeof(T) * count;
+			void* addr = trackedMallocAlignedInSandbox(size, std::max(alignment, alignof(T)));
+			if(addr != nullptr && (!this->isValidSandboxedPointer(this->getSandboxedPointer(addr), false /* isFuncPtr */) ||
+				(size != 0 && !this->isValidSandboxedPointer(this->getSandboxedPointer(((char*) addr) + size - 1), false /* isFuncPtr */))))
+			{
+				abort();
+			}
+			tainted<T*, TSandbox> ret;
+			ret.field = static_cast<T*>(addr);
+			return ret;
+		}
+
+		//Resizes an allocation from mallocInSandbox or mallocAlignedInSandbox to count objects, in place when the backend can
+		//extend it and otherwise by moving it. A null ptr allocates
+		//Moving needs the allocation's size, which is only recorded while memory accounting is on. Backends that can't
+		//resize allocations abort if it isn't known, so use the overload taking oldCount for memory allocated without accounting
+		//Returns a null pointer and leaves the allocation alone if it would exceed the hard quota
+		template<typename T>
+		tainted<T*, TSandbox> reallocInSandbox(tainted<T*, TSandbox> ptr, unsigned int count)
+		{
+			return reallocKnownSizeInSandbox(ptr, SIZE_MAX, sizeof(T) * count);
+		}
+
+		//As above, for an allocation of oldCount objects, which works whether memory accounting is on or not
+		template<typename T>
+		tainted<T*, TSandbox> reallocInSandbox(tainted<T*, TSandbox> ptr, unsigned int oldCount, unsigned int count)
+		{
+			return reallocKnownSizeInSandbox(ptr, sizeof(T) * oldCount, sizeof(T) * count);
+		}
+
+		template<typename T>
+		tainted<T*, TSandbox> reallocKnownSizeInSandbox(tainted<T*, TSandbox> ptr, size_t oldSize, size_t size)
+		{
+			void* addr = trackedReallocInSandbox((void*) ptr.UNSAFE_Unverified(), size, oldSize);
+			if(addr != nullptr && (!this->isValidSandboxedPointer(this->getSandboxedPointer(addr), false /* isFuncPtr */) ||
+				(size != 0 && !this->isValidSandboxedPointer(this->getSandboxedPointer(((char*) addr) + size - 1), false /* isFuncPtr */))))
+			{
+				abort();
+			}
+			tainted<T*, TSandbox> ret;
+			ret.field = static_cast<T*>(addr);
+			return ret;
+		}
+
+		template<typename T>
+		tainted_freezable<T*, TSandbox> mallocFrozenInSandbox()
+		{
+			void* addr = trackedMallocInSandbox(sizeof(T));
+			if(addr != nullptr && !this->isValidSandboxedPointer(this->getSandboxedPointer(addr), false /* isFuncPtr */))
+			{
+				abort();
+			}
+			tainted_freezable<T*, TSandbox> ret;
+			ret.field = static_cast<T*>(addr);
+			return ret;
+		}
+
+		template <typename T, RLBOX_ENABLE_IF(my_is_base_of_v<sandbox_wrapper_base, T>)>
+		void freeInSandbox(T val)
+		{
+			return trackedFreeInSandbox(val.UNSAFE_Unverified());
+		}
+
+		template <typename T>
+		void freeInSandbox(tainted_freezable<T*, TSandbox> val)
+		{
+			val->unfreeze();
+			return trackedFreeInSandbox(val.UNSAFE_Unverified());
+		}
+
+		//Allocation paths of mallocInSandbox and the heaparr and stackarr helpers, which keep the memory stats
+		//Allocations return nullptr if they would exceed the hard quota
+		void* trackedMallocInSandbox(size_t size)
+		{
+			if(!memoryAccounting)
+			{
+				return this->impl_mallocInSandbox(size);
+			}
+			if(!reserveMemory(size))
+			{
+				return nullptr;
+			}
+			void* addr = this->impl_mallocInSandbox(size);
+			if(addr == nullptr)
+			{
+				releaseMemory(size);
+				return nullptr;
+			}
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			allocations[addr] = AllocationInfo { size, false /* fromSlab */, addr, false /* releasePages */, true /* accounted */, size };
+			allocationsChanged();
+			return addr;
+		}
+
+		//Slab objects are always recorded, as the free needs to find their chunk. Their bytes are counted by the chunk
+		void* trackedSlabMallocInSandbox(size_t size)
+		{
+			const bool accounted = memoryAccounting;
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			void* addr = slabAllocate(size, accounted);
+			if(addr == nullptr)
+			{
+				return nullptr;
+			}
+			if(accounted)
+			{
+				memoryStats.allocationCount++;
+				memoryStats.totalAllocations++;
+			}
+			allocations[addr] = AllocationInfo { size, true /* fromSlab */, addr, false /* releasePages */, accounted, 0 /* accountedSize */ };
+			allocationsChanged();
+			return addr;
+		}
+
+		//Memory that was not allocated by the application, such as buffers handed out by the library, is freed without accounting
+		void trackedFreeInSandbox(void* addr)
+		{
+			if(trackedAllocationCount == 0)
+			{
+				freeOrDeferInSandbox(addr);
+				return;
+			}
+			void* base = addr;
+			size_t releaseSize = 0;
+			{
+				std::lock_guard<std::mutex> lock(memoryStatsLock);
+				auto it = allocations.find(addr);
+				if(it != allocations.end())
+				{
+					if(it->second.accounted)
+					{
+						memoryStats.bytesAllocated -= it->second.accountedSize;
+						memoryStats.allocationCount--;
+					}
+					if(it->second.fromSlab)
+					{
+						allocations.erase(it);
+						slabFree(addr);
+						allocationsChanged();
+						return;
+					}
+					base = it->second.base;
+					if(it->second.releasePages)
+					{
+						releaseSize = it->second.size;
+					}
+					allocations.erase(it);
+					allocationsChanged();
+				}
+				else if(findSlabChunk(addr) != slabChunks.end())
+				{
+					//the sandbox allocator doesn't know this pointer, so passing it on would corrupt its heap
+					printf("freeInSandbox called on a slab object that is not allocated\n");
+					abort();
+				}
+			}
+			if(releaseSize != 0)
+			{
+				releaseUnusedPages(addr, releaseSize);
+			}
+			freeOrDeferInSandbox(base);
+		}
+
+		//Only plain allocations are resized by the backend. Slab objects and aligned allocations are moved into a plain one
+		//oldSize is SIZE_MAX if the caller doesn't know it, and is only used for allocations made without accounting
+		void* trackedReallocInSandbox(void* addr, size_t size, size_t oldSize = SIZE_MAX)
+		{
+			if(addr == nullptr)
+			{
+				return trackedMallocInSandbox(size);
+			}
+			AllocationInfo info;
+			bool found = false;
+			if(trackedAllocationCount != 0)
+			{
+				std::lock_guard<std::mutex> lock(memoryStatsLock);
+				auto it = allocations.find(addr);
+				if(it != allocations.end())
+				{
+					info = it->second;
+					found = true;
+					if(!info.fromSlab && info.base == addr)
+					{
+						if(info.accounted)
+						{
+							if(size > info.size && memoryStats.hardQuota != 0 && memoryStats.bytesAllocated + (size - info.size) > memoryStats.hardQuota)
+							{
+								memoryStats.failedAllocations++;
+								return nullptr;
+							}
+							memoryStats.bytesAllocated = memoryStats.bytesAllocated - info.size + size;
+							memoryStats.peakBytesAllocated = std::max(memoryStats.peakBytesAllocated, memoryStats.bytesAllocated);
+							if(memoryStats.softQuota != 0 && memoryStats.bytesAllocated > memoryStats.softQuota)
+							{
+								memoryStats.softQuotaExceeded++;
+							}
+						}
+						//dropped before the realloc releases addr, as another thread may be handed the same address right after
+						allocations.erase(it);
+						allocationsChanged();
+					}
+				}
+			}
+			if(!found)
+			{
+				//allocated while accounting was off, so only the caller may know its size
+				if(oldSize != SIZE_MAX)
+				{
+					return reallocUntrackedInSandbox(addr, oldSize, size);
+				}
+				return reallocUnknownSizeInSandbox(addr, size);
+			}
+			if(info.fromSlab || info.base != addr)
+			{
+				void* ret = trackedMallocInSandbox(size);
+				if(ret != nullptr)
+				{
+					memcpy(ret, addr, std::min(info.size, size));
+					trackedFreeInSandbox(addr);
+				}
+				return ret;
+			}
+
+			void* ret = reallocUntrackedInSandbox(addr, info.size, size);
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			if(ret == nullptr)
+			{
+				//addr is still allocated
+				if(info.accounted)
+				{
+					memoryStats.bytesAllocated = memoryStats.bytesAllocated - size + info.size;
+					memoryStats.failedAllocations++;
+				}
+				allocations[addr] = info;
+			}
+			else
+			{
+				allocations[ret] = AllocationInfo { size, false /* fromSlab */, ret, false /* releasePages */, info.accounted, size };
+			}
+			allocationsChanged();
+			return ret;
+		}
+
+		//alignment must be a power of 2. Allocations of at least largeAllocationSize bytes are also page aligned
+		void* trackedMallocAlignedInSandbox(size_t size, size_t alignment)
+		{
+			if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+			{
+				printf("Alignment %zu is not a power of 2\n", alignment);
+				abort();
+			}
+			const bool large = size >= largeAllocationSize;
+			size_t allocSize = size;
+			if(large)
+			{
+				if(alignment < largeAllocationAlignment)
+				{
+					alignment = largeAllocationAlignment;
+				}
+				//so that the last page is not shared with other allocations either
+				allocSize = (size + largeAllocationAlignment - 1) & ~(largeAllocationAlignment - 1);
+			}
+			const size_t paddedSize = allocSize + alignment - 1;
+			if(paddedSize < allocSize)
+			{
+				return nullptr;
+			}
+
+			//the padding is memory the sandbox allocator hands out as well, so it counts against the quota
+			const bool accounted = memoryAccounting;
+			if(accounted && !reserveMemory(paddedSize))
+			{
+				return nullptr;
+			}
+			void* base = this->impl_mallocInSandbox(paddedSize);
+			if(base == nullptr)
+			{
+				if(accounted)
+				{
+					releaseMemory(paddedSize);
+				}
+				return nullptr;
+			}
+			void* addr = (void*) ((((uintptr_t) base) + alignment - 1) & ~(alignment - 1));
+			//recorded even without accounting, as the free needs the start of the underlying allocation
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			allocations[addr] = AllocationInfo { allocSize, false /* fromSlab */, base, large, accounted, paddedSize };
+			allocationsChanged();
+			return addr;
+		}
+
+		//Frees the memory of a sandbox_mapped_file_helper, putting anonymous memory back first if the file was mapped
+		void trackedUnmapFileInSandbox(void* region, size_t regionSize, bool mapped, bool blocksSnapshot, unsigned long restartGeneration)
+		{
+			//the region went away with the sandbox if it was replaced since it was mapped
+			if(restartGeneration == getRestartGeneration())
+			{
+				if(mapped)
+				{
+					unmapFileUntrackedInSandbox(region, regionSize);
+				}
+				trackedFreeInSandbox(region);
+			}
+			if(blocksSnapshot)
+			{
+				liveFileMappings--;
+			}
+		}
+
+		//While enabled, frees from freeInSandbox and the heaparr helpers are queued and given to the sandbox together,
+		//at the next sandbox_invoke, once threshold frees are queued, or on flushDeferredFrees
+		//Disabling flushes the queue
+		void setDeferredFree(bool enable, size_t threshold = 64)
+		{
+			{
+				std::lock_guard<std::mutex> lock(deferredFreeLock);
+				deferredFreeThreshold = std::max(threshold, (size_t) 1);
+				deferFrees = enable;
+			}
+			if(!enable)
+			{
+				flushDeferredFrees();
+			}
+		}
+
+		void flushDeferredFrees()
+		{
+			std::vector<void*> pending;
+			{
+				std::lock_guard<std::mutex> lock(deferredFreeLock);
+				pending.swap(deferredFrees);
+				deferredFreeCount = 0;
+			}
+			if(!pending.empty())
+			{
+				freeBatchInSandbox(pending.data(), pending.size());
+			}
+		}
+
+		size_t getDeferredFreeCount()
+		{
+			return deferredFreeCount;
+		}
+
+		void* trackedPushStackArr(size_t size)
+		{
+			const bool accounted = memoryAccounting;
+			if(accounted && !reserveMemory(size))
+			{
+				return nullptr;
+			}
+			void* addr = this->impl_pushStackArr(size);
+			if(addr == nullptr && accounted)
+			{
+				releaseMemory(size);
+			}
+			return addr;
+		}
+
+		void trackedPopStackArr(void* addr, size_t size)
+		{
+			if(memoryAccounting)
+			{
+				releaseMemory(size);
+			}
+			this->impl_popStackArr(addr, size);
+		}
+
+		//Memory stats and quotas are only kept while accounting is on, so that allocations skip the bookkeeping otherwise
+		//Allocations made while it is off are never counted. Don't change it while stackarr helpers are alive
+		void setMemoryAccounting(bool enable)
+		{
+			memoryAccounting = enable;
+		}
+
+		inline bool isMemoryAccountingEnabled() const
+		{
+			return memoryAccounting;
+		}
+
+		//A quota of 0 means no limit. Allocations over the hard quota fail, those over the soft quota are only counted
+		//Setting a quota turns accounting on
+		void setMemoryQuota(size_t softQuota, size_t hardQuota)
+		{
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			memoryStats.softQuota = softQuota;
+			memoryStats.hardQuota = hardQuota;
+			if(softQuota != 0 || hardQuota != 0)
+			{
+				memoryAccounting = true;
+			}
+		}
+
+		RLBoxSandboxMemoryStats getMemoryStats()
+		{
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			return memoryStats;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline RLBox_Invoke_Status getLastInvokeStatus()
+		{
+			return this->impl_sandboxDiedInLastInvoke()? RLBox_Invoke_Status::SANDBOX_DIED : RLBox_Invoke_Status::SUCCESS;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline RLBox_Invoke_Status getLastInvokeStatus()
+		{
+			return RLBox_Invoke_Status::SUCCESS;
+		}
+
+		//Changes every time the backend replaces a crashed sandbox. Helpers holding sandbox memory record it when they
+		//allocate, and give up their memory without freeing it once it changed, as it belonged to the old sandbox
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline unsigned long getRestartGeneration()
+		{
+			return this->impl_getRestartCount();
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline unsigned long getRestartGeneration()
+		{
+			return 0;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline auto getRestartStats() -> decltype(std::declval<T2&>().impl_getRestartStats())
+		{
+			return this->impl_getRestartStats();
+		}
+
+		//Keeps a second, pre-started sandbox process ready so that recovering from a crash does not wait for a new process
+		//Off by default, as it doubles the number of processes per sandbox. Ignored by backends that can't restart
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline void setWarmSpare(bool enable)
+		{
+			this->impl_SetWarmSpare(enable);
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsRestart<T2>::value)>
+		inline void setWarmSpare(bool enable)
+		{
+		}
+
+		//Saves the current sandbox memory, for instance right after the library is initialized
+		//Returns false if the backend does not keep sandbox memory in a single region that we can snapshot,
+		//or while helpers from mapFileInSandbox are alive
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsSnapshot<T2>::value)>
+		inline bool snapshot()
+		{
+			if(liveFileMappings != 0)
+			{
+				return false;
+			}
+			flushDeferredFreesIfPending();
+			if(!this->impl_SnapshotMemory())
+			{
+				return false;
+			}
+			saveAllocatorStateForSnapshot();
+			{
+				std::lock_guard<std::mutex> blobLock(sharedBlobLock);
+				snapshotSharedBlobs.clear();
+				for(auto& entry : sharedBlobs)
+				{
+					snapshotSharedBlobs.insert(entry.first);
+				}
+			}
+			std::lock_guard<std::mutex> lock(callbackStateLock);
+			snapshotCallbackStates = liveCallbackStates;
+			return true;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsSnapshot<T2>::value)>
+		inline bool snapshot()
+		{
+			return false;
+		}
+
+		//Brings sandbox memory back to the last snapshot. Sandboxed pointers obtained after the snapshot are invalidated
+		//No sandbox functions may be running during the restore. Returns false while helpers from mapFileInSandbox are alive
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsSnapshot<T2>::value)>
+		inline bool restore()
+		{
+			if(liveFileMappings != 0)
+			{
+				return false;
+			}
+			if(!this->impl_RestoreMemory())
+			{
+				return false;
+			}
+			reapplyHugePages();
+			dropDeferredFrees();
+			{
+				//the restore put the snapshot's memory back over blobs mapped after it
+				std::lock_guard<std::mutex> blobLock(sharedBlobLock);
+				for(auto it = sharedBlobs.begin(); it != sharedBlobs.end();)
+				{
+					if(snapshotSharedBlobs.count(it->first) == 0)
+					{
+						it->second.release();
+						it = sharedBlobs.erase(it);
+					}
+					else
+					{
+						++it;
+					}
+				}
+			}
+			std::lock_guard<std::mutex> lock(memoryStatsLock);
+			restoreAllocatorStateFromSnapshot();
+			return true;
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsSnapshot<T2>::value)>
+		inline bool restore()
+		{
+			return false;
+		}
+
+		inline size_t getTotalMemory()
+		{
+			return this->impl_getTotalMemory();
+		}
+
+		//Resident bytes of sandbox memory. Returns 0 where sandbox memory is not separate from the application's
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsMemoryTrim<T2>::value)>
+		inline size_t getResidentMemory()
+		{
+			return this->impl_getResidentMemory();
+		}
+
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsMemoryTrim<T2>::value)>
+		inline size_t getResidentMemory()
+		{
+			return 0;
 		}
-		
-		void destroySandbox()
+
+		//Gives free sandbox memory back to the OS and returns the drop in resident memory
+		//Empty slab chunks are given back to the allocator and the pages of free slab objects are released. Then the
+		//allocator trims its heap if the library exports rlbox_malloc_trim, as libtest does
+		//No sandbox functions may be running during the trim
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(rlbox_detail::has_member_impl_SupportsMemoryTrim<T2>::value)>
+		inline size_t trimMemory()
 		{
-			this->impl_DestroySandbox();
+			const size_t before = this->impl_getResidentMemory();
+			//frees still queued would keep the allocator from trimming
+			flushDeferredFreesIfPending();
+			releaseEmptySlabChunks();
+			{
+				std::lock_guard<std::mutex> lock(memoryStatsLock);
+				releaseFreeSlabPages();
+			}
+			this->impl_TrimMemory();
+			const size_t after = this->impl_getResidentMemory();
+			return before > after? before - after : 0;
 		}
 
-		inline auto getSandbox() -> decltype(this->impl_getSandbox())
+		//Where sandbox memory is the application's heap, empty slab chunks are still given back to the allocator
+		template<typename T2=TSandbox, RLBOX_ENABLE_IF(!rlbox_detail::has_member_impl_SupportsMemoryTrim<T2>::value)>
+		inline size_t trimMemory()
 		{
-			return this->impl_getSandbox();
+			releaseEmptySlabChunks();
+			return 0;
+		}
+
+		inline tainted<char*, TSandbox> getMaxPointer()
+		{
+			tainted<char*, TSandbox> ret;
+			ret.field = this->impl_getMaxPointer();
+			return ret;
 		}
 
 		template<typename T>
-		tainted<T*, TSandbox> mallocInSandbox(unsigned int count=1)
+		inline void* getSandboxedPointer(T* p)
+		{
+			return this->impl_GetSandboxedPointer(p);
+		}
+
+		template<typename T>
+		inline void* getUnsandboxedPointer(T* p)
+		{
+			return this->impl_GetUnsandboxedPointer(p);
+		}
+
+		inline bool isValidSandboxedPointer(const void* p, bool isFuncPtr)
+		{
+			return this->impl_isValidSandboxedPointer(p, isFuncPtr);
+		}
+
+		inline bool isPointerInSandboxMemoryOrNull(const void* p)
+		{
+			return this->impl_isPointerInSandboxMemoryOrNull(p);
+		}
+
+		//Whether all size bytes from p are in sandbox memory, checking only the ends of the range
+		//A null p is only accepted for an empty range
+		inline bool isRangeInSandboxMemory(const void* p, size_t size)
 		{
-			void* addr = this->impl_mallocInSandbox(sizeof(T) * count);
-			if(!this->isValidSandboxedPointer(this->getSandboxedPointer(addr), false /* isFuncPtr */))
+			if(size == 0)
 			{
-				abort();
+				return isPointerInSandboxMemoryOrNull(p);
 			}
-			tainted<T*, TSandbox> ret;
-			ret.field = static_cast<T*>(addr);
+			const uintptr_t start = (uintptr_t) p;
+			return p != nullptr && start <= UINTPTR_MAX - (size - 1) && isPointerInSandboxMemoryOrNull(p)
+				&& isPointerInSandboxMemoryOrNull((const void*) (start + size - 1));
+		}
+
+		inline bool isPointerInAppMemoryOrNull(const void* p)
+		{
+			return this->impl_isPointerInAppMemoryOrNull(p);
+		}
+
+		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(my_is_void_v<return_argument<T>> && sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
+		void invokeWithFunctionPointer(T* fnPtr, TArgs&&... params)
+		{
+			flushDeferredFreesIfPending();
+			this->impl_InvokeFunction(fnPtr, sandbox_removeWrapper(this, std::forward<TArgs>(params))...);
+			handleSandboxRestart();
+		}
+
+		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(!my_is_void_v<return_argument<T>> && sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
+		tainted<return_argument<T>, TSandbox> invokeWithFunctionPointer(T* fnPtr, TArgs&&... params)
+		{
+			flushDeferredFreesIfPending();
+			tainted<return_argument<T>, TSandbox> ret = sandbox_convertToUnverified<return_argument<T>>(this, this->impl_InvokeFunction(fnPtr, sandbox_removeWrapper(this, std::forward<TArgs>(params))...));
+			handleSandboxRestart();
 			return ret;
 		}
 
+		//Invokes a function returning a struct and writes the result straight into dest, skipping the copies made
+		//when the result is returned as a tainted value
+		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(my_is_class_v<return_argument<T>> && sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
+		void invokeWithFunctionPointerInto(tainted<return_argument<T>, TSandbox>& dest, T* fnPtr, TArgs&&... params)
+		{
+			flushDeferredFreesIfPending();
+			auto&& retRaw = this->impl_InvokeFunction(fnPtr, sandbox_removeWrapper(this, std::forward<TArgs>(params))...);
+			memcpy(&dest, &retRaw, sizeof(return_argument<T>));
+			dest.unsandboxPointersOrNull(this);
+			handleSandboxRestart();
+		}
+
+		//Same as above, but dest is in sandbox memory, so the struct is left as the library wrote it and pointer fields
+		//are only unswizzled when they are read through dest
+		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(my_is_class_v<return_argument<T>> && sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
+		void invokeWithFunctionPointerInto(tainted<return_argument<T>*, TSandbox> dest, T* fnPtr, TArgs&&... params)
+		{
+			auto destPtr = (char*) dest.UNSAFE_Unverified();
+			if(!destPtr || !isPointerInSandboxMemoryOrNull(destPtr) || !isPointerInSandboxMemoryOrNull(destPtr + sizeof(return_argument<T>) - 1))
+			{
+				printf("Destination of sandbox_invoke_into is not in sandbox memory\n");
+				abort();
+			}
+			flushDeferredFreesIfPending();
+			invokeFunctionIntoSandbox(destPtr, fnPtr, sandbox_removeWrapper(this, std::forward<TArgs>(params))...);
+			handleSandboxRestart();
+		}
+
+		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
+		return_argument<T> invokeWithFunctionPointerReturnAppPtr(T* fnPtr, TArgs&&... params)
+		{
+			flushDeferredFreesIfPending();
+			auto ret = this->impl_InvokeFunctionReturnAppPtr(fnPtr, sandbox_removeWrapper(this, std::forward<TArgs>(params))...);
+			handleSandboxRestart();
+			auto p_appPtrMap = getMaintainAppPtrMap();
+			auto it = p_appPtrMap->find((void*) ret);
+			return_argument<T> val = nullptr;
+			if (it != p_appPtrMap->end()) {
+				val = (return_argument<T>) it->second;
+			}
+			return val;
+		}
+
+		void* getFunctionPointerFromCache(const char* fnName, bool forSandboxFunction)
+		{
+			void* fnPtr;
+			std::lock_guard<std::mutex> lock(functionPointerCacheLock);
+			if(!fnPointerMap)
+			{
+				fnPointerMap = new std::map<std::string, void*>;
+			}
+
+			auto& fnMapTyped = *(std::map<std::string, void*> *) fnPointerMap;
+			auto fnPtrRef = fnMapTyped.find(fnName);
+
+			if(fnPtrRef == fnMapTyped.end())
+			{
+				fnPtr = this->impl_LookupSymbol(fnName, forSandboxFunction);
+				//lookups fail without aborting only if the sandbox died, so don't cache these
+				if(fnPtr)
+				{
+					fnMapTyped[fnName] = fnPtr;
+				}
+			}
+			else
+			{
+				fnPtr = fnPtrRef->second;
+			}
+
+			return fnPtr;
+		}
 		template<typename T>
-		tainted_freezable<T*, TSandbox> mallocFrozenInSandbox()
+		inline sandbox_app_ptr_wrapper<T> app_ptr(T* arg)
+		{
+			auto p_appPtrMap = getMaintainAppPtrMap();
+
+			std::lock_guard<std::mutex> lock(this->appPtrMapMutex);
+			bool found = false;
+			T* key;
+			for (auto it = p_appPtrMap->begin(); it != p_appPtrMap->end(); it++)
+			{
+				if (it->second == arg)
+				{
+					key = (T*) it->first;
+					found = true;
+					break;
+				}
+			}
+
+			if (!found)
+			{
+				this->appPtrMapCounter++;
+				key = (T*)(uintptr_t)this->appPtrMapCounter;
+				(*p_appPtrMap)[(void*)key] = (void*) arg;
+			}
+
+			return sandbox_app_ptr_wrapper<T>(key);
+		}
+
+		inline std::map<void*, void*>* getMaintainAppPtrMap()
+		{
+			return &(this->appPtrMap);
+		}
+
+		//The array helpers can't report a failed allocation, and a null pointer handed to the library would go unnoticed
+		//So running over the hard quota or out of sandbox memory there is fatal. Use mallocInSandbox to handle it instead
+		static inline void* checkArrAllocation(void* addr, size_t size, const char* name)
 		{
-			void* addr = this->impl_mallocInSandbox(sizeof(T));
-			if(!this->isValidSandboxedPointer(this->getSandboxedPointer(addr), false /* isFuncPtr */))
+			if(addr == nullptr && size != 0)
 			{
+				printf("%s could not allocate %zu bytes in the sandbox\n", name, size);
 				abort();
 			}
-			tainted_freezable<T*, TSandbox> ret;
-			ret.field = static_cast<T*>(addr);
-			return ret;
+			return addr;
 		}
 
-		template <typename T, RLBOX_ENABLE_IF(my_is_base_of_v<sandbox_wrapper_base, T>)>
-		void freeInSandbox(T val)
+		template<typename T>
+		sandbox_stackarr_helper<T, TSandbox> stacktemp()
 		{
-			return this->impl_freeInSandbox(val.UNSAFE_Unverified());
+			const size_t size = sizeof(T);
+			const unsigned long generation = getRestartGeneration();
+			T* argInSandbox = static_cast<T*>(checkArrAllocation(trackedPushStackArr(size), size, "stacktemp"));
+			if(argInSandbox != nullptr)
+			{
+				memset((void*)argInSandbox, 0, size);
+			}
+
+			return sandbox_stackarr_helper<T, TSandbox>(this, argInSandbox, size, generation);
+		}
+
+		inline std::mutex* getMaintainAppPtrMapMutex()
+		{
+			return &(this->appPtrMapMutex);
 		}
 
 		template <typename T>
-		void freeInSandbox(tainted_freezable<T*, TSandbox> val)
+		inline sandbox_stackarr_helper<T, TSandbox> stackarr(T* arg, size_t size)
 		{
-			val->unfreeze();
-			return this->impl_freeInSandbox(val.UNSAFE_Unverified());
+			const unsigned long generation = getRestartGeneration();
+			T* argInSandbox = static_cast<T*>(checkArrAllocation(trackedPushStackArr(size), size, "stackarr"));
+			if(argInSandbox != nullptr)
+			{
+				// static_cast drops constness
+				memcpy((void*) argInSandbox, (void*) arg, size);
+			}
+
+			sandbox_stackarr_helper<T, TSandbox> ret(this, argInSandbox, size, generation);
+			return ret;
+		}
+		inline sandbox_stackarr_helper<const char, TSandbox> stackarr(const char* str)
+		{
+			return stackarr(str, strlen(str) + 1);
+		}
+		inline sandbox_stackarr_helper<char, TSandbox> stackarr(char* str)
+		{
+			return stackarr(str, strlen(str) + 1);
 		}
 
-		inline size_t getTotalMemory()
+		template <typename T>
+		inline sandbox_heaparr_helper<T, TSandbox> heaparr(T* arg, size_t size)
 		{
-			return this->impl_getTotalMemory();
+			const unsigned long generation = getRestartGeneration();
+			T* argInSandbox = static_cast<T*>(checkArrAllocation(trackedMallocInSandbox(size), size, "heaparr"));
+			if(argInSandbox != nullptr)
+			{
+				// static_cast drops constness
+				memcpy((void*)argInSandbox, (void*)arg, size);
+			}
+
+			sandbox_heaparr_helper<T, TSandbox> ret(this, argInSandbox, generation);
+			return ret;
+		}
+		inline sandbox_heaparr_helper<const char, TSandbox> heaparr(const char* str)
+		{
+			return heaparr(str, strlen(str) + 1);
+		}
+		inline sandbox_heaparr_helper<char, TSandbox> heaparr(char* str)
+		{
+			return heaparr(str, strlen(str) + 1);
 		}
 
-		inline tainted<char*, TSandbox> getMaxPointer()
+		//Packs several buffers into one sandbox allocation, instead of one heaparr per buffer
+		template <typename... T>
+		inline sandbox_scatter_helper<TSandbox, T...> scatterarr(const sandbox_iovec<T>&... iovs)
 		{
-			tainted<char*, TSandbox> ret;
-			ret.field = this->impl_getMaxPointer();
+			return sandbox_scatter_helper<TSandbox, T...>(this, iovs...);
+		}
+
+		//Makes length bytes of the regular file fd from offset readable by the sandbox. Backends running the library in our
+		//process map the page cache into sandbox memory, so nothing is copied, and the Process sandbox reads the file into it
+		//readOnly mappings fault if the library writes to them. Writes to other mappings are not written back to the file
+		//The file must not be truncated while mapped, as reading pages past its end raises SIGBUS. Use a memfd sealed with
+		//F_SEAL_SHRINK for files others can write to
+		//snapshot and restore refuse to run while the helper is alive, as a restore would replace the mapping
+		//Returns a null pointer if the range is not in the file, the allocation would exceed the hard quota or reading fails
+		sandbox_mapped_file_helper<TSandbox> mapFileInSandbox(int fd, off_t offset, size_t length, bool readOnly = true)
+		{
+			return trackedMapFileInSandbox(fd, offset, length, readOnly, true /* blocksSnapshot */);
+		}
+
+		sandbox_mapped_file_helper<TSandbox> trackedMapFileInSandbox(int fd, off_t offset, size_t length, bool readOnly, bool blocksSnapshot)
+		{
+			struct stat fileInfo;
+			if(length == 0 || offset < 0 || fstat(fd, &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode) ||
+				offset > fileInfo.st_size || length > (unsigned long long) (fileInfo.st_size - offset))
+			{
+				return sandbox_mapped_file_helper<TSandbox>();
+			}
+
+			//mmap needs a page aligned file offset, so the range starts partway into the first page
+			const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+			const size_t pageOffset = (size_t) offset % pageSize;
+			const size_t regionSize = (pageOffset + length + pageSize - 1) & ~(pageSize - 1);
+			const unsigned long generation = getRestartGeneration();
+			char* region = (char*) trackedMallocAlignedInSandbox(regionSize, pageSize);
+			if(region == nullptr)
+			{
+				return sandbox_mapped_file_helper<TSandbox>();
+			}
+			if(!isRangeInSandboxMemory(region, regionSize))
+			{
+				abort();
+			}
+
+			const bool mapped = mapFileUntrackedInSandbox(region, regionSize, fd, offset - pageOffset, readOnly);
+			if(!mapped)
+			{
+				size_t copied = 0;
+				while(copied < length)
+				{
+					ssize_t readCount = pread(fd, region + pageOffset + copied, length - copied, offset + copied);
+					if(readCount <= 0)
+					{
+						if(readCount == -1 && errno == EINTR) { continue; }
+						trackedFreeInSandbox(region);
+						return sandbox_mapped_file_helper<TSandbox>();
+					}
+					copied += readCount;
+				}
+			}
+			if(blocksSnapshot)
+			{
+				liveFileMappings++;
+			}
+			return sandbox_mapped_file_helper<TSandbox>(this, region, regionSize, region + pageOffset, length, mapped, blocksSnapshot, generation);
+		}
+
+		//Maps a shared blob read-only into this sandbox on first use and returns the same address on later calls
+		//Backends that can map files share the blob's pages with every other sandbox, the Process sandbox gets a copy
+		//Sandboxes with blobs mapped can't be used as clone templates, see cloneFrom
+		//Returns a null pointer if the blob is not valid or could not be mapped
+		tainted<const char*, TSandbox> getSharedBlob(const RLBoxSharedBlob& blob)
+		{
+			{
+				std::lock_guard<std::mutex> lock(sharedBlobLock);
+				auto it = sharedBlobs.find(blob.getId());
+				if(it != sharedBlobs.end())
+				{
+					return it->second.get();
+				}
+			}
+			if(!blob.isValid())
+			{
+				return nullptr;
+			}
+			//mapped and unmapped outside sharedBlobLock, as that takes memoryStatsLock
+			//blobs are read-only, so they are not in a snapshot, and a restore drops those mapped after it
+			auto mapped = trackedMapFileInSandbox(blob.getFd(), 0, blob.size(), true /* readOnly */, false /* blocksSnapshot */);
+			if(mapped.get() == nullptr)
+			{
+				return nullptr;
+			}
+			std::lock_guard<std::mutex> lock(sharedBlobLock);
+			auto it = sharedBlobs.find(blob.getId());
+			if(it == sharedBlobs.end())
+			{
+				it = sharedBlobs.emplace(blob.getId(), std::move(mapped)).first;
+			}
+			//if another thread mapped the blob first, ours is unmapped once the lock is dropped
+			return it->second.get();
+		}
+
+		//Unmaps a blob from getSharedBlob. Returns false if it was not mapped in this sandbox
+		bool unmapSharedBlob(const RLBoxSharedBlob& blob)
+		{
+			std::unique_lock<std::mutex> lock(sharedBlobLock);
+			auto it = sharedBlobs.find(blob.getId());
+			if(it == sharedBlobs.end())
+			{
+				return false;
+			}
+			sandbox_mapped_file_helper<TSandbox> removed(std::move(it->second));
+			sharedBlobs.erase(it);
+			lock.unlock();
+			return true;
+		}
+
+		template <typename TRet, typename... TArgs, RLBOX_ENABLE_IF(sandbox_callback_all_args_are_tainted<TSandbox, TArgs...>::value)>
+		__attribute__ ((noinline))
+		sandbox_callback_helper<TRet(sandbox_removeWrapper_t<TArgs>...), TSandbox> createCallback(TRet(*fnPtr)(RLBoxSandbox<TSandbox>*, TArgs...))
+		{
+			using fnType = TRet(sandbox_removeWrapper_t<TArgs>...);
+			auto registerCallback = sandbox_callback_register<TSandbox, TRet, sandbox_removeWrapper_t<TArgs>...>;
+			auto key = std::make_pair((void*)(uintptr_t)fnPtr, (void*)(uintptr_t)registerCallback);
+
+			//callbacks for the same function share one registration, so creating them again is a lookup
+			std::lock_guard<std::mutex> lock(callbackStateLock);
+			sandbox_callback_state<TSandbox>* stateObject;
+			auto it = callbackCache.find(key);
+			if(it != callbackCache.end() && liveCallbackStates.count(it->second) != 0)
+			{
+				stateObject = it->second;
+				if(stateObject->refCount == 0)
+				{
+					idleCallbackStates.erase(std::find(idleCallbackStates.begin(), idleCallbackStates.end(), stateObject));
+				}
+			}
+			else
+			{
+				stateObject = newCallbackStateLocked((void*)(uintptr_t)fnPtr, registerCallback, sandbox_callback_unregister<TSandbox, fnType>);
+				stateObject->registeredAddress = stateObject->registerCallback(this, stateObject);
+				if(stateObject->registeredAddress == nullptr)
+				{
+					//out of callback slots, the helper is empty and nothing is counted
+					deleteCallbackStateLocked(stateObject);
+					return sandbox_callback_helper<fnType, TSandbox>();
+				}
+				liveCallbackStates.insert(stateObject);
+				callbackCache[key] = stateObject;
+			}
+			stateObject->refCount++;
+			callbackHelperCount++;
+			auto ret = sandbox_callback_helper<fnType, TSandbox>(this, (fnType*)(uintptr_t)stateObject->registeredAddress, stateObject);
 			return ret;
 		}
 
-		template<typename T>
-		inline void* getSandboxedPointer(T* p)
+		//Creates a callback from a lambda or other function object, which can carry its own context instead of
+		//passing it through the sandbox as an app_ptr. Objects of up to inlineCallableSize bytes are stored in the callback state
+		template <typename TFunc, RLBOX_ENABLE_IF(std::is_class<my_decay_t<TFunc>>::value)>
+		inline auto createCallback(TFunc&& callable)
 		{
-			return this->impl_GetSandboxedPointer(p);
+			return createCallableCallback(std::forward<TFunc>(callable), &my_decay_t<TFunc>::operator());
 		}
 
-		template<typename T>
-		inline void* getUnsandboxedPointer(T* p)
+		template <typename TFunc, typename TClass, typename TRet, typename... TArgs, RLBOX_ENABLE_IF(sandbox_callback_all_args_are_tainted<TSandbox, TArgs...>::value)>
+		inline sandbox_callback_helper<TRet(sandbox_removeWrapper_t<TArgs>...), TSandbox> createCallableCallback(TFunc&& callable, TRet(TClass::*)(RLBoxSandbox<TSandbox>*, TArgs...) const)
 		{
-			return this->impl_GetUnsandboxedPointer(p);
+			return createCallableCallbackHelper<TFunc, TRet, TArgs...>(std::forward<TFunc>(callable));
 		}
 
-		inline bool isValidSandboxedPointer(const void* p, bool isFuncPtr)
+		template <typename TFunc, typename TClass, typename TRet, typename... TArgs, RLBOX_ENABLE_IF(sandbox_callback_all_args_are_tainted<TSandbox, TArgs...>::value)>
+		inline sandbox_callback_helper<TRet(sandbox_removeWrapper_t<TArgs>...), TSandbox> createCallableCallback(TFunc&& callable, TRet(TClass::*)(RLBoxSandbox<TSandbox>*, TArgs...))
 		{
-			return this->impl_isValidSandboxedPointer(p, isFuncPtr);
+			return createCallableCallbackHelper<TFunc, TRet, TArgs...>(std::forward<TFunc>(callable));
+		}
+
+		template <typename TFunc, typename TRet, typename... TArgs>
+		sandbox_callback_helper<TRet(sandbox_removeWrapper_t<TArgs>...), TSandbox> createCallableCallbackHelper(TFunc&& callable)
+		{
+			using fnType = TRet(sandbox_removeWrapper_t<TArgs>...);
+			auto stateObject = newCallbackState((void*) nullptr, sandbox_callback_register_callable<TSandbox, my_decay_t<TFunc>, TRet, sandbox_removeWrapper_t<TArgs>...>, sandbox_callback_unregister<TSandbox, fnType>);
+			stateObject->storeCallable(std::forward<TFunc>(callable));
+			stateObject->registeredAddress = stateObject->registerCallback(this, stateObject);
+			if(stateObject->registeredAddress == nullptr)
+			{
+				deleteCallbackState(stateObject);
+				return sandbox_callback_helper<fnType, TSandbox>();
+			}
+			stateObject->refCount = 1;
+			{
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				liveCallbackStates.insert(stateObject);
+				callbackHelperCount++;
+			}
+			auto ret = sandbox_callback_helper<fnType, TSandbox>(this, (fnType*)(uintptr_t)stateObject->registeredAddress, stateObject);
+			return ret;
 		}
 
-		inline bool isPointerInSandboxMemoryOrNull(const void* p)
+		//Drops a callback helper's reference, unregistering the callback and freeing its state with the last one
+		void releaseCallbackReference(sandbox_callback_state<TSandbox>* stateObject)
 		{
-			return this->impl_isPointerInSandboxMemoryOrNull(p);
+			{
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				callbackHelperCount--;
+				if(--stateObject->refCount != 0)
+				{
+					return;
+				}
+				auto it = callbackCache.find(getCallbackCacheKey(stateObject));
+				const bool cached = it != callbackCache.end() && it->second == stateObject;
+				if(cached && liveCallbackStates.count(stateObject) != 0 && idleCallbackStates.size() < idleCallbackLimit)
+				{
+					idleCallbackStates.push_back(stateObject);
+					return;
+				}
+				if(cached)
+				{
+					callbackCache.erase(it);
+				}
+			}
+			releaseCallbackState(stateObject);
+			deleteCallbackState(stateObject);
 		}
 
-		inline bool isPointerInAppMemoryOrNull(const void* p)
+		//Callback helpers call back into the sandbox object when they are destroyed, so it must outlive them
+		size_t getCallbackHelperCount()
 		{
-			return this->impl_isPointerInAppMemoryOrNull(p);
+			std::lock_guard<std::mutex> lock(callbackStateLock);
+			return callbackHelperCount;
 		}
 
-		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(my_is_void_v<return_argument<T>> && sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
-		void invokeWithFunctionPointer(T* fnPtr, TArgs&&... params)
+		//Keeps up to limit callbacks registered after their last helper is unregistered, so that creating them again
+		//does not register them again. The sandbox can still call a kept callback, so only use this if that is safe
+		void setIdleCallbackLimit(size_t limit)
 		{
-			// TODO: use std::forward?
-			this->impl_InvokeFunction(fnPtr, sandbox_removeWrapper(this, params)...);
+			bool release;
+			{
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				idleCallbackLimit = limit;
+				release = idleCallbackStates.size() > limit;
+			}
+			if(release)
+			{
+				releaseIdleCallbacks();
+			}
 		}
 
-		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(!my_is_void_v<return_argument<T>> && sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
-		tainted<return_argument<T>, TSandbox> invokeWithFunctionPointer(T* fnPtr, TArgs&&... params)
+		void releaseIdleCallbacks()
 		{
-			// TODO: use std::forward?
-			tainted<return_argument<T>, TSandbox> ret = sandbox_convertToUnverified<return_argument<T>>(this, this->impl_InvokeFunction(fnPtr, sandbox_removeWrapper(this, params)...));
-			return ret;
+			std::vector<sandbox_callback_state<TSandbox>*> idleStates;
+			{
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				idleStates.swap(idleCallbackStates);
+				for(auto stateObject : idleStates)
+				{
+					eraseFromCallbackCache(stateObject);
+				}
+			}
+			for(auto stateObject : idleStates)
+			{
+				releaseCallbackState(stateObject);
+				deleteCallbackState(stateObject);
+			}
 		}
 
-		template <typename T, typename ... TArgs, RLBOX_ENABLE_IF(sandbox_function_have_all_args_fundamental_or_wrapped<TArgs...>::value && my_is_invocable_v<T, sandbox_removeWrapper_t<TArgs>...>)>
-		return_argument<T> invokeWithFunctionPointerReturnAppPtr(T* fnPtr, TArgs&&... params)
+		//Unregisters the callback unless a reset already did so. The caller owns and frees the state object
+		void releaseCallbackState(sandbox_callback_state<TSandbox>* stateObject)
 		{
-			auto ret = this->impl_InvokeFunctionReturnAppPtr(fnPtr, sandbox_removeWrapper(this, params)...);
-			auto p_appPtrMap = getMaintainAppPtrMap();
-			auto it = p_appPtrMap->find((void*) ret);
-			return_argument<T> val = nullptr;
-			if (it != p_appPtrMap->end()) {
-				val = (return_argument<T>) it->second;
+			{
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				snapshotCallbackStates.erase(stateObject);
+				if(liveCallbackStates.erase(stateObject) == 0)
+				{
+					return;
+				}
 			}
-			return val;
+			stateObject->unregisterCallback(this, stateObject->actualCallback);
 		}
 
-		void* getFunctionPointerFromCache(const char* fnName, bool forSandboxFunction)
+		//Drops state accumulated while the sandbox was in use, so that it can be handed to a different user
+		//Callback helpers that are still alive become inert, and app_ptr values handed out earlier no longer resolve
+		//If a snapshot was taken, sandbox memory is also restored to it, and callbacks that existed at the snapshot are kept
+		void resetSandbox()
 		{
-			void* fnPtr;
-			std::lock_guard<std::mutex> lock(functionPointerCacheLock);
-			if(!fnPointerMap)
+			std::vector<sandbox_callback_state<TSandbox>*> statesToRelease;
+			//idle cached callbacks have no helper that would free them once they are unregistered
+			std::vector<sandbox_callback_state<TSandbox>*> statesToDelete;
 			{
-				fnPointerMap = new std::map<std::string, void*>;
+				std::lock_guard<std::mutex> lock(callbackStateLock);
+				for(auto it = idleCallbackStates.begin(); it != idleCallbackStates.end();)
+				{
+					if(snapshotCallbackStates.count(*it) == 0)
+					{
+						eraseFromCallbackCache(*it);
+						statesToDelete.push_back(*it);
+						it = idleCallbackStates.erase(it);
+					}
+					else
+					{
+						it++;
+					}
+				}
+				for(auto it = liveCallbackStates.begin(); it != liveCallbackStates.end();)
+				{
+					if(snapshotCallbackStates.count(*it) == 0)
+					{
+						statesToRelease.push_back(*it);
+						it = liveCallbackStates.erase(it);
+					}
+					else
+					{
+						it++;
+					}
+				}
 			}
-
-			auto& fnMapTyped = *(std::map<std::string, void*> *) fnPointerMap;
-			auto fnPtrRef = fnMapTyped.find(fnName);
-
-			if(fnPtrRef == fnMapTyped.end())
+			for(auto stateObject : statesToRelease)
 			{
-				fnPtr = this->impl_LookupSymbol(fnName, forSandboxFunction);
-				fnMapTyped[fnName] = fnPtr;
+				stateObject->unregisterCallback(this, stateObject->actualCallback);
 			}
-			else
+			for(auto stateObject : statesToDelete)
 			{
-				fnPtr = fnPtrRef->second;
+				deleteCallbackState(stateObject);
 			}
 
-			return fnPtr;
+			{
+				std::lock_guard<std::mutex> lock(appPtrMapMutex);
+				appPtrMap.clear();
+				appPtrMapCounter = 0;
+			}
+
+			restore();
 		}
-		template<typename T>
-		inline sandbox_app_ptr_wrapper<T> app_ptr(T* arg)
+	};
+
+	//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	class RLBoxSandboxPoolStats
+	{
+	public:
+		unsigned long checkouts = 0;
+		//checkouts served by an idle sandbox, vs. those that had to create one or wait for one to be returned
+		unsigned long hits = 0;
+		unsigned long misses = 0;
+		unsigned long waits = 0;
+		unsigned long created = 0;
+		unsigned long destroyed = 0;
+		size_t trimmedBytes = 0;
+		std::chrono::nanoseconds totalWaitTime{0};
+		std::chrono::nanoseconds maxWaitTime{0};
+		size_t idleCount = 0;
+		size_t totalCount = 0;
+
+		inline double hitRate() const
+		{
+			return checkouts == 0? 0.0 : ((double) hits) / checkouts;
+		}
+	};
+
+	//Keeps initialized sandboxes around so that users don't pay for sandbox creation on every use
+	//Sandboxes are handed out as leases, and are reset rather than destroyed when the lease ends
+	//All leases must be returned before the pool is destroyed
+	template<typename TSandbox>
+	class RLBoxSandboxPool
+	{
+	public:
+		class Lease
 		{
-			auto p_appPtrMap = getMaintainAppPtrMap();
+		private:
+			RLBoxSandboxPool<TSandbox>* pool;
+			RLBoxSandbox<TSandbox>* sandbox;
+		public:
+			Lease(RLBoxSandboxPool<TSandbox>* pool, RLBoxSandbox<TSandbox>* sandbox) : pool(pool), sandbox(sandbox) {}
+			Lease(const Lease&) = delete;
+			Lease& operator=(const Lease&) = delete;
 
-			std::lock_guard<std::mutex> lock(this->appPtrMapMutex);
-			bool found = false;
-			T* key;
-			for (auto it = p_appPtrMap->begin(); it != p_appPtrMap->end(); it++)
+			Lease(Lease&& other)
 			{
-				if (it->second == arg)
+				pool = other.pool;
+				sandbox = other.sandbox;
+				other.pool = nullptr;
+				other.sandbox = nullptr;
+			}
+
+			Lease& operator=(Lease&& other)
+			{
+				if (this != &other)
 				{
-					key = (T*) it->first;
-					found = true;
-					break;
+					release();
+					pool = other.pool;
+					sandbox = other.sandbox;
+					other.pool = nullptr;
+					other.sandbox = nullptr;
 				}
+				return *this;
 			}
 
-			if (!found)
+			void release()
 			{
-				this->appPtrMapCounter++;
-				key = (T*)(uintptr_t)this->appPtrMapCounter;
-				(*p_appPtrMap)[(void*)key] = (void*) arg;
+				if(sandbox != nullptr)
+				{
+					pool->checkin(sandbox);
+					pool = nullptr;
+					sandbox = nullptr;
+				}
 			}
 
-			return sandbox_app_ptr_wrapper<T>(key);
+			~Lease()
+			{
+				release();
+			}
+
+			inline RLBoxSandbox<TSandbox>* get() const noexcept { return sandbox; }
+			inline RLBoxSandbox<TSandbox>* operator->() const noexcept { return sandbox; }
+		};
+
+	private:
+		class IdleSandbox
+		{
+		public:
+			RLBoxSandbox<TSandbox>* sandbox;
+			std::chrono::steady_clock::time_point idleSince;
+		};
+
+		const std::string sandboxRuntimePath;
+		const std::string libraryPath;
+		const size_t minSize;
+		const size_t maxSize;
+		const std::chrono::milliseconds idleTimeout;
+		const std::function<void(RLBoxSandbox<TSandbox>*)> initializer;
+		const RLBoxSandboxOptions options;
+
+		std::mutex poolLock;
+		std::condition_variable sandboxReturned;
+		//used as a stack, so that the most recently used (and warmest) sandbox is handed out first
+		std::vector<IdleSandbox> idleSandboxes;
+		size_t totalCount = 0;
+		RLBoxSandboxPoolStats stats;
+		//evicted sandboxes are torn down here, and the pool's destructor waits for them
+		RLBoxSandboxReaper reaper;
+
+		std::thread autoTrimThread;
+		bool autoTrimStopping = false;
+		std::condition_variable autoTrimStop;
+
+		RLBoxSandbox<TSandbox>* createPoolSandbox()
+		{
+			auto sandbox = RLBoxSandbox<TSandbox>::createSandbox(sandboxRuntimePath.c_str(), libraryPath.c_str(), options);
+			if(initializer)
+			{
+				initializer(sandbox);
+			}
+			//where supported, returned sandboxes are restored to their freshly initialized memory
+			sandbox->snapshot();
+			return sandbox;
 		}
 
-		inline std::map<void*, void*>* getMaintainAppPtrMap()
+		static void destroyPoolSandbox(RLBoxSandbox<TSandbox>* sandbox)
 		{
-			return &(this->appPtrMap);
+			sandbox->destroySandbox();
+			delete sandbox;
 		}
 
-		template<typename T>
-		sandbox_stackarr_helper<T, TSandbox> stacktemp()
+		//Removes sandboxes that reached the idle timeout while keeping at least minSize sandboxes
+		//Returns the sandboxes to destroy, as we don't want to destroy them while holding the lock
+		std::vector<RLBoxSandbox<TSandbox>*> evictIdleLocked()
 		{
-			const size_t size = sizeof(T);
-			T* argInSandbox = static_cast<T*>(this->impl_pushStackArr(size));
-			memset((void*)argInSandbox, 0, size);
-
-			return sandbox_stackarr_helper<T, TSandbox>(this, argInSandbox, size);
+			std::vector<RLBoxSandbox<TSandbox>*> ret;
+			auto now = std::chrono::steady_clock::now();
+			//the oldest entries are at the bottom of the stack
+			auto it = idleSandboxes.begin();
+			while(it != idleSandboxes.end() && totalCount > minSize && now - it->idleSince >= idleTimeout)
+			{
+				//callback helpers that outlived their lease still refer to the sandbox, so it is kept until they are gone
+				if(it->sandbox->getCallbackHelperCount() != 0)
+				{
+					it++;
+					continue;
+				}
+				ret.push_back(it->sandbox);
+				totalCount--;
+				stats.destroyed++;
+				it = idleSandboxes.erase(it);
+			}
+			return ret;
 		}
 
-		inline std::mutex* getMaintainAppPtrMapMutex()
+		void checkin(RLBoxSandbox<TSandbox>* sandbox)
 		{
-			return &(this->appPtrMapMutex);
+			sandbox->resetSandbox();
+			std::vector<RLBoxSandbox<TSandbox>*> evicted;
+			{
+				std::lock_guard<std::mutex> lock(poolLock);
+				IdleSandbox idle;
+				idle.sandbox = sandbox;
+				idle.idleSince = std::chrono::steady_clock::now();
+				idleSandboxes.push_back(idle);
+				evicted = evictIdleLocked();
+			}
+			//evicting sandboxes frees up room for waiters to create new ones
+			if(evicted.empty())
+			{
+				sandboxReturned.notify_one();
+			}
+			else
+			{
+				sandboxReturned.notify_all();
+			}
+			//checkin runs on the thread that used the sandbox, so keep teardown off it
+			for(auto evictedSandbox : evicted)
+			{
+				evictedSandbox->destroySandboxAsync(reaper);
+			}
 		}
 
-		template <typename T>
-		inline sandbox_stackarr_helper<T, TSandbox> stackarr(T* arg, size_t size)
-		{
-			T* argInSandbox = static_cast<T*>(this->impl_pushStackArr(size));
-			// static_cast drops constness
-			memcpy((void*) argInSandbox, (void*) arg, size);
+	public:
+		//initializer is run once on every new sandbox, for instance to initialize the sandboxed library
+		//Every sandbox of the pool is created with options
+		RLBoxSandboxPool(const char* sandboxRuntimePath, const char* libraryPath, size_t minSize, size_t maxSize,
+			std::chrono::milliseconds idleTimeout, std::function<void(RLBoxSandbox<TSandbox>*)> initializer = nullptr,
+			const RLBoxSandboxOptions& options = RLBoxSandboxOptions())
+			: sandboxRuntimePath(sandboxRuntimePath), libraryPath(libraryPath), minSize(minSize), maxSize(maxSize),
+			idleTimeout(idleTimeout), initializer(initializer), options(options)
+		{
+			if(maxSize == 0 || minSize > maxSize)
+			{
+				printf("Invalid sandbox pool size: min %zu, max %zu\n", minSize, maxSize);
+				abort();
+			}
 
-			sandbox_stackarr_helper<T, TSandbox> ret(this, argInSandbox, size);
-			return ret;
-		}
-		inline sandbox_stackarr_helper<const char, TSandbox> stackarr(const char* str)
-		{
-			return stackarr(str, strlen(str) + 1);
+			for(size_t i = 0; i < minSize; i++)
+			{
+				IdleSandbox idle;
+				idle.sandbox = createPoolSandbox();
+				idle.idleSince = std::chrono::steady_clock::now();
+				idleSandboxes.push_back(idle);
+			}
+			totalCount = minSize;
+			stats.created = minSize;
 		}
-		inline sandbox_stackarr_helper<char, TSandbox> stackarr(char* str)
+
+		RLBoxSandboxPool(const RLBoxSandboxPool&) = delete;
+		RLBoxSandboxPool& operator=(const RLBoxSandboxPool&) = delete;
+
+		~RLBoxSandboxPool()
 		{
-			return stackarr(str, strlen(str) + 1);
+			if(autoTrimThread.joinable())
+			{
+				{
+					std::lock_guard<std::mutex> lock(poolLock);
+					autoTrimStopping = true;
+				}
+				autoTrimStop.notify_all();
+				autoTrimThread.join();
+			}
+
+			std::lock_guard<std::mutex> lock(poolLock);
+			if(idleSandboxes.size() != totalCount)
+			{
+				printf("Sandbox pool destroyed with %zu sandboxes still leased\n", totalCount - idleSandboxes.size());
+				abort();
+			}
+			for(auto& idle : idleSandboxes)
+			{
+				if(idle.sandbox->getCallbackHelperCount() != 0)
+				{
+					printf("Sandbox pool destroyed with callback helpers still referring to its sandboxes\n");
+					abort();
+				}
+			}
+			for(auto& idle : idleSandboxes)
+			{
+				destroyPoolSandbox(idle.sandbox);
+			}
 		}
 
-		template <typename T>
-		inline sandbox_heaparr_helper<T, TSandbox> heaparr(T* arg, size_t size)
+		//Blocks if all maxSize sandboxes are leased
+		Lease checkout()
 		{
-			T* argInSandbox = static_cast<T*>(this->impl_mallocInSandbox(size));
-			// static_cast drops constness
-			memcpy((void*)argInSandbox, (void*)arg, size);
+			std::unique_lock<std::mutex> lock(poolLock);
+			stats.checkouts++;
 
-			sandbox_heaparr_helper<T, TSandbox> ret(this, argInSandbox);
-			return ret;
+			bool waited = false;
+			if(idleSandboxes.empty() && totalCount == maxSize)
+			{
+				waited = true;
+				stats.waits++;
+				auto waitStart = std::chrono::steady_clock::now();
+				//sandboxes evicted in the meantime make room to create one
+				sandboxReturned.wait(lock, [this]() { return !idleSandboxes.empty() || totalCount < maxSize; });
+				auto waitTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - waitStart);
+				stats.totalWaitTime += waitTime;
+				stats.maxWaitTime = std::max(stats.maxWaitTime, waitTime);
+			}
+
+			if(!idleSandboxes.empty())
+			{
+				auto sandbox = idleSandboxes.back().sandbox;
+				idleSandboxes.pop_back();
+				if(waited)
+				{
+					stats.misses++;
+				}
+				else
+				{
+					stats.hits++;
+				}
+				return Lease(this, sandbox);
+			}
+
+			//create outside the lock, but reserve our spot so that we never exceed maxSize
+			totalCount++;
+			stats.misses++;
+			stats.created++;
+			lock.unlock();
+			return Lease(this, createPoolSandbox());
 		}
-		inline sandbox_heaparr_helper<const char, TSandbox> heaparr(const char* str)
+
+		//Destroys sandboxes that have been idle for longer than the idle timeout, and trims the memory of the others
+		void trimIdle()
 		{
-			return heaparr(str, strlen(str) + 1);
+			std::vector<RLBoxSandbox<TSandbox>*> evicted;
+			std::vector<RLBoxSandbox<TSandbox>*> toTrim;
+			{
+				std::lock_guard<std::mutex> lock(poolLock);
+				evicted = evictIdleLocked();
+				for(auto& idle : idleSandboxes)
+				{
+					toTrim.push_back(idle.sandbox);
+				}
+			}
+			if(!evicted.empty())
+			{
+				sandboxReturned.notify_all();
+			}
+			//torn down by the reaper as on checkin, so trimming is not held up by it
+			for(auto evictedSandbox : evicted)
+			{
+				evictedSandbox->destroySandboxAsync(reaper);
+			}
+
+			//only the sandbox being trimmed is taken out of the pool, so the others can still be checked out
+			for(auto sandbox : toTrim)
+			{
+				IdleSandbox idle;
+				{
+					std::lock_guard<std::mutex> lock(poolLock);
+					auto it = std::find_if(idleSandboxes.begin(), idleSandboxes.end(), [sandbox](const IdleSandbox& entry) { return entry.sandbox == sandbox; });
+					if(it == idleSandboxes.end())
+					{
+						//checked out in the meantime
+						continue;
+					}
+					idle = *it;
+					idleSandboxes.erase(it);
+				}
+
+				const size_t trimmedBytes = sandbox->trimMemory();
+
+				{
+					std::lock_guard<std::mutex> lock(poolLock);
+					//sandboxes returned in the meantime are more recently used, so they stay on top
+					auto pos = std::upper_bound(idleSandboxes.begin(), idleSandboxes.end(), idle, [](const IdleSandbox& a, const IdleSandbox& b) { return a.idleSince < b.idleSince; });
+					idleSandboxes.insert(pos, idle);
+					stats.trimmedBytes += trimmedBytes;
+				}
+				sandboxReturned.notify_one();
+			}
 		}
-		inline sandbox_heaparr_helper<char, TSandbox> heaparr(char* str)
+
+		//Calls trimIdle every interval on a background thread, until the pool is destroyed
+		void startAutoTrim(std::chrono::milliseconds interval)
 		{
-			return heaparr(str, strlen(str) + 1);
+			if(autoTrimThread.joinable())
+			{
+				return;
+			}
+			autoTrimThread = std::thread([this, interval]() {
+				std::unique_lock<std::mutex> lock(poolLock);
+				while(!autoTrimStop.wait_for(lock, interval, [this]() { return autoTrimStopping; }))
+				{
+					lock.unlock();
+					trimIdle();
+					lock.lock();
+				}
+			});
 		}
 
-		template <typename TRet, typename... TArgs, RLBOX_ENABLE_IF(sandbox_callback_all_args_are_tainted<TSandbox, TArgs...>::value)>
-		__attribute__ ((noinline))
-		sandbox_callback_helper<TRet(sandbox_removeWrapper_t<TArgs>...), TSandbox> createCallback(TRet(*fnPtr)(RLBoxSandbox<TSandbox>*, TArgs...))
+		RLBoxSandboxPoolStats getStats()
 		{
-			auto stateObject = new sandbox_callback_state<TSandbox>(this, (void*)(uintptr_t)fnPtr);
-			void* callbackReciever = (void*)(uintptr_t) sandbox_callback_receiver<TSandbox, TRet, sandbox_removeWrapper_t<TArgs>...>;
-			// TODO: use std::forward?
-			auto callbackRegisteredAddress = this->template impl_RegisterCallback<TRet, sandbox_removeWrapper_t<TArgs>...>((void*)(uintptr_t)fnPtr, callbackReciever, (void*)stateObject);
-			using fnType = TRet(sandbox_removeWrapper_t<TArgs>...);
-			auto ret = sandbox_callback_helper<fnType, TSandbox>(this, (fnType*)(uintptr_t)callbackRegisteredAddress, stateObject);
+			std::lock_guard<std::mutex> lock(poolLock);
+			RLBoxSandboxPoolStats ret = stats;
+			ret.idleCount = idleSandboxes.size();
+			ret.totalCount = totalCount;
 			return ret;
 		}
 	};
@@ -2045,16 +5043,75 @@ namespace rlbox
 		return *pret;
 	}
 
-	template<typename TSandbox, typename TRHS, typename TVal, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS, TSandbox>, TWrap<TRHS, TSandbox>>)>
-	inline TWrap<TRHS*, TSandbox> memset(RLBoxSandbox<TSandbox>* sandbox, TWrap<TRHS*, TSandbox> ptr, TVal value, TNum num)
+	//The memory functions below check each tainted range once, with isRangeInSandboxMemory, and then call the libc routine
+	//Source operands may be tainted pointers, which are checked, or application pointers
+
+	template<typename TSandbox>
+	inline void sandbox_checkRange(RLBoxSandbox<TSandbox>* sandbox, const void* p, size_t num, const char* name)
 	{
-		auto unum = rlboxUnwrapOrReturnValue(num);
-		tainted<char*, TSandbox> endVal = sandbox_reinterpret_cast<char*>(ptr) + unum;
-		if(unum >= sandbox->getTotalMemory() || !sandbox->isPointerInSandboxMemoryOrNull(endVal.UNSAFE_Unverified()))
+		if(!sandbox->isRangeInSandboxMemory(p, num))
 		{
-			printf("memset is out of bounds\n");
+			printf("%s is out of bounds\n", name);
 			abort();
 		}
+	}
+
+	template<typename TSandbox, typename TRHS, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS*, TSandbox>, TWrap<TRHS*, TSandbox>>)>
+	inline const void* sandbox_checkedSource(RLBoxSandbox<TSandbox>* sandbox, const TWrap<TRHS*, TSandbox>& src, size_t num, const char* name)
+	{
+		const void* p = (const void*) src.UNSAFE_Unverified();
+		sandbox_checkRange(sandbox, p, num, name);
+		return p;
+	}
+
+	template<typename TSandbox, typename T>
+	inline const void* sandbox_checkedSource(RLBoxSandbox<TSandbox>* sandbox, T* src, size_t num, const char* name)
+	{
+		return (const void*) src;
+	}
+
+	//Copies of at least this many bytes out of the sandbox bypass the cache
+	const size_t nonTemporalCopyThreshold = 4 * 1024 * 1024;
+
+	//Copies with non-temporal stores, so that a large copy does not evict the rest of the application's working set
+	inline void memcpyNonTemporal(void* dest, const void* src, size_t num)
+	{
+		#if defined(__SSE2__)
+			char* d = (char*) dest;
+			const char* s = (const char*) src;
+			//streaming stores need an aligned destination
+			size_t head = (16 - ((uintptr_t) d & 15)) & 15;
+			if(head > num)
+			{
+				head = num;
+			}
+			std::memcpy(d, s, head);
+			d += head;
+			s += head;
+			num -= head;
+			for(; num >= 64; num -= 64, d += 64, s += 64)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i*) s);
+				__m128i b = _mm_loadu_si128((const __m128i*) (s + 16));
+				__m128i c = _mm_loadu_si128((const __m128i*) (s + 32));
+				__m128i e = _mm_loadu_si128((const __m128i*) (s + 48));
+				_mm_stream_si128((__m128i*) d, a);
+				_mm_stream_si128((__m128i*) (d + 16), b);
+				_mm_stream_si128((__m128i*) (d + 32), c);
+				_mm_stream_si128((__m128i*) (d + 48), e);
+			}
+			_mm_sfence();
+			std::memcpy(d, s, num);
+		#else
+			std::memcpy(dest, src, num);
+		#endif
+	}
+
+	template<typename TSandbox, typename TRHS, typename TVal, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS, TSandbox>, TWrap<TRHS, TSandbox>>)>
+	inline TWrap<TRHS*, TSandbox> memset(RLBoxSandbox<TSandbox>* sandbox, TWrap<TRHS*, TSandbox> ptr, TVal value, TNum num)
+	{
+		size_t unum = rlboxUnwrapOrReturnValue(num);
+		sandbox_checkRange(sandbox, (const void*) ptr.UNSAFE_Unverified(), unum, "memset");
 		std::memset((void*) ptr.UNSAFE_Unverified(), rlboxUnwrapOrReturnValue(value), unum);
 		return ptr;
 	}
@@ -2062,19 +5119,84 @@ namespace rlbox
 	template<typename TSandbox, typename TRHS, typename TLHS, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS, TSandbox>, TWrap<TRHS, TSandbox>>)>
 	inline TWrap<TRHS*, TSandbox> memcpy(RLBoxSandbox<TSandbox>* sandbox, TWrap<TRHS*, TSandbox> dest, TLHS src, TNum num)
 	{
-		auto unum = rlboxUnwrapOrReturnValue(num);
-		tainted<char*, TSandbox> endVal = sandbox_reinterpret_cast<char*>(dest) + unum;
-		if(unum >= sandbox->getTotalMemory() || !sandbox->isPointerInSandboxMemoryOrNull(endVal.UNSAFE_Unverified()))
+		size_t unum = rlboxUnwrapOrReturnValue(num);
+		sandbox_checkRange(sandbox, (const void*) dest.UNSAFE_Unverified(), unum, "memcpy");
+		std::memcpy((void*) dest.UNSAFE_Unverified(), sandbox_checkedSource(sandbox, src, unum, "memcpy source"), unum);
+		return dest;
+	}
+
+	//Copies num bytes out of the sandbox into application memory and passes the copy to verifyFunction
+	//On failure the copy is cleared. dest must not be in sandbox memory, where the sandbox could change the copy
+	//while it is verified
+	template<typename TSandbox, typename TDest, typename TRHS, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS*, TSandbox>, TWrap<TRHS*, TSandbox>>)>
+	inline bool memcpy(RLBoxSandbox<TSandbox>* sandbox, TDest* dest, const TWrap<TRHS*, TSandbox>& src, TNum num, std::function<RLBox_Verify_Status(my_decay_t<TDest>*, size_t)> verifyFunction)
+	{
+		size_t unum = rlboxUnwrapOrReturnValue(num);
+		if(unum != 0 && (dest == nullptr || !sandbox->isPointerInAppMemoryOrNull((const void*) dest) ||
+			!sandbox->isPointerInAppMemoryOrNull(((const char*) dest) + unum - 1)))
 		{
-			printf("memcpy is out of bounds\n");
+			printf("memcpy destination is not in application memory\n");
 			abort();
 		}
-		std::memcpy((void*) dest.UNSAFE_Unverified(), rlboxUnwrapOrReturnValue(src), unum);
+		const void* p = sandbox_checkedSource(sandbox, src, unum, "memcpy source");
+		if(unum >= nonTemporalCopyThreshold)
+		{
+			memcpyNonTemporal((void*) dest, p, unum);
+		}
+		else
+		{
+			std::memcpy((void*) dest, p, unum);
+		}
+		if(verifyFunction(dest, unum) == RLBox_Verify_Status::SAFE)
+		{
+			return true;
+		}
+		std::memset((void*) dest, 0, unum);
+		return false;
+	}
+
+	template<typename TSandbox, typename TRHS, typename TLHS, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS, TSandbox>, TWrap<TRHS, TSandbox>>)>
+	inline TWrap<TRHS*, TSandbox> memmove(RLBoxSandbox<TSandbox>* sandbox, TWrap<TRHS*, TSandbox> dest, TLHS src, TNum num)
+	{
+		size_t unum = rlboxUnwrapOrReturnValue(num);
+		sandbox_checkRange(sandbox, (const void*) dest.UNSAFE_Unverified(), unum, "memmove");
+		std::memmove((void*) dest.UNSAFE_Unverified(), sandbox_checkedSource(sandbox, src, unum, "memmove source"), unum);
+		return dest;
+	}
+
+	//The result depends on sandbox memory, so it is tainted
+	template<typename TSandbox, typename TRHS, typename TLHS, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS, TSandbox>, TWrap<TRHS, TSandbox>>)>
+	inline tainted<int, TSandbox> memcmp(RLBoxSandbox<TSandbox>* sandbox, TWrap<TRHS*, TSandbox> lhs, TLHS rhs, TNum num)
+	{
+		size_t unum = rlboxUnwrapOrReturnValue(num);
+		sandbox_checkRange(sandbox, (const void*) lhs.UNSAFE_Unverified(), unum, "memcmp");
+		tainted<int, TSandbox> ret = std::memcmp((const void*) lhs.UNSAFE_Unverified(), sandbox_checkedSource(sandbox, rhs, unum, "memcmp source"), unum);
+		return ret;
+	}
+
+	template<typename TSandbox, typename TRHS, typename TVal, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS, TSandbox>, TWrap<TRHS, TSandbox>>)>
+	inline tainted<TRHS*, TSandbox> memchr(RLBoxSandbox<TSandbox>* sandbox, TWrap<TRHS*, TSandbox> ptr, TVal value, TNum num)
+	{
+		size_t unum = rlboxUnwrapOrReturnValue(num);
+		sandbox_checkRange(sandbox, (const void*) ptr.UNSAFE_Unverified(), unum, "memchr");
+		TRHS* found = (TRHS*) std::memchr((const void*) ptr.UNSAFE_Unverified(), rlboxUnwrapOrReturnValue(value), unum);
+		return *((tainted<TRHS*, TSandbox>*) &found);
+	}
+
+	//As with strncpy, dest is padded with nulls up to num and is not null terminated if src is num bytes or longer
+	//A tainted src must have num bytes in sandbox memory
+	template<typename TSandbox, typename TRHS, typename TLHS, typename TNum, template <typename, typename> class TWrap, RLBOX_ENABLE_IF(my_is_base_of_v<tainted_base<TRHS, TSandbox>, TWrap<TRHS, TSandbox>> && sizeof(TRHS) == 1)>
+	inline TWrap<TRHS*, TSandbox> strncpy(RLBoxSandbox<TSandbox>* sandbox, TWrap<TRHS*, TSandbox> dest, TLHS src, TNum num)
+	{
+		size_t unum = rlboxUnwrapOrReturnValue(num);
+		sandbox_checkRange(sandbox, (const void*) dest.UNSAFE_Unverified(), unum, "strncpy");
+		std::strncpy((char*) dest.UNSAFE_Unverified(), (const char*) sandbox_checkedSource(sandbox, src, unum, "strncpy source"), unum);
 		return dest;
 	}
 
 	#define sandbox_invoke(sandbox, fnName, ...) sandbox->invokeWithFunctionPointer((decltype(fnName)*)sandbox->getFunctionPointerFromCache(#fnName, false), ##__VA_ARGS__)
 	#define sandbox_invoke_return_app_ptr(sandbox, fnName, ...) sandbox->invokeWithFunctionPointerReturnAppPtr((decltype(fnName)*)sandbox->getFunctionPointerFromCache(#fnName, false), ##__VA_ARGS__)
+	#define sandbox_invoke_into(sandbox, dest, fnName, ...) sandbox->invokeWithFunctionPointerInto(dest, (decltype(fnName)*)sandbox->getFunctionPointerFromCache(#fnName, false), ##__VA_ARGS__)
 	#define sandbox_invoke_with_fnptr(sandbox, fnPtr, ...) sandbox->invokeWithFunctionPointer(fnPtr, ##__VA_ARGS__)
 	#define sandbox_function(sandbox, fnName) sandbox_convertToUnverified<decltype(fnName)*>(sandbox, (decltype(fnName)*) sandbox->getFunctionPointerFromCache(#fnName, true))
 	#undef RLUNUSED
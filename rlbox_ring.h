@@ -0,0 +1,148 @@
+#pragma once
+
+//Single producer, single consumer byte ring shared by an application and a sandboxed library
+//The ring lives in sandbox memory and is created by the application with sandbox_ring_buffer in RLBox_RingBuffer.h
+//This header is the library's side of it, and only uses C so that it builds with any sandbox toolchain
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    //Operations passed to the signal callback
+    //RLBOX_RING_WAIT blocks until the other side made progress, RLBOX_RING_NOTIFY wakes the other side if it waits
+    #define RLBOX_RING_WAIT 0
+    #define RLBOX_RING_NOTIFY 1
+
+    //Indices run freely and wrap at 2^32, the position in data is the index modulo capacity
+    //Each side's fields are on their own cache line. The data follows the struct
+    struct rlbox_ring
+    {
+        //a power of 2, set by the application
+        uint32_t capacity;
+        //set by the producer when it is done, or by the consumer when it stops reading
+        uint32_t closed;
+        uint32_t padding0[14];
+        //written by the consumer
+        uint32_t head;
+        uint32_t consumerWaiting;
+        uint32_t padding1[14];
+        //written by the producer
+        uint32_t tail;
+        uint32_t producerWaiting;
+        uint32_t padding2[14];
+    };
+
+    typedef void (*RingSignalCallback)(struct rlbox_ring* ring, unsigned op);
+
+    static inline unsigned char* rlbox_ring_data(struct rlbox_ring* ring)
+    {
+        return (unsigned char*) (ring + 1);
+    }
+
+    static inline int rlbox_ring_is_closed(struct rlbox_ring* ring)
+    {
+        return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) != 0;
+    }
+
+    //Copies up to size bytes into the ring without blocking, and returns the number of bytes copied
+    static inline uint32_t rlbox_ring_write(struct rlbox_ring* ring, const void* src, uint32_t size, RingSignalCallback signal)
+    {
+        const uint32_t capacity = ring->capacity;
+        const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        const uint32_t tail = ring->tail;
+        uint32_t count = capacity - (tail - head);
+        if(count > size) { count = size; }
+        if(count == 0) { return 0; }
+
+        const uint32_t pos = tail & (capacity - 1);
+        const uint32_t first = count < capacity - pos? count : capacity - pos;
+        memcpy(rlbox_ring_data(ring) + pos, src, first);
+        memcpy(rlbox_ring_data(ring), ((const unsigned char*) src) + first, count - first);
+        __atomic_store_n(&ring->tail, tail + count, __ATOMIC_SEQ_CST);
+        if(__atomic_exchange_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST))
+        {
+            signal(ring, RLBOX_RING_NOTIFY);
+        }
+        return count;
+    }
+
+    //Copies up to size bytes out of the ring without blocking, and returns the number of bytes copied
+    static inline uint32_t rlbox_ring_read(struct rlbox_ring* ring, void* dest, uint32_t size, RingSignalCallback signal)
+    {
+        const uint32_t capacity = ring->capacity;
+        const uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        const uint32_t head = ring->head;
+        uint32_t count = tail - head;
+        if(count > size) { count = size; }
+        if(count == 0) { return 0; }
+
+        const uint32_t pos = head & (capacity - 1);
+        const uint32_t first = count < capacity - pos? count : capacity - pos;
+        memcpy(dest, rlbox_ring_data(ring) + pos, first);
+        memcpy(((unsigned char*) dest) + first, rlbox_ring_data(ring), count - first);
+        __atomic_store_n(&ring->head, head + count, __ATOMIC_SEQ_CST);
+        if(__atomic_exchange_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST))
+        {
+            signal(ring, RLBOX_RING_NOTIFY);
+        }
+        return count;
+    }
+
+    //Writes all of src, waiting for space as needed. Returns 0 if the consumer closed the ring first
+    static inline int rlbox_ring_write_all(struct rlbox_ring* ring, const void* src, uint32_t size, RingSignalCallback signal)
+    {
+        const unsigned char* p = (const unsigned char*) src;
+        while(size > 0)
+        {
+            if(rlbox_ring_is_closed(ring)) { return 0; }
+            uint32_t written = rlbox_ring_write(ring, p, size, signal);
+            if(written == 0)
+            {
+                //the flag is set before checking again, so the consumer either sees it or we see its read
+                __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_SEQ_CST);
+                if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->capacity &&
+                    !rlbox_ring_is_closed(ring))
+                {
+                    signal(ring, RLBOX_RING_WAIT);
+                }
+                __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_SEQ_CST);
+            }
+            p += written;
+            size -= written;
+        }
+        return 1;
+    }
+
+    //Reads at least one byte, waiting for data as needed. Returns 0 once the ring is closed and empty
+    static inline uint32_t rlbox_ring_read_some(struct rlbox_ring* ring, void* dest, uint32_t size, RingSignalCallback signal)
+    {
+        for(;;)
+        {
+            uint32_t count = rlbox_ring_read(ring, dest, size, signal);
+            if(count != 0 || size == 0) { return count; }
+            if(rlbox_ring_is_closed(ring))
+            {
+                //data written before the close is still read
+                return rlbox_ring_read(ring, dest, size, signal);
+            }
+            __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == ring->head && !rlbox_ring_is_closed(ring))
+            {
+                signal(ring, RLBOX_RING_WAIT);
+            }
+            __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    static inline void rlbox_ring_close(struct rlbox_ring* ring, RingSignalCallback signal)
+    {
+        __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+        signal(ring, RLBOX_RING_NOTIFY);
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,9 +3,12 @@
 #include <dlfcn.h>
 #include <iostream>
 #include <limits>
+#include <memory>
+#include <sys/mman.h>
 #include "libtest.h"
 #include "RLBox_MyApp.h"
 #include "RLBox_DynLib.h"
+#include "RLBox_SandboxMemory.h"
 #ifndef NO_PROCESS
 	#define USE_RLBOXTEST
 	#include "RLBox_Process.h"
@@ -18,6 +21,7 @@
 #endif
 #include "testlib_structs_for_cpp_api.h"
 #include "rlbox.h"
+#include "RLBox_RingBuffer.h"
 
 using namespace rlbox;
 
@@ -197,6 +201,13 @@ public:
 		ENSURE(ret2.UNSAFE_Unverified() == 42);
 	}
 
+	void testInvokeStatus()
+	{
+		auto ret = sandbox_invoke(sandbox, simpleAddTest, 2, 3);
+		ENSURE(sandbox->getLastInvokeStatus() == RLBox_Invoke_Status::SUCCESS);
+		ENSURE(ret.UNSAFE_Unverified() == 5);
+	}
+
 	void test64BitReturns()
 	{
 		auto ret2 = sandbox_invoke(sandbox, simpleLongAddTest, std::numeric_limits<std::uint32_t>::max(), 20);
@@ -276,6 +287,11 @@ public:
 		return ret;
 	}
 
+	static int exampleCallbackCached(RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned, TSandbox> a, tainted<const char*, TSandbox> b, tainted<unsigned[1], TSandbox> c)
+	{
+		return a.copyAndVerify([](unsigned val){ return val > 0 && val < 100? val : -1; }) + 1;
+	}
+
 	static int exampleCallback2(RLBoxSandbox<TSandbox>* sandbox, 
 		tainted<unsigned long, TSandbox> val1,
 		tainted<unsigned long, TSandbox> val2,
@@ -314,6 +330,31 @@ public:
 		}
 	}
 
+	void testCallbackCache()
+	{
+		//callbacks for the same function share a registration
+		{
+			auto cb = sandbox->createCallback(exampleCallback);
+			ENSURE(cb.UNSAFE_Unverified() == registeredCallback.UNSAFE_Unverified());
+		}
+		auto result = sandbox_invoke(sandbox, simpleCallbackTest, (unsigned) 4, sandbox->stackarr("Hello"), registeredCallback)
+			.copyAndVerify([](int val){ return val > 0 && val < 100? val : -1; });
+		ENSURE(result == 10);
+
+		//idle registrations are kept up to the limit
+		sandbox->setIdleCallbackLimit(1);
+		auto cb = sandbox->createCallback(exampleCallbackCached);
+		auto cbAddress = cb.UNSAFE_Unverified();
+		cb.unregister();
+		cb = sandbox->createCallback(exampleCallbackCached);
+		ENSURE(cb.UNSAFE_Unverified() == cbAddress);
+		result = sandbox_invoke(sandbox, simpleCallbackTest, (unsigned) 4, sandbox->stackarr("Hello"), cb)
+			.copyAndVerify([](int val){ return val > 0 && val < 100? val : -1; });
+		ENSURE(result == 6);
+		cb.unregister();
+		sandbox->setIdleCallbackLimit(0);
+	}
+
 	void testInternalCallback()
 	{
 		auto fnPtr = sandbox_function(sandbox, internalCallback);
@@ -432,6 +473,70 @@ public:
 		ENSURE(val == 17);
 	}
 
+	void testStructuresInto(bool ignoreGlobalStringsInLib)
+	{
+		auto verifyString = [](const char* val) { return strlen(val) < 100? RLBox_Verify_Status::SAFE : RLBox_Verify_Status::UNSAFE; };
+
+		tainted<testStruct, TSandbox> resultT;
+		sandbox_invoke_into(sandbox, resultT, simpleTestStructVal);
+		ENSURE(resultT.fieldLong.copyAndVerify([](unsigned long val) { return val; }) == 7);
+		ENSURE(resultT.fieldBool.copyAndVerify([](unsigned int val) { return val; }) == 1);
+		if(!ignoreGlobalStringsInLib)
+		{
+			auto str = resultT.fieldString.copyAndVerifyString(sandbox, verifyString, nullptr);
+			ENSURE(strcmp(str, "Hello") == 0);
+			delete[] str;
+		}
+
+		//the result stays in sandbox memory
+		tainted<testStruct*, TSandbox> pResult = sandbox->template mallocInSandbox<testStruct>();
+		sandbox_invoke_into(sandbox, pResult, simpleTestStructVal);
+		ENSURE(pResult->fieldLong.copyAndVerify([](unsigned long val) { return val; }) == 7);
+		char fixedArr[8];
+		pResult->fieldFixedArr.copyAndVerify(fixedArr, sizeof(fixedArr), [](char* arr, size_t size){ UNUSED(arr); UNUSED(size); return RLBox_Verify_Status::SAFE; });
+		ENSURE(strcmp(fixedArr, "Bye") == 0);
+		if(!ignoreGlobalStringsInLib)
+		{
+			auto str = pResult->fieldString.copyAndVerifyString(sandbox, verifyString, nullptr);
+			ENSURE(strcmp(str, "Hello") == 0);
+			delete[] str;
+		}
+		sandbox->freeInSandbox(pResult);
+	}
+
+	void testStructView(bool ignoreGlobalStringsInLib)
+	{
+		auto resultT = sandbox_invoke(sandbox, simpleTestStructPtr);
+		tainted_struct_view<testStruct, TSandbox> view(resultT);
+
+		int verifyCalls = 0;
+		auto verifyLong = [&verifyCalls](unsigned long val) { verifyCalls++; return val; };
+		ENSURE(view.fieldLong.copyAndVerify(verifyLong) == 7);
+		ENSURE(view.fieldBool.copyAndVerify([](unsigned int val) { return val == 1? RLBox_Verify_Status::SAFE : RLBox_Verify_Status::UNSAFE; }, 0) == 1);
+
+		//later reads see the copied value, even if the sandbox changes the field, and run their own verifier
+		resultT->fieldLong = 17;
+		ENSURE(view.fieldLong.copyAndVerify(verifyLong) == 7);
+		ENSURE(verifyCalls == 2);
+		ENSURE(view.fieldLong.copyAndVerify([](unsigned long val) { return val > 10? val : 0; }) == 0);
+
+		//fields read for the first time see the current value
+		resultT->fieldBool = 0;
+		tainted_struct_view<testStruct, TSandbox> view2(*resultT);
+		ENSURE(view2.fieldLong.UNSAFE_Unverified() == 17);
+		ENSURE(view2.fieldBool.copyAndVerify([](unsigned int val) { return val; }) == 0);
+
+		char fixedArr[8];
+		view.fieldFixedArr.get().copyAndVerify(fixedArr, sizeof(fixedArr), [](char* arr, size_t size){ UNUSED(arr); UNUSED(size); return RLBox_Verify_Status::SAFE; });
+		ENSURE(strcmp(fixedArr, "Bye") == 0);
+		if(!ignoreGlobalStringsInLib)
+		{
+			auto str = view.fieldString.get().copyAndVerifyString(sandbox, [](const char* val) { return strlen(val) < 100? RLBox_Verify_Status::SAFE : RLBox_Verify_Status::UNSAFE; }, nullptr);
+			ENSURE(strcmp(str, "Hello") == 0);
+			delete[] str;
+		}
+	}
+
 	void testStructurePointers(bool ignoreGlobalStringsInLib)
 	{
 		auto resultT = sandbox_invoke(sandbox, simpleTestStructPtr);
@@ -470,6 +575,87 @@ public:
 		ENSURE(result == 45);
 	}
 
+	void testCapturingCallback()
+	{
+		int calls = 0;
+		const int offset = 20;
+		auto cb = sandbox->createCallback([&calls, offset](RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned, TSandbox> a, tainted<const char*, TSandbox> b, tainted<unsigned[1], TSandbox> c) {
+			calls++;
+			return (int) a.copyAndVerify([](unsigned val){ return val < 100? val : 0; }) + offset;
+		});
+		auto result = sandbox_invoke(sandbox, simpleCallbackTest, (unsigned) 4, sandbox->stackarr("Hello"), cb)
+			.copyAndVerify([](int val){ return val; });
+		ENSURE(result == 25);
+		ENSURE(calls == 1);
+
+		//context too large to store inline, which is freed with the callback
+		auto context = std::make_shared<int>(7);
+		char padding[64] = { 0 };
+		auto cb2 = sandbox->createCallback([context, padding](RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned, TSandbox> a, tainted<const char*, TSandbox> b, tainted<unsigned[1], TSandbox> c) mutable {
+			padding[0]++;
+			return *context + padding[0];
+		});
+		ENSURE(context.use_count() == 2);
+		result = sandbox_invoke(sandbox, simpleCallbackTest, (unsigned) 4, sandbox->stackarr("Hello"), cb2)
+			.copyAndVerify([](int val){ return val; });
+		ENSURE(result == 8);
+		cb2.unregister();
+		cb.unregister();
+		ENSURE(context.use_count() == 1);
+
+		//reuses the storage of the states freed above
+		auto cb3 = sandbox->createCallback([offset](RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned, TSandbox> a, tainted<const char*, TSandbox> b, tainted<unsigned[1], TSandbox> c) {
+			return offset;
+		});
+		result = sandbox_invoke(sandbox, simpleCallbackTest, (unsigned) 4, sandbox->stackarr("Hello"), cb3)
+			.copyAndVerify([](int val){ return val; });
+		ENSURE(result == 20);
+
+		//assigning over a helper releases the callback it held
+		const size_t helpers = sandbox->getCallbackHelperCount();
+		cb3 = sandbox->createCallback([offset](RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned, TSandbox> a, tainted<const char*, TSandbox> b, tainted<unsigned[1], TSandbox> c) {
+			return offset + 1;
+		});
+		ENSURE(sandbox->getCallbackHelperCount() == helpers);
+		cb3.unregister();
+		ENSURE(sandbox->getCallbackHelperCount() == helpers - 1);
+	}
+
+	static int exhaustionCallback(RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned, TSandbox> a, tainted<const char*, TSandbox> b, tainted<unsigned[1], TSandbox> c)
+	{
+		return 0;
+	}
+
+	void testCallbackSlotExhaustion()
+	{
+		const size_t helpers = sandbox->getCallbackHelperCount();
+		std::vector<sandbox_callback_helper<int(unsigned, const char*, unsigned*), TSandbox>> callbacks;
+		bool exhausted = false;
+		//backends with a fallback map for their slots never run out
+		for(int i = 0; i < 256 && !exhausted; i++)
+		{
+			callbacks.push_back(sandbox->createCallback([i](RLBoxSandbox<TSandbox>* sandbox, tainted<unsigned, TSandbox> a, tainted<const char*, TSandbox> b, tainted<unsigned[1], TSandbox> c) {
+				return i;
+			}));
+			exhausted = callbacks.back().UNSAFE_Unverified() == nullptr;
+		}
+		if(exhausted)
+		{
+			ENSURE(sandbox->getCallbackHelperCount() == helpers + callbacks.size() - 1);
+			//a failed registration is neither counted nor cached
+			auto failed = sandbox->createCallback(exhaustionCallback);
+			ENSURE(failed.UNSAFE_Unverified() == nullptr);
+			ENSURE(sandbox->getCallbackHelperCount() == helpers + callbacks.size() - 1);
+			callbacks.clear();
+			ENSURE(sandbox->getCallbackHelperCount() == helpers);
+			auto registered = sandbox->createCallback(exhaustionCallback);
+			ENSURE(registered.UNSAFE_Unverified() != nullptr);
+			ENSURE(sandbox->getCallbackHelperCount() == helpers + 1);
+		}
+		callbacks.clear();
+		ENSURE(sandbox->getCallbackHelperCount() == helpers);
+	}
+
 	void testAppPtrFunctionReturn()
 	{
 		#if defined(_M_X64) || defined(__x86_64__)
@@ -611,6 +797,231 @@ public:
 		sandbox->freeInSandbox(dest);
 	}
 
+	void testScatterGather()
+	{
+		const char input[] = "Hello";
+		int counts[3] = { 1, 2, 3 };
+		char output[8] = "";
+		//writable, but only copied in
+		char scratch[4] = "abc";
+		auto before = sandbox->getMemoryStats();
+		{
+			auto bufs = sandbox->scatterarr(sandbox_iov(input, sizeof(input)), sandbox_iov_inout(counts, sizeof(counts)), sandbox_iov_out(output, sizeof(output)), sandbox_iov(scratch, sizeof(scratch)));
+			ENSURE(sandbox->getMemoryStats().allocationCount == before.allocationCount + 1);
+
+			auto len = sandbox_invoke(sandbox, simpleStrLenTest, bufs.template get<0>()).copyAndVerify([](size_t val) { return val; });
+			ENSURE(len == 5);
+			sandbox_invoke(sandbox, simplePointerWrite, bufs.template get<1>() + 1, 20);
+
+			auto views = bufs.views();
+			ENSURE(((uintptr_t) std::get<0>(views).UNSAFE_Unverified()) % 16 == 0);
+			ENSURE(((uintptr_t) std::get<2>(views).UNSAFE_Unverified()) % 16 == 0);
+			memcpy(sandbox, std::get<2>(views), "Bye", 4);
+			memcpy(sandbox, std::get<3>(views), "xyz", 4);
+
+			std::vector<size_t> verified;
+			ENSURE(bufs.gather([&verified](size_t index, void* data, size_t size) {
+				verified.push_back(index);
+				return RLBox_Verify_Status::SAFE;
+			}));
+			ENSURE(verified.size() == 2 && verified[0] == 1 && verified[1] == 2);
+			ENSURE(counts[0] == 1 && counts[1] == 20 && counts[2] == 3);
+			ENSURE(strcmp(output, "Bye") == 0);
+			ENSURE(strcmp(scratch, "abc") == 0);
+
+			//a rejected buffer is cleared, the others are still copied
+			ENSURE(!bufs.gather([](size_t index, void* data, size_t size) {
+				return index == 2? RLBox_Verify_Status::UNSAFE : RLBox_Verify_Status::SAFE;
+			}));
+			ENSURE(counts[1] == 20 && output[0] == 0);
+		}
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+	}
+
+	void testMapFile()
+	{
+		FILE* file = tmpfile();
+		ENSURE(file != nullptr);
+		std::vector<char> contents(10000, 'a');
+		strcpy(contents.data() + 5000, "Hello");
+		ENSURE(fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+		fflush(file);
+		const int fd = fileno(file);
+
+		auto before = sandbox->getMemoryStats();
+		{
+			//starts partway into a page
+			auto mapped = sandbox->mapFileInSandbox(fd, 5000, 6);
+			ENSURE(mapped.get() != nullptr && mapped.size() == 6);
+			auto len = sandbox_invoke(sandbox, simpleStrLenTest, mapped).copyAndVerify([](size_t val) { return val; });
+			ENSURE(len == 5);
+			ENSURE(sandbox->isRangeInSandboxMemory(mapped.UNSAFE_Unverified(), mapped.size()));
+
+			auto whole = sandbox->mapFileInSandbox(fd, 0, contents.size(), false /* readOnly */);
+			ENSURE(memcmp(whole.UNSAFE_Unverified(), contents.data(), contents.size()) == 0);
+			//private mapping, so the file is not changed
+			((char*) whole.UNSAFE_Unverified())[0] = 'b';
+			char first = 0;
+			ENSURE(pread(fd, &first, 1, 0) == 1 && first == 'a');
+		}
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+
+		ENSURE(sandbox->mapFileInSandbox(fd, 9000, 2000).get() == nullptr);
+		ENSURE(sandbox->mapFileInSandbox(fd, 0, 0).get() == nullptr);
+		ENSURE(sandbox->mapFileInSandbox(-1, 0, 16).get() == nullptr);
+		fclose(file);
+	}
+
+	void testSharedBlob()
+	{
+		const char table[] = "Shared table";
+		tainted<const char*, TSandbox> mapped;
+		{
+			RLBoxSharedBlob blob(table, sizeof(table));
+			ENSURE(blob.isValid() && blob.size() == sizeof(table));
+			//sealed, so it can't be changed under the sandboxes using it
+			ENSURE(pwrite(blob.getFd(), "x", 1, 0) == -1);
+
+			mapped = sandbox->getSharedBlob(blob);
+			ENSURE(mapped != nullptr);
+			ENSURE(sandbox->getSharedBlob(blob).UNSAFE_Unverified() == mapped.UNSAFE_Unverified());
+			ENSURE(strcmp(mapped.UNSAFE_Unverified(), table) == 0);
+			auto len = sandbox_invoke(sandbox, simpleStrLenTest, mapped).copyAndVerify([](size_t val) { return val; });
+			ENSURE(len == strlen(table));
+		}
+		//the mapping outlives the blob
+		ENSURE(strcmp(mapped.UNSAFE_Unverified(), table) == 0);
+
+		RLBoxSharedBlob other(table, 4);
+		auto before = sandbox->getMemoryStats();
+		ENSURE(sandbox->getSharedBlob(other) != nullptr);
+		ENSURE(sandbox->unmapSharedBlob(other));
+		ENSURE(!sandbox->unmapSharedBlob(other));
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+
+		//threads mapping the same blob at once get one mapping, and the extra ones are released
+		std::vector<std::thread> threads;
+		std::vector<const char*> addresses(4);
+		for(size_t i = 0; i < addresses.size(); i++)
+		{
+			threads.emplace_back([&, i]() { addresses[i] = sandbox->getSharedBlob(other).UNSAFE_Unverified(); });
+		}
+		for(auto& thread : threads)
+		{
+			thread.join();
+		}
+		for(auto address : addresses)
+		{
+			ENSURE(address != nullptr && address == addresses[0]);
+		}
+		ENSURE(sandbox->unmapSharedBlob(other));
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+
+		RLBoxSharedBlob empty(table, 0);
+		ENSURE(!empty.isValid() && sandbox->getSharedBlob(empty) == nullptr);
+	}
+
+	void testRingBuffer()
+	{
+		//small rings, so that both sides wrap around and wait for each other
+		sandbox_ring_buffer<TSandbox> in(sandbox, RLBox_Ring_Direction::TO_SANDBOX, 64);
+		sandbox_ring_buffer<TSandbox> out(sandbox, RLBox_Ring_Direction::FROM_SANDBOX, 64);
+		auto signal = sandbox_ring_buffer<TSandbox>::createSignalCallback(sandbox);
+
+		std::string input;
+		for(int i = 0; i < 5000; i++)
+		{
+			input += (char) ('a' + i % 26);
+		}
+		unsigned long total = 0;
+		std::thread library([&]() {
+			total = sandbox_invoke(sandbox, ringBufferUppercase, in.get(), out.get(), signal).UNSAFE_Unverified();
+		});
+		std::thread producer([&]() {
+			ENSURE(in.writeAll(input.data(), input.size()));
+			in.close();
+		});
+
+		std::string output;
+		char buf[100];
+		size_t count;
+		while((count = out.readSome(buf, sizeof(buf))) != 0)
+		{
+			output.append(buf, count);
+		}
+		producer.join();
+		library.join();
+		ENSURE(total == input.size() && output.size() == input.size());
+		for(size_t i = 0; i < output.size(); i++)
+		{
+			ENSURE(output[i] == input[i] - 'a' + 'A');
+		}
+		ENSURE(!in.isCorrupted() && !out.isCorrupted());
+
+		//an index moved past the data by the library is caught
+		sandbox_ring_buffer<TSandbox> bad(sandbox, RLBox_Ring_Direction::FROM_SANDBOX, 64);
+		bad.get().UNSAFE_Unverified()->tail = 1000;
+		ENSURE(bad.read(buf, sizeof(buf)) == 0 && bad.isCorrupted());
+		ENSURE(bad.readSome(buf, sizeof(buf)) == 0);
+
+		//a ring that could not be allocated transfers nothing
+		sandbox->setMemoryQuota(0, sandbox->getMemoryStats().bytesAllocated + 64);
+		sandbox_ring_buffer<TSandbox> unallocated(sandbox, RLBox_Ring_Direction::TO_SANDBOX, 1024);
+		sandbox->setMemoryQuota(0, 0);
+		ENSURE(unallocated.get().UNSAFE_Unverified() == nullptr);
+		ENSURE(unallocated.write("ab", 2) == 0 && !unallocated.writeAll("ab", 2));
+		unallocated.close();
+	}
+
+	void testMemoryFunctions()
+	{
+		auto buf = sandbox->template mallocInSandbox<char>(16);
+		auto str = sandbox->template mallocInSandbox<char>(16);
+		memcpy(sandbox, buf, "abcdefghijklmno", 16);
+
+		//overlapping move
+		memmove(sandbox, buf + 2, buf, 6);
+		ENSURE(strncmp(buf.UNSAFE_Unverified(), "ababcdefijklmno", 16) == 0);
+
+		ENSURE(memcmp(sandbox, buf, "abab", 4).UNSAFE_Unverified() == 0);
+		ENSURE(memcmp(sandbox, buf, "abac", 4).UNSAFE_Unverified() < 0);
+		memcpy(sandbox, str, buf, 16);
+		ENSURE(memcmp(sandbox, buf, str, 16).UNSAFE_Unverified() == 0);
+
+		auto found = memchr(sandbox, buf, 'f', 16);
+		ENSURE(found.UNSAFE_Unverified() == buf.UNSAFE_Unverified() + 7);
+		ENSURE(memchr(sandbox, buf, 'z', 16) == nullptr);
+
+		strncpy(sandbox, str, "Hi", 16);
+		ENSURE(strcmp(str.UNSAFE_Unverified(), "Hi") == 0 && str.UNSAFE_Unverified()[15] == 0);
+		strncpy(sandbox, str, buf, 4);
+		ENSURE(strncmp(str.UNSAFE_Unverified(), "abab", 4) == 0);
+
+		//copies out to the application, below and above the size where non-temporal stores are used
+		char out[16];
+		auto verifyOut = [](char* val, size_t size) { return val[size - 1] == 0? RLBox_Verify_Status::SAFE : RLBox_Verify_Status::UNSAFE; };
+		ENSURE(memcpy(sandbox, out, buf, 16, verifyOut));
+		ENSURE(strncmp(out, "ababcdefijklmno", 16) == 0);
+		//a copy the verifier rejects is cleared
+		ENSURE(!memcpy(sandbox, out, buf, 8, verifyOut));
+		ENSURE(out[0] == 0 && out[7] == 0);
+
+		const size_t largeSize = nonTemporalCopyThreshold + 37;
+		auto large = sandbox->template mallocInSandbox<char>(largeSize);
+		for(size_t i = 0; i < largeSize; i += 4096)
+		{
+			*(large.UNSAFE_Unverified() + i) = (char) (i / 4096);
+		}
+		*(large.UNSAFE_Unverified() + largeSize - 1) = 'x';
+		std::vector<char> largeOut(largeSize + 1);
+		ENSURE(memcpy(sandbox, largeOut.data() + 1, large, largeSize, [](char* val, size_t size) { UNUSED(val); UNUSED(size); return RLBox_Verify_Status::SAFE; }));
+		ENSURE(largeOut[1 + 4096 * 5] == 5 && largeOut[largeSize] == 'x');
+
+		sandbox->freeInSandbox(large);
+		sandbox->freeInSandbox(str);
+		sandbox->freeInSandbox(buf);
+	}
+
 	void testFrozenValues()
 	{
 		tainted_freezable<int*, TSandbox> pfa = sandbox->template mallocFrozenInSandbox<int>();
@@ -709,6 +1120,8 @@ public:
 	void init(const char* runtimePath, const char* libraryPath)
 	{
 		sandbox = RLBoxSandbox<TSandbox>::createSandbox(runtimePath, libraryPath);
+		//several tests check the memory stats
+		sandbox->setMemoryAccounting(true);
 		registeredCallback = sandbox->createCallback(exampleCallback);
 		registeredCallback2 = sandbox->createCallback(exampleCallback2);
 	}
@@ -722,6 +1135,325 @@ public:
 	}
 
 
+	void testSnapshot()
+	{
+		if(!sandbox->snapshot())
+		{
+			ENSURE(!sandbox->restore());
+			return;
+		}
+
+		auto val = sandbox->template mallocInSandbox<int>();
+		*val = 5;
+		auto valPtr = val.UNSAFE_Unverified();
+		ENSURE(sandbox->snapshot());
+		*val = 6;
+		ENSURE(sandbox->restore());
+		ENSURE(*valPtr == 5);
+		sandbox->freeInSandbox(val);
+	}
+
+	void testTrimMemory()
+	{
+		auto val = sandbox->template mallocInSandbox<int>();
+		*val = 5;
+		sandbox->trimMemory();
+		ENSURE(*(val.UNSAFE_Unverified()) == 5);
+		ENSURE(sandbox->getResidentMemory() <= sandbox->getTotalMemory());
+		sandbox->freeInSandbox(val);
+
+		//where sandbox memory is separate, the pages of slab chunks holding only free objects are released
+		if(sandbox->getResidentMemory() != 0)
+		{
+			std::vector<tainted<uint64_t*, TSandbox>> objects;
+			for(uint64_t i = 0; i < 8 * 1024; i++)
+			{
+				auto obj = sandbox->template mallocSlabInSandbox<uint64_t>();
+				ENSURE(obj != nullptr);
+				*(obj.UNSAFE_Unverified()) = i + 1;
+				objects.push_back(obj);
+			}
+			//keeps the chunks alive with one object each
+			for(size_t i = 0; i < objects.size(); i++)
+			{
+				if(i % 1024 != 0)
+				{
+					sandbox->freeInSandbox(objects[i]);
+				}
+			}
+			const size_t resident = sandbox->getResidentMemory();
+			ENSURE(sandbox->trimMemory() > 0);
+			ENSURE(sandbox->getResidentMemory() < resident);
+			for(size_t i = 0; i < objects.size(); i += 1024)
+			{
+				ENSURE(*(objects[i].UNSAFE_Unverified()) == i + 1);
+				sandbox->freeInSandbox(objects[i]);
+			}
+		}
+	}
+
+	void testClone()
+	{
+		auto val = sandbox->template mallocInSandbox<int>();
+		*val = 7;
+		//as if the library saved a callback during initialization
+		auto cb = sandbox->createCallback(exampleCallback);
+		auto savedCallback = sandbox->template mallocInSandbox<CallbackType>();
+		*savedCallback = cb;
+		//clones start from the template's last snapshot, not its current memory
+		const bool snapshotted = sandbox->snapshot();
+		*val = 8;
+		auto clone = RLBoxSandbox<TSandbox>::cloneFrom(sandbox);
+		if(!clone)
+		{
+			//only backends that snapshot memory can clone it
+			ENSURE(!snapshotted);
+			sandbox->freeInSandbox(savedCallback);
+			sandbox->freeInSandbox(val);
+			return;
+		}
+
+		//the clone starts with the template's memory at the snapshot, and can use its callbacks
+		auto cloneVal = (int*) clone->getUnsandboxedPointer(sandbox->getSandboxedPointer(val.UNSAFE_Unverified()));
+		ENSURE(*cloneVal == 7);
+		auto cloneSavedCallback = sandbox_convertToUnverified<CallbackType*>(clone,
+			(CallbackType*) clone->getUnsandboxedPointer(sandbox->getSandboxedPointer(savedCallback.UNSAFE_Unverified())));
+		auto result = sandbox_invoke(clone, simpleCallbackTest, (unsigned) 4, clone->stackarr("Hello"), *cloneSavedCallback)
+			.copyAndVerify([](int val){ return val > 0 && val < 100? val : -1; });
+		ENSURE(result == 10);
+
+		clone->destroySandbox();
+		delete clone;
+		sandbox->freeInSandbox(savedCallback);
+		sandbox->freeInSandbox(val);
+	}
+
+	void testSlabAllocation()
+	{
+		auto before = sandbox->getMemoryStats();
+		auto first = sandbox->template mallocSlabInSandbox<testStruct>();
+		auto second = sandbox->template mallocSlabInSandbox<testStruct>();
+		ENSURE(first != nullptr && second != nullptr);
+		ENSURE(first.UNSAFE_Unverified() != second.UNSAFE_Unverified());
+		ENSURE(((uintptr_t) first.UNSAFE_Unverified()) % alignof(testStruct) == 0);
+		ENSURE(sandbox->isValidSandboxedPointer(sandbox->getSandboxedPointer(second.UNSAFE_Unverified()), false /* isFuncPtr */));
+		//the chunk counts against the quota, not the objects
+		ENSURE(sandbox->getMemoryStats().bytesAllocated > before.bytesAllocated + 2 * sizeof(testStruct));
+		ENSURE(sandbox->getMemoryStats().allocationCount == before.allocationCount + 2);
+
+		//freed objects are reused by the next allocation of the same size
+		auto firstPtr = first.UNSAFE_Unverified();
+		sandbox->freeInSandbox(first);
+		auto third = sandbox->template mallocSlabInSandbox<testStruct>();
+		ENSURE(third.UNSAFE_Unverified() == firstPtr);
+		third->fieldLong = 7;
+		ENSURE(sandbox->getMemoryStats().slabAllocations == before.slabAllocations + 3);
+
+		//resizing moves the object out of the chunk
+		auto moved = sandbox->reallocInSandbox(third, 2);
+		ENSURE(moved != nullptr && moved->fieldLong.UNSAFE_Unverified() == 7);
+
+		//plain allocations are separate allocations of the sandbox allocator
+		auto plain = sandbox->template mallocInSandbox<testStruct>();
+		ENSURE(sandbox->getMemoryStats().slabAllocations == before.slabAllocations + 3);
+
+		sandbox->freeInSandbox(plain);
+		sandbox->freeInSandbox(moved);
+		sandbox->freeInSandbox(second);
+		//the empty chunk is kept for reuse until a trim
+		sandbox->trimMemory();
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+		ENSURE(sandbox->getMemoryStats().allocationCount == before.allocationCount);
+	}
+
+	void testDeferredFree()
+	{
+		sandbox->setDeferredFree(true, 4 /* threshold */);
+		{
+			auto str = sandbox->heaparr("Hello");
+			auto buf = sandbox->template mallocInSandbox<char>(32);
+			sandbox->freeInSandbox(buf);
+		}
+		ENSURE(sandbox->getDeferredFreeCount() == 2);
+
+		//queued frees are released before the next call into the sandbox
+		auto result = sandbox_invoke(sandbox, simpleAddTest, 2, 3)
+			.copyAndVerify([](int val){ return val; });
+		ENSURE(result == 5);
+		ENSURE(sandbox->getDeferredFreeCount() == 0);
+
+		for(int i = 0; i < 4; i++)
+		{
+			sandbox->freeInSandbox(sandbox->template mallocInSandbox<char>(32));
+		}
+		ENSURE(sandbox->getDeferredFreeCount() == 0);
+
+		sandbox->freeInSandbox(sandbox->template mallocInSandbox<char>(32));
+		sandbox->setDeferredFree(false);
+		ENSURE(sandbox->getDeferredFreeCount() == 0);
+	}
+
+	void testAlignedAllocation()
+	{
+		auto before = sandbox->getMemoryStats();
+		auto vec = sandbox->template mallocAlignedInSandbox<int>(10, 64);
+		ENSURE(((uintptr_t) vec.UNSAFE_Unverified()) % 64 == 0);
+		*(vec + 9) = 3;
+
+		//large allocations are page aligned
+		const unsigned int largeSize = 2 * 1024 * 1024 + 100;
+		auto large = sandbox->template mallocAlignedInSandbox<char>(largeSize, 32);
+		ENSURE(((uintptr_t) large.UNSAFE_Unverified()) % 4096 == 0);
+		*large = 1;
+		*(large + (largeSize - 1)) = 2;
+		ENSURE(sandbox->getMemoryStats().bytesAllocated >= before.bytesAllocated + largeSize + 10 * sizeof(int));
+
+		sandbox->freeInSandbox(large);
+		sandbox->freeInSandbox(vec);
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+	}
+
+	void testSpan()
+	{
+		const unsigned int count = 100;
+		auto arr = sandbox->template mallocInSandbox<int>(count);
+		tainted_span<int, TSandbox> span(sandbox, arr, count);
+		ENSURE(span.size() == count && !span.empty());
+
+		for(unsigned int i = 0; i < count; i++)
+		{
+			span[i] = (int) i;
+		}
+		int sum = 0;
+		for(auto& elem : span)
+		{
+			sum += elem.UNSAFE_Unverified();
+		}
+		ENSURE(sum == (int)(count * (count - 1) / 2));
+		ENSURE((*(arr + 42)).UNSAFE_Unverified() == 42);
+
+		auto sub = span.subspan(10, 5);
+		ENSURE(sub.size() == 5);
+		ENSURE(sub[0].copyAndVerify([](int val) { return val; }) == 10);
+		ENSURE(sub.data().UNSAFE_Unverified() == arr.UNSAFE_Unverified() + 10);
+		ENSURE(span.subspan(count, 0).empty());
+
+		tainted<int*, TSandbox> nullPtr = nullptr;
+		tainted_span<int, TSandbox> emptySpan(sandbox, nullPtr, 0);
+		ENSURE(emptySpan.empty());
+		sandbox->freeInSandbox(arr);
+	}
+
+	void testVector()
+	{
+		auto before = sandbox->getMemoryStats();
+		{
+			tainted_vector<int, TSandbox> vec(sandbox);
+			for(int i = 0; i < 1000; i++)
+			{
+				ENSURE(vec.push_back(i));
+			}
+			ENSURE(vec.size() == 1000 && vec.capacity() >= 1000);
+			ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated + vec.capacity() * sizeof(int));
+			ENSURE(vec[999].copyAndVerify([](int val) { return val; }) == 999);
+
+			sandbox_invoke(sandbox, simplePointerWrite, vec.data(), 42);
+			ENSURE(vec[0].UNSAFE_Unverified() == 42);
+
+			std::vector<int> copy(vec.size());
+			ENSURE(vec.copyAndVerify(copy.data(), copy.size() * sizeof(int), [](int* arr, size_t count) {
+				return count == 1000 && arr[500] == 500? RLBox_Verify_Status::SAFE : RLBox_Verify_Status::UNSAFE;
+			}));
+			ENSURE(copy[0] == 42 && copy[999] == 999);
+			ENSURE(!vec.copyAndVerify(copy.data(), 10 * sizeof(int), [](int* arr, size_t count) { return RLBox_Verify_Status::SAFE; }));
+
+			//growth that would go over the hard quota fails and leaves the vector as it was
+			sandbox->setMemoryQuota(0, sandbox->getMemoryStats().bytesAllocated + 64);
+			ENSURE(!vec.reserve(vec.capacity() * 4));
+			ENSURE(vec.size() == 1000 && vec[999].UNSAFE_Unverified() == 999);
+			sandbox->setMemoryQuota(0, 0);
+
+			tainted_vector<int, TSandbox> moved(std::move(vec));
+			ENSURE(vec.empty() && vec.capacity() == 0);
+			ENSURE(moved.size() == 1000 && moved[1].UNSAFE_Unverified() == 1);
+			ENSURE(moved.resize(1200) && moved[1199].UNSAFE_Unverified() == 0);
+		}
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+
+		tainted_vector<char, TSandbox> str(sandbox);
+		for(const char* c = "Hello"; *c; c++)
+		{
+			str.push_back(*c);
+		}
+		str.push_back('\0');
+		auto len = sandbox_invoke(sandbox, simpleStrLenTest, str.data()).copyAndVerify([](size_t val) { return val; });
+		ENSURE(len == 5);
+
+		//growth doesn't depend on the sizes recorded by memory accounting
+		sandbox->setMemoryAccounting(false);
+		{
+			tainted_vector<int, TSandbox> untracked(sandbox);
+			for(int i = 0; i < 1000; i++)
+			{
+				ENSURE(untracked.push_back(i));
+			}
+			ENSURE(untracked[0].UNSAFE_Unverified() == 0 && untracked[999].UNSAFE_Unverified() == 999);
+			auto arr = sandbox->template mallocInSandbox<int>(4);
+			arr.UNSAFE_Unverified()[3] = 3;
+			arr = sandbox->template reallocInSandbox<int>(arr, 4, 1000);
+			ENSURE(arr != nullptr && arr.UNSAFE_Unverified()[3] == 3);
+			sandbox->freeInSandbox(arr);
+		}
+		sandbox->setMemoryAccounting(true);
+	}
+
+	void testMemoryAccounting()
+	{
+		//nothing is counted while accounting is off
+		sandbox->setMemoryAccounting(false);
+		auto untracked = sandbox->getMemoryStats();
+		auto plain = sandbox->template mallocInSandbox<int>(4);
+		ENSURE(plain != nullptr);
+		ENSURE(sandbox->getMemoryStats().allocationCount == untracked.allocationCount);
+		sandbox->freeInSandbox(plain);
+		sandbox->setMemoryAccounting(true);
+
+		auto before = sandbox->getMemoryStats();
+		auto val = sandbox->template mallocInSandbox<int>(4);
+		{
+			auto arr = sandbox->stackarr("Hello");
+			auto stats = sandbox->getMemoryStats();
+			ENSURE(stats.bytesAllocated == before.bytesAllocated + 4 * sizeof(int) + sizeof("Hello"));
+			ENSURE(stats.allocationCount == before.allocationCount + 2);
+			ENSURE(stats.peakBytesAllocated >= stats.bytesAllocated);
+		}
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated + 4 * sizeof(int));
+
+		//allocations over the hard quota fail without aborting
+		sandbox->setMemoryQuota(before.bytesAllocated + 4 * sizeof(int), before.bytesAllocated + 64);
+		auto big = sandbox->template mallocInSandbox<char>(128);
+		ENSURE(big == nullptr);
+		auto small = sandbox->template mallocInSandbox<char>(8);
+		ENSURE(small != nullptr);
+		auto stats = sandbox->getMemoryStats();
+		ENSURE(stats.failedAllocations == before.failedAllocations + 1);
+		ENSURE(stats.softQuotaExceeded == before.softQuotaExceeded + 1);
+		sandbox->setMemoryQuota(0, 0);
+
+		sandbox->freeInSandbox(small);
+		sandbox->freeInSandbox(val);
+		stats = sandbox->getMemoryStats();
+		ENSURE(stats.bytesAllocated == before.bytesAllocated);
+		ENSURE(stats.allocationCount == before.allocationCount);
+		ENSURE(stats.totalAllocations == before.totalAllocations + 3);
+
+		//the alignment padding is counted as well
+		auto aligned = sandbox->template mallocAlignedInSandbox<char>(16, 64);
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated + 16 + 64 - 1);
+		sandbox->freeInSandbox(aligned);
+		ENSURE(sandbox->getMemoryStats().bytesAllocated == before.bytesAllocated);
+	}
+
 	void runTests(bool ignoreGlobalStringsInLib)
 	{
 		testGetSandbox();
@@ -737,12 +1469,14 @@ public:
 		testAppPointer();
 		testFunctionInvocation();
 		testPointerNullChecks();
+		testInvokeStatus();
 		test64BitReturns();
 		testTwoVerificationFunctionFormats();
 		testEnumVerificationFunction();
 		testPointerVerificationFunctionFormats();
 		testStackAndHeapArrAndStringParams();
 		testCallback();
+		testCallbackCache();
 		testInternalCallback();
 		testCallbackOnStruct();
 		testEchoAndPointerLocations();
@@ -750,15 +1484,33 @@ public:
 		testFloatingPoint();
 		testPointerValAdd();
 		testStructures(ignoreGlobalStringsInLib);
+		testStructuresInto(ignoreGlobalStringsInLib);
 		testStructurePointers(ignoreGlobalStringsInLib);
+		testStructView(ignoreGlobalStringsInLib);
 		testStatefulLambdas();
+		testCapturingCallback();
+		testCallbackSlotExhaustion();
 		testAppPtrFunctionReturn();
 		testPointersInStruct();
 		test32BitPointerEdgeCases();
 		testMemset();
 		testMemcpy();
+		testMemoryFunctions();
+		testScatterGather();
+		testMapFile();
+		testSharedBlob();
+		testRingBuffer();
 		testFrozenValues();
 		testFrozenStructs();
+		testSnapshot();
+		testClone();
+		testTrimMemory();
+		testMemoryAccounting();
+		testSlabAllocation();
+		testDeferredFree();
+		testAlignedAllocation();
+		testSpan();
+		testVector();
 	}
 
 	void runBadPointersTest()
@@ -771,6 +1523,276 @@ public:
 
 
 
+void testMemorySnapshotHelpers(bool shared)
+{
+	const size_t pageSize = RLBox_SandboxMemory::getPageSize();
+	const size_t pages = 64;
+	const size_t size = pages * pageSize;
+	char* region = (char*) mmap(nullptr, size, PROT_READ | PROT_WRITE, (shared? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+	ENSURE(region != MAP_FAILED);
+	//the last pages are not yet accessible at snapshot time
+	ENSURE(mprotect(region + 48 * pageSize, 16 * pageSize, PROT_NONE) == 0);
+
+	//leave some pages untouched so that the snapshot has holes
+	for(size_t i = 0; i < 48; i += 2)
+	{
+		memset(region + i * pageSize, (int) i + 1, pageSize);
+	}
+
+	RLBox_SandboxMemory::MemorySnapshot snapshot;
+	ENSURE(snapshot.create((uintptr_t) region, size));
+
+	for(int round = 0; round < 2; round++)
+	{
+		memset(region, 0xAB, 48 * pageSize);
+		ENSURE(mprotect(region + 48 * pageSize, 16 * pageSize, PROT_READ | PROT_WRITE) == 0);
+		memset(region + 48 * pageSize, 0xCD, 16 * pageSize);
+
+		ENSURE(snapshot.restore());
+		for(size_t i = 0; i < pages; i++)
+		{
+			char expected = (i < 48 && i % 2 == 0)? (char) (i + 1) : 0;
+			ENSURE(region[i * pageSize] == expected && region[(i + 1) * pageSize - 1] == expected);
+		}
+	}
+
+	//a restored private region maps the snapshot, whose pages hold data before they are faulted in
+	{
+		RLBox_SandboxMemory::MemorySnapshot restoredSnapshot;
+		ENSURE(snapshot.restore());
+		ENSURE(restoredSnapshot.create((uintptr_t) region, size));
+		memset(region, 0xAB, 48 * pageSize);
+		ENSURE(restoredSnapshot.restore());
+		for(size_t i = 0; i < pages; i++)
+		{
+			char expected = (i < 48 && i % 2 == 0)? (char) (i + 1) : 0;
+			ENSURE(region[i * pageSize] == expected && region[(i + 1) * pageSize - 1] == expected);
+		}
+	}
+
+	char* cloneRegion = (char*) mmap(nullptr, size, PROT_READ | PROT_WRITE, (shared? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+	ENSURE(cloneRegion != MAP_FAILED);
+	RLBox_SandboxMemory::MemorySnapshot cloneSnapshot;
+	ENSURE(!snapshot.cloneInto(cloneSnapshot, (uintptr_t) cloneRegion, size - pageSize));
+	ENSURE(snapshot.cloneInto(cloneSnapshot, (uintptr_t) cloneRegion, size));
+	ENSURE(cloneSnapshot.restore());
+	ENSURE(memcmp(cloneRegion, region, 48 * pageSize) == 0);
+	munmap(cloneRegion, size);
+
+	snapshot.clear();
+	ENSURE(!snapshot.restore());
+	munmap(region, size);
+}
+
+void testMemoryTrimHelpers(bool shared)
+{
+	const size_t pageSize = RLBox_SandboxMemory::getPageSize();
+	const size_t pages = 32;
+	const size_t size = pages * pageSize;
+	char* region = (char*) mmap(nullptr, size, PROT_READ | PROT_WRITE, (shared? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+	ENSURE(region != MAP_FAILED);
+
+	memset(region, 0, size);
+	ENSURE(RLBox_SandboxMemory::getResidentMemory((uintptr_t) region, size) == size);
+
+	//only whole pages of the range are released
+	memset(region, 1, size);
+	ENSURE(RLBox_SandboxMemory::releaseUnusedPages((uintptr_t) region + 1, (uintptr_t) region + 4 * pageSize + 1) == 3 * pageSize);
+	ENSURE(region[0] == 1 && region[pageSize] == 0 && region[4 * pageSize - 1] == 0 && region[4 * pageSize] == 1);
+
+	munmap(region, size);
+}
+
+void testMemoryOptionHelpers()
+{
+	const size_t pageSize = RLBox_SandboxMemory::getPageSize();
+	const size_t size = 16 * pageSize;
+	char* region = (char*) mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ENSURE(region != MAP_FAILED);
+
+	//huge pages may be disabled on this machine, so only check that advising leaves the memory usable
+	RLBox_SandboxMemory::adviseHugePages((uintptr_t) region, size);
+	region[0] = 3;
+	RLBox_SandboxMemory::prefault((uintptr_t) region, size, 8 * pageSize);
+	ENSURE(region[0] == 3);
+	ENSURE(RLBox_SandboxMemory::getResidentMemory((uintptr_t) region, size) >= 8 * pageSize);
+	munmap(region, size);
+}
+
+template<typename T>
+void testSandboxOptions(const char* runtimePath, const char* libraryPath)
+{
+	RLBoxSandboxOptions options;
+	options.useHugePages = true;
+	options.prefaultSize = 1024 * 1024;
+	auto sandbox = RLBoxSandbox<T>::createSandbox(runtimePath, libraryPath, options);
+	auto ret = sandbox_invoke(sandbox, simpleAddTest, 2, 3);
+	ENSURE(ret.UNSAFE_Unverified() == 5);
+	ENSURE(sandbox->getOptions().prefaultSize == options.prefaultSize);
+	//the advice is applied again to the memory a restore maps in
+	if(sandbox->snapshot())
+	{
+		ENSURE(sandbox->restore());
+	}
+
+	auto clone = RLBoxSandbox<T>::cloneFrom(sandbox);
+	if(clone)
+	{
+		ENSURE(clone->getOptions().useHugePages && clone->usesHugePages() == sandbox->usesHugePages());
+		clone->destroySandbox();
+		delete clone;
+	}
+	sandbox->destroySandbox();
+	delete sandbox;
+
+	auto asyncSandbox = RLBoxSandbox<T>::createSandboxAsync(runtimePath, libraryPath, options).get();
+	ENSURE(asyncSandbox->getOptions().useHugePages);
+	asyncSandbox->destroySandbox();
+	delete asyncSandbox;
+
+	RLBoxSandboxPool<T> pool(runtimePath, libraryPath, 1 /* minSize */, 1 /* maxSize */, std::chrono::milliseconds(0), nullptr, options);
+	ENSURE(pool.checkout()->getOptions().useHugePages);
+}
+
+template<typename T>
+void testSandboxPool(const char* runtimePath, const char* libraryPath)
+{
+	int initCount = 0;
+	RLBoxSandboxPool<T> pool(runtimePath, libraryPath, 1 /* minSize */, 2 /* maxSize */, std::chrono::milliseconds(0), [&initCount](RLBoxSandbox<T>* sandbox) {
+		initCount++;
+	});
+	ENSURE(initCount == 1);
+
+	RLBoxSandbox<T>* firstSandbox;
+	{
+		auto lease = pool.checkout();
+		firstSandbox = lease.get();
+		auto ret = sandbox_invoke(lease.get(), simpleAddTest, 2, 3);
+		ENSURE(ret.UNSAFE_Unverified() == 5);
+
+		int val = 4;
+		lease->app_ptr(&val);
+		ENSURE(lease->getMaintainAppPtrMap()->size() == 1);
+
+		auto lease2 = pool.checkout();
+		ENSURE(lease2.get() != firstSandbox);
+		ENSURE(initCount == 2);
+		//the idle timeout is 0, so the pool shrinks back to minSize right away
+		lease2.release();
+
+		//left registered on purpose, the pool should drop it on return
+		auto callback = lease->createCallback(SandboxTests<T>::exampleCallback2);
+		lease.release();
+	}
+
+	auto stats = pool.getStats();
+	ENSURE(stats.checkouts == 2 && stats.hits == 1 && stats.misses == 1);
+	ENSURE(stats.totalCount == 1 && stats.idleCount == 1 && stats.destroyed == 1);
+
+	{
+		auto lease = pool.checkout();
+		ENSURE(lease.get() == firstSandbox);
+		ENSURE(lease->getMaintainAppPtrMap()->empty());
+		auto callback = lease->createCallback(SandboxTests<T>::exampleCallback2);
+		auto ret = sandbox_invoke(lease.get(), simpleCallbackTest2, 4, callback);
+		ENSURE(ret.UNSAFE_Unverified() == 11);
+	}
+	ENSURE(pool.getStats().hits == 2);
+
+	pool.trimIdle();
+	ENSURE(pool.getStats().idleCount == 1);
+	ENSURE(pool.checkout().get() == firstSandbox);
+
+	{
+		auto lease = pool.checkout();
+		auto lease2 = pool.checkout();
+		auto callbackSandbox = lease2.get();
+		auto callback = lease2->createCallback(SandboxTests<T>::exampleCallback2);
+		lease2.release();
+		//the callback helper outlived its lease, so its sandbox is kept and the other one is evicted instead
+		lease.release();
+		stats = pool.getStats();
+		ENSURE(stats.totalCount == 1 && stats.idleCount == 1);
+		ENSURE(callbackSandbox->getCallbackHelperCount() == 1);
+		callback.unregister();
+		ENSURE(pool.checkout().get() == callbackSandbox);
+	}
+}
+
+template<typename T>
+void testSandboxReaper(const char* runtimePath, const char* libraryPath)
+{
+	const int sandboxCount = 3;
+	std::vector<std::future<RLBoxSandbox<T>*>> pending;
+	for(int i = 0; i < sandboxCount; i++)
+	{
+		pending.push_back(RLBoxSandbox<T>::createSandboxAsync(runtimePath, libraryPath));
+	}
+
+	RLBoxSandboxReaper reaper(1 /* maxQueueLength */);
+	for(auto& future : pending)
+	{
+		auto sandbox = future.get();
+		auto ret = sandbox_invoke(sandbox, simpleAddTest, 2, 3);
+		ENSURE(ret.UNSAFE_Unverified() == 5);
+		sandbox->destroySandboxAsync(reaper);
+	}
+	reaper.drain();
+
+	auto stats = reaper.getStats();
+	ENSURE(stats.queued == sandboxCount && stats.completed == sandboxCount);
+	ENSURE(stats.queueLength == 0 && stats.maxQueueLength == 1);
+}
+
+//Kills the sandbox process in the middle of an invoke, so only runs on backends that restart the sandbox
+template<typename T>
+void testSandboxRestart(const char* runtimePath, const char* libraryPath)
+{
+	auto sandbox = RLBoxSandbox<T>::createSandbox(runtimePath, libraryPath);
+	auto otherSandbox = RLBoxSandbox<T>::createSandbox(runtimePath, libraryPath);
+	sandbox_invoke(otherSandbox, simpleAddTest, 2, 3);
+	ENSURE(otherSandbox->getLastInvokeStatus() == RLBox_Invoke_Status::SUCCESS);
+
+	{
+		//helpers holding memory of the crashed process give it up instead of freeing it into the replacement
+		char buffer[16] = "Hello";
+		auto arr = sandbox->heaparr("Hello");
+		auto scatter = sandbox->scatterarr(sandbox_iov_inout(buffer, sizeof(buffer)));
+		tainted_vector<int, T> vec(sandbox);
+		ENSURE(vec.push_back(1));
+
+		//without a warm spare, the replacement process is started on demand
+		auto crashRet = sandbox_invoke(sandbox, simpleCrashTest, 1);
+		ENSURE(sandbox->getLastInvokeStatus() == RLBox_Invoke_Status::SANDBOX_DIED);
+		ENSURE(crashRet.UNSAFE_Unverified() == 0);
+		ENSURE(sandbox->getRestartStats().restarts == 1);
+		//the status is per sandbox
+		ENSURE(otherSandbox->getLastInvokeStatus() == RLBox_Invoke_Status::SUCCESS);
+
+		ENSURE(!scatter.gather([](size_t, void*, size_t) { return RLBox_Verify_Status::SAFE; }));
+		ENSURE(vec.push_back(2));
+		ENSURE(vec.size() == 1 && vec[0].UNSAFE_Unverified() == 2);
+	}
+
+	auto ret = sandbox_invoke(sandbox, simpleAddTest, 2, 3);
+	ENSURE(sandbox->getLastInvokeStatus() == RLBox_Invoke_Status::SUCCESS);
+	ENSURE(ret.UNSAFE_Unverified() == 5);
+
+	sandbox->setWarmSpare(true);
+	sandbox_invoke(sandbox, simpleCrashTest, 1);
+	ENSURE(sandbox->getLastInvokeStatus() == RLBox_Invoke_Status::SANDBOX_DIED);
+	ENSURE(sandbox->getRestartStats().restarts == 2);
+	ret = sandbox_invoke(sandbox, simpleAddTest, 4, 5);
+	ENSURE(sandbox->getLastInvokeStatus() == RLBox_Invoke_Status::SUCCESS);
+	ENSURE(ret.UNSAFE_Unverified() == 9);
+	sandbox->setWarmSpare(false);
+
+	otherSandbox->destroySandbox();
+	delete otherSandbox;
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
 template<typename T>
 void runTests(const char* runtimePath, const char* libraryPath, bool shouldRunBadPointersTest, bool shouldRunThreadingTests, bool ignoreGlobalStringsInLib)
 {
@@ -787,6 +1809,10 @@ void runTests(const char* runtimePath, const char* libraryPath, bool shouldRunBa
 		sandbox.finish();
 	}
 
+	testSandboxPool<T>(runtimePath, libraryPath);
+	testSandboxReaper<T>(runtimePath, libraryPath);
+	testSandboxOptions<T>(runtimePath, libraryPath);
+
 	using voidPVoidPFunction = void* (*)(void*);
 	voidPVoidPFunction testInvoker;
 	if (ignoreGlobalStringsInLib) {
@@ -876,8 +1902,72 @@ void runTests(const char* runtimePath, const char* libraryPath, bool shouldRunBa
 	}
 }
 
+class CopyCountingArg
+{
+public:
+	static int copies;
+	static int moves;
+	int value;
+
+	CopyCountingArg(int value) : value(value) {}
+	CopyCountingArg(const CopyCountingArg& other) : value(other.value) { copies++; }
+	CopyCountingArg(CopyCountingArg&& other) : value(other.value) { moves++; }
+};
+
+int CopyCountingArg::copies = 0;
+int CopyCountingArg::moves = 0;
+
+//A wrapper whose unwrapped value is a class type, so that we can see how often the invoke path copies it
+template<typename T, typename TSandbox>
+class copy_counting_wrapper : public sandbox_wrapper_base, public sandbox_wrapper_base_of<T>
+{
+public:
+	int value;
+
+	copy_counting_wrapper(int value) : value(value) {}
+	inline T UNSAFE_Sandboxed(RLBoxSandbox<TSandbox>* sandbox) const { return T(value); }
+	inline T UNSAFE_Unverified() const { return T(value); }
+};
+
+int addCopyCountingArg(CopyCountingArg a, int b)
+{
+	return a.value + b;
+}
+
+void testInvokeForwarding()
+{
+	auto sandbox = RLBoxSandbox<RLBox_MyApp>::createSandbox("", "");
+
+	//the unwrapped argument is moved into the callee's parameter once, and never copied
+	copy_counting_wrapper<CopyCountingArg, RLBox_MyApp> arg(2);
+	int b = 3;
+	auto result = sandbox_invoke_with_fnptr(sandbox, addCopyCountingArg, arg, b)
+		.copyAndVerify([](int val){ return val; });
+	ENSURE(result == 5);
+	ENSURE(CopyCountingArg::copies == 0);
+	ENSURE(CopyCountingArg::moves <= 1);
+
+	CopyCountingArg::moves = 0;
+	result = sandbox_invoke_with_fnptr(sandbox, addCopyCountingArg, copy_counting_wrapper<CopyCountingArg, RLBox_MyApp>(4), 5)
+		.copyAndVerify([](int val){ return val; });
+	ENSURE(result == 9);
+	ENSURE(CopyCountingArg::copies == 0);
+	ENSURE(CopyCountingArg::moves <= 1);
+
+	sandbox->destroySandbox();
+	delete sandbox;
+}
+
 int main(int argc, char const *argv[])
 {
+	printf("Testing sandbox memory snapshots\n");
+	testMemorySnapshotHelpers(false /* shared */);
+	testMemorySnapshotHelpers(true /* shared */);
+	testMemoryTrimHelpers(false /* shared */);
+	testMemoryTrimHelpers(true /* shared */);
+	testMemoryOptionHelpers();
+	testInvokeForwarding();
+
 	printf("Testing calls within my app - i.e. no sandbox\n");
 	//the RLBox_MyApp doesn't mask bad pointers, so can't test with 'runBadPointersTest'
 	runTests<RLBox_MyApp>("", "", false, false, false);
@@ -896,6 +1986,14 @@ int main(int argc, char const *argv[])
 		"../../../ProcessSandbox/ProcessSandbox_otherside_rlboxtest64"
 		#endif
 		, false, false, true);
+		testSandboxRestart<RLBox_Process<RLBoxTestProcessSandbox>>(
+		"",
+		#if defined(_M_IX86) || defined(__i386__)
+		"../../../ProcessSandbox/ProcessSandbox_otherside_rlboxtest32"
+		#else
+		"../../../ProcessSandbox/ProcessSandbox_otherside_rlboxtest64"
+		#endif
+		);
 	#endif
 
 	#ifndef NO_NACL